@@ -22,6 +22,10 @@
 **/
 #include <math.h>
 #include <algorithm>
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <thread>
 #include "NuXPixels.h"
 #include "NuXPixelsImpl.h"
 #if (NUXPIXELS_SIMD)
@@ -342,6 +346,141 @@ Vertex AffineTransformation::transform(const Vertex& xy) const
 			, xy.x * matrix[1][0] + xy.y * matrix[1][1] + matrix[1][2]);
 }
 
+/* --- ThreadPool --- */
+
+/**
+	Everything is guarded by `mutex` except the jobs themselves. Each call to run() is a new `generation` so that
+	workers can tell a new batch from the one they just finished. run() returns once every job has been taken and no
+	job is still running.
+**/
+class ThreadPool::Impl {
+	public:		Impl(int threadCount);
+	public:		void work(std::unique_lock<std::mutex>& lock);
+	public:		void workerLoop();
+	public:		int threadCount;
+	public:		std::vector<std::thread> workers;
+	public:		std::mutex mutex;
+	public:		std::condition_variable wake;
+	public:		std::condition_variable done;
+	public:		unsigned int generation;
+	public:		bool quit;
+	public:		Job job;
+	public:		void* data;
+	public:		int jobCount;
+	public:		int nextJob;
+	public:		int runningCount;
+	public:		std::exception_ptr error;
+};
+
+ThreadPool::Impl::Impl(int threadCount)
+	: threadCount(threadCount), generation(0), quit(false), job(0), data(0), jobCount(0), nextJob(0), runningCount(0)
+{
+}
+
+void ThreadPool::Impl::work(std::unique_lock<std::mutex>& lock)
+{
+	while (nextJob < jobCount) {
+		const int index = nextJob++;
+		const Job currentJob = job;
+		void* const currentData = data;
+		++runningCount;
+		lock.unlock();
+		std::exception_ptr caught;
+		try {
+			currentJob(currentData, index);
+		}
+		catch (...) {
+			caught = std::current_exception();
+		}
+		lock.lock();
+		if (caught) {
+			if (!error) {
+				error = caught;
+			}
+			nextJob = jobCount;
+		}
+		--runningCount;
+	}
+	if (runningCount == 0) {
+		done.notify_all();
+	}
+}
+
+void ThreadPool::Impl::workerLoop()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	unsigned int seenGeneration = generation;
+	while (true) {
+		while (!quit && generation == seenGeneration) {
+			wake.wait(lock);
+		}
+		if (quit) {
+			return;
+		}
+		seenGeneration = generation;
+		work(lock);
+	}
+}
+
+ThreadPool::ThreadPool(int threadCount) : impl(0)
+{
+	if (threadCount <= 0) {
+		threadCount = maxValue(static_cast<int>(std::thread::hardware_concurrency()), 1);
+	}
+	impl = new Impl(threadCount);
+	try {
+		for (int i = 1; i < threadCount; ++i) {
+			impl->workers.push_back(std::thread(&Impl::workerLoop, impl));
+		}
+	}
+	catch (...) {
+		impl->threadCount = static_cast<int>(impl->workers.size()) + 1;	// settle for the threads we got
+	}
+}
+
+int ThreadPool::getThreadCount() const { return impl->threadCount; }
+
+void ThreadPool::run(int jobCount, Job job, void* data)
+{
+	if (impl->workers.empty()) {
+		for (int i = 0; i < jobCount; ++i) {
+			job(data, i);
+		}
+		return;
+	}
+	std::unique_lock<std::mutex> lock(impl->mutex);
+	impl->job = job;
+	impl->data = data;
+	impl->jobCount = jobCount;
+	impl->nextJob = 0;
+	impl->error = std::exception_ptr();
+	++impl->generation;
+	impl->wake.notify_all();
+	impl->work(lock);
+	while (impl->nextJob < impl->jobCount || impl->runningCount > 0) {
+		impl->done.wait(lock);
+	}
+	std::exception_ptr error = impl->error;
+	impl->error = std::exception_ptr();
+	lock.unlock();
+	if (error) {
+		std::rethrow_exception(error);
+	}
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(impl->mutex);
+		impl->quit = true;
+	}
+	impl->wake.notify_all();
+	for (size_t i = 0; i < impl->workers.size(); ++i) {
+		impl->workers[i].join();
+	}
+	delete impl;
+}
+
 /* --- Path --- */
 
 Rect<double> Path::calcFloatBounds() const {
@@ -716,13 +855,23 @@ static void strokeOneSide(Path& stroked, double direction, const StrokeSegment*
 }
 
 Path& Path::stroke(double width, EndCapStyle endCaps, JointStyle joints, double miterLimit, double curveQuality) {
+	Path stroked;
+	strokeTo(stroked, width, endCaps, joints, miterLimit, curveQuality);
+	instructions.swap(stroked.instructions);
+	openIndex = stroked.openIndex;
+	return *this;
+}
+
+void Path::strokeTo(Path& stroked, double width, EndCapStyle endCaps, JointStyle joints, double miterLimit
+		, double curveQuality) const {
+	assert(&stroked != this);
 	assert(0.0 <= width);
 	assert(BUTT <= endCaps && endCaps <= SQUARE);
 	assert(BEVEL <= joints && joints <= MITER);
 	assert(1.0 <= miterLimit);
 	assert(0.0 < curveQuality);
 	
-	Path stroked;
+	stroked.clear();
 	stroked.instructions.reserve(instructions.size() * 3);
 	width = maxValue(width, EPSILON);
 
@@ -804,10 +953,6 @@ Path& Path::stroke(double width, EndCapStyle endCaps, JointStyle joints, double
 		stroked.instructions.back().first = CLOSE;				// Close first output path, begin a new one.
 		stroked.instructions[firstVertexIndex] = Instruction(MOVE, stroked.getPosition());
 	}
-
-	instructions.swap(stroked.instructions);
-	openIndex = stroked.openIndex;
-	return *this;
 }
 
 Path& Path::dash(double dashLength, double gapLength, double dashOffset) {
@@ -878,6 +1023,16 @@ Path& Path::dash(double dashLength, double gapLength, double dashOffset) {
 }
 
 Path& Path::closeAll() {
+	// Nothing to do (and nothing to allocate) if every sub-path already ends with CLOSE.
+	bool allClosed = (instructions.empty() || instructions.back().first == CLOSE);
+	for (const_iterator it = instructions.begin(), e = instructions.end(); allClosed && it != e; ++it) {
+		allClosed = (it->first != MOVE || it == instructions.begin() || (it - 1)->first != LINE);
+	}
+	if (allClosed) {
+		openIndex = instructions.size() - 1;
+		return *this;
+	}
+
 	InstructionsVector closed;
 	
 	Vertex openCoordinates(0.0, 0.0);
@@ -905,6 +1060,87 @@ Path& Path::transform(const AffineTransformation& transformation) {
 	return *this;
 }
 
+static Vertex clampVertex(const Vertex& v, const Rect<double>& rect) {
+	return Vertex(minValue(maxValue(v.x, rect.left), rect.calcRight()), minValue(maxValue(v.y, rect.top), rect.calcBottom()));
+}
+
+/*
+	Clamping every point of the path to the rect (not just the vertices) preserves the winding number of every point
+	inside it: a horizontal ray from an inside point crosses a clamped edge exactly where it crossed the original. An
+	edge is mapped to a polyline with corners where it crosses the rect's border lines, so edges are split there
+	first. Consecutive points on the same border line are merged as they are just a vertical or horizontal edge.
+*/
+Path& Path::clampToRect(const Rect<double>& rect) {
+	const double left = rect.left;
+	const double top = rect.top;
+	const double right = rect.calcRight();
+	const double bottom = rect.calcBottom();
+	InstructionsVector clamped;
+	clamped.reserve(instructions.size() + 8);
+	size_type runStart = 0;	// index of first clamped instruction of the current straight run along a border
+	Vertex lv(0.0, 0.0);
+	for (const_iterator it = instructions.begin(), e = instructions.end(); it != e; ++it) {
+		const Vertex v = it->second;
+		if (!isfinite(v.x) || !isfinite(v.y) || !isfinite(lv.x) || !isfinite(lv.y)) {
+			clamped.push_back(*it);
+			runStart = clamped.size();
+			lv = v;
+			continue;
+		}
+		if (it->first == MOVE) {
+			clamped.push_back(Instruction(MOVE, clampVertex(v, rect)));
+			runStart = clamped.size();
+			lv = v;
+			continue;
+		}
+		double splits[4];
+		int splitCount = 0;
+		const double dx = v.x - lv.x;
+		const double dy = v.y - lv.y;
+		const double lines[4] = { left, right, top, bottom };
+		for (int i = 0; i < 4; ++i) {
+			const double d = (i < 2 ? dx : dy);
+			if (d != 0.0) {
+				const double t = (lines[i] - (i < 2 ? lv.x : lv.y)) / d;
+				if (t > 0.0 && t < 1.0) {
+					int j = splitCount++;
+					for (; j > 0 && splits[j - 1] > t; --j) {
+						splits[j] = splits[j - 1];
+					}
+					splits[j] = t;
+				}
+			}
+		}
+		for (int i = 0; i <= splitCount; ++i) {
+			const Vertex p = clampVertex(i < splitCount ? Vertex(lv.x + dx * splits[i], lv.y + dy * splits[i]) : v, rect);
+			const Operation op = (i < splitCount ? LINE : it->first);
+			const size_type n = clamped.size();
+			if (n >= runStart + 2 && clamped[n - 1].first == LINE
+					&& (((p.x == left || p.x == right) && clamped[n - 1].second.x == p.x && clamped[n - 2].second.x == p.x)
+					|| ((p.y == top || p.y == bottom) && clamped[n - 1].second.y == p.y && clamped[n - 2].second.y == p.y))) {
+				clamped[n - 1] = Instruction(op, p);
+			} else if (n > 0 && op == LINE && clamped[n - 1].second == p) {
+				continue;
+			} else {
+				clamped.push_back(Instruction(op, p));
+			}
+			if (op == CLOSE) {
+				runStart = clamped.size();
+			}
+		}
+		lv = v;
+	}
+	instructions.swap(clamped);
+	openIndex = static_cast<size_type>(-1);
+	for (size_type i = instructions.size(); i > 0; --i) {
+		if (instructions[i - 1].first == MOVE) {
+			openIndex = i - 1;
+			break;
+		}
+	}
+	return *this;
+}
+
 /* --- GammaTable --- */
 
 GammaTable::GammaTable(double gamma)
@@ -985,6 +1221,15 @@ void LinearAscend::render(int x, int y, int length, SpanBuffer<Mask8>& output) c
 
 Mask8::Pixel RadialAscend::sqrtTable[1 << RADIAL_SQRT_BITS];
 
+static bool initRadialSqrtTable(Mask8::Pixel* table) {
+	for (int i = 0; i < (1 << RADIAL_SQRT_BITS); ++i) {
+		// Notice: output is 255 at the center so that we'll have full transparency surroundings.
+		// The entire table is therefore inversed.
+		table[i] = 255 - roundToInt(sqrt(double(i) / ((1 << RADIAL_SQRT_BITS) - 1)) * 255);
+	}
+	return true;
+}
+
 RadialAscend::RadialAscend(double centerX, double centerY, double width, double height)
 	: centerX(centerX)
 	, centerY(centerY)
@@ -994,13 +1239,8 @@ RadialAscend::RadialAscend(double centerX, double centerY, double width, double
 	, wk((1U << 30) / (width * width))
 {
 	assert(width != 0.0 && height != 0.0);
-	if (sqrtTable[0] == 0) { // sqrtTable[0] should be 255 when initialized.
-		{ for (int i = 0; i < (1 << RADIAL_SQRT_BITS); ++i) {
-			// Notice: output is 255 at the center so that we'll have full transparency surroundings.
-			// The entire table is therefore inversed.
-			sqrtTable[i] = 255 - roundToInt(sqrt(double(i) / ((1 << RADIAL_SQRT_BITS) - 1)) * 255);
-		} }
-	}
+	static const bool sqrtTableInitialized = initRadialSqrtTable(sqrtTable); // thread-safe one-time initialization
+	(void)sqrtTableInitialized;
 }
 
 IntRect RadialAscend::calcBounds() const
@@ -1155,9 +1395,33 @@ struct PolygonMask::Segment::Order {
 
 bool PolygonMask::isValid() const { return valid; }
 
-PolygonMask::PolygonMask(const Path& path, const IntRect& clipBounds, const FillRule& fillRule)
+bool PolygonMask::isValidPath(const Path& path) {
+	const double vertexLimit = static_cast<double>(0x7FFFFFFF >> POLYGON_FRACTION_BITS);
+	for (Path::const_iterator it = path.begin(); it != path.end(); ++it) {
+		const double x = it->second.x;
+		const double y = it->second.y;
+		if (!isfinite(x) || !isfinite(y) || fabs(x) > vertexLimit || fabs(y) > vertexLimit) {
+			return false;
+		}
+	}
+	return true;
+}
+
+size_t PolygonMask::calcSegmentBytes(const Path& path) {
+	// Each segment is also listed in segsVertically and segsHorizontally.
+	return (path.size() + 1) * (sizeof (Segment) + 2 * sizeof (Segment*));
+}
+
+PolygonMask::PolygonMask(const Path& path, const IntRect& clipBounds, const FillRule& fillRule, Workspace* workspace
+		, bool antialiased)
 	: segments(), fillRule(fillRule), row(0), engagedStart(0), engagedEnd(0), coverageDelta(), valid(true)
+	, antialiased(antialiased), workspace(workspace)
 {
+	if (workspace != 0) {
+		swapWorkspace();
+		segments.clear();
+	}
+
 	// Clamp the clip rectangle to the numeric limits handled by the rasterizer.
 	IntRect cb = clipBounds;
 	assert(0 <= cb.width && 0 <= cb.height);
@@ -1280,6 +1544,19 @@ PolygonMask::PolygonMask(const Path& path, const IntRect& clipBounds, const Fill
 	rewind();
 }
 
+PolygonMask::~PolygonMask() {
+	if (workspace != 0) {
+		swapWorkspace();
+	}
+}
+
+void PolygonMask::swapWorkspace() {
+	segments.swap(workspace->segments);
+	coverageDelta.swap(workspace->coverageDelta);
+	segsVertically.swap(workspace->segsVertically);
+	segsHorizontally.swap(workspace->segsHorizontally);
+}
+
 void PolygonMask::rewind() const {
 	assert(valid);
 	if (!valid) return;
@@ -1416,6 +1693,24 @@ void PolygonMask::render(int x, int y, int length, SpanBuffer<Mask8>& output) co
 			// Swap out directly from vertical list.
 			std::swap(segsVertically[integrateIndex], segsVertically[drawIndex]);
 			++integrateIndex;
+		} else if (!antialiased) {
+			// Aliased: an edge crossing the center line of this row covers every pixel with its center to the right of
+			// it. Left and right edge are the same column, so the integration below outputs solid spans only.
+			const int centerY = rowFixed + (FRACT_ONE >> 1);
+			int col;
+			if (seg->topY <= centerY && centerY < seg->bottomY) {
+				const int centerX = high32(add(seg->x, multiply(static_cast<UInt32>(centerY - seg->currentY), seg->dx)));
+				col = ((centerX + (FRACT_ONE >> 1)) >> FRACT_BITS) - x;
+				if (col < length) {
+					coverageDelta[maxValue(col, 0)] += (seg->coverageByX < 0)
+							? -(1 << (COVERAGE_BITS + FRACT_BITS)) : (1 << (COVERAGE_BITS + FRACT_BITS));
+				}
+			} else {
+				col = (high32(seg->x) >> FRACT_BITS) - x;
+			}
+			col = maxValue(minValue(col, length), 0);
+			seg->leftEdge = col;
+			seg->rightEdge = col;
 		} else {
 			const int coverageByX = seg->coverageByX;
 			int remaining;	// Signed total area this segment contributes in THIS row (fixed-point; sign follows winding)
@@ -1576,6 +1871,354 @@ void PolygonMask::render(int x, int y, int length, SpanBuffer<Mask8>& output) co
 NonZeroFillRule PolygonMask::nonZeroFillRule;
 EvenOddFillRule PolygonMask::evenOddFillRule;
 
+/* --- RectMask --- */
+
+/*
+	Walks the path exactly like the PolygonMask constructor (same rounding, same edges) and succeeds if the only
+	non-horizontal edges are two opposite vertical edges spanning the full height of the path's bounds.
+*/
+static bool findFixedRect(const Path& path, int& left, int& top, int& right, int& bottom)
+{
+	const double vertexLimit = static_cast<double>(0x7FFFFFFF >> POLYGON_FRACTION_BITS);
+	int edgeX[2] = { 0, 0 };
+	int edgeTop[2] = { 0, 0 };
+	int edgeBottom[2] = { 0, 0 };
+	bool edgeDown[2] = { false, false };
+	int edgeCount = 0;
+	int minY = 0x3FFFFFFF;
+	int minX = 0x3FFFFFFF;
+	int maxY = -0x3FFFFFFF;
+	int maxX = -0x3FFFFFFF;
+	int lx = 0;
+	int ly = 0;
+	for (Path::const_iterator it = path.begin(), e = path.end(); it != e; ++it) {
+		const double x = it->second.x;
+		const double y = it->second.y;
+		if (!isfinite(x) || !isfinite(y) || fabs(x) > vertexLimit || fabs(y) > vertexLimit) {
+			return false;
+		}
+		const int x1 = roundToInt(x * FRACT_ONE);
+		const int y1 = roundToInt(y * FRACT_ONE);
+		if (it->first != Path::MOVE) {
+			if (y1 != ly) {
+				if (x1 != lx || edgeCount == 2) {
+					return false;
+				}
+				edgeX[edgeCount] = x1;
+				edgeTop[edgeCount] = minValue(ly, y1);
+				edgeBottom[edgeCount] = maxValue(ly, y1);
+				edgeDown[edgeCount] = (ly < y1);
+				++edgeCount;
+			}
+			minX = minValue(minX, minValue(lx, x1));
+			maxX = maxValue(maxX, maxValue(lx, x1));
+			minY = minValue(minY, minValue(ly, y1));
+			maxY = maxValue(maxY, maxValue(ly, y1));
+		}
+		lx = x1;
+		ly = y1;
+	}
+	if (edgeCount != 2 || edgeDown[0] == edgeDown[1] || edgeTop[0] != edgeTop[1] || edgeBottom[0] != edgeBottom[1]) {
+		return false;
+	}
+	left = minValue(edgeX[0], edgeX[1]);
+	right = maxValue(edgeX[0], edgeX[1]);
+	top = edgeTop[0];
+	bottom = edgeBottom[0];
+	return (left != right && left == minX && right == maxX && top == minY && bottom == maxY);
+}
+
+bool RectMask::isRect(const Path& path)
+{
+	int left;
+	int top;
+	int right;
+	int bottom;
+	return findFixedRect(path, left, top, right, bottom);
+}
+
+RectMask::RectMask(const Path& path, const IntRect& clipBounds)
+	: left(0), top(0), right(0), bottom(0)
+{
+	const bool found = findFixedRect(path, left, top, right, bottom);
+	(void)found;
+	assert(found);
+
+	// Clamp the clip rectangle like PolygonMask does.
+	IntRect cb = clipBounds;
+	assert(0 <= cb.width && 0 <= cb.height);
+	const int limit = (0x7FFFFFFF >> FRACT_BITS);
+	cb.left = maxValue(-limit, minValue(cb.left, limit));
+	cb.top = maxValue(-limit, minValue(cb.top, limit));
+	int rightBound = maxValue(-limit, minValue(cb.calcRight(), limit));
+	int bottomBound = maxValue(-limit, minValue(cb.calcBottom(), limit));
+	cb.width = maxValue(0, rightBound - cb.left);
+	cb.height = maxValue(0, bottomBound - cb.top);
+
+	bounds.left = left >> FRACT_BITS;
+	bounds.top = top >> FRACT_BITS;
+	bounds.width = ((right + FRACT_MASK) >> FRACT_BITS) - bounds.left;
+	bounds.height = ((bottom + FRACT_MASK) >> FRACT_BITS) - bounds.top;
+	bounds = bounds.calcIntersection(cb);
+}
+
+IntRect RectMask::calcBounds() const
+{
+	return bounds;
+}
+
+/*
+	A vertical edge deposits (1 - sub) * rowCoverage in its own column and the full row coverage after it, so the
+	left edge column gets (1 - leftSub), the columns between the edges get all and the right edge column gets
+	rightSub (or rightSub - leftSub when both edges share a column). Since rowCoverage is a whole number of subpixel
+	rows no precision is lost and the results match PolygonMask for either winding direction.
+*/
+void RectMask::render(int x, int y, int length, SpanBuffer<Mask8>& output) const
+{
+	assert(0 < length && length <= MAX_RENDER_LENGTH);
+	const int rowFixed = y << FRACT_BITS;
+	const int clipLeft = maxValue(x, bounds.left);
+	const int clipRight = minValue(x + length, bounds.calcRight());
+	if (y < bounds.top || y >= bounds.calcBottom() || clipLeft >= clipRight) {
+		output.addTransparent(length);
+		return;
+	}
+	const int dy = minValue(bottom - rowFixed, FRACT_ONE) - maxValue(top - rowFixed, 0);
+	assert(dy > 0);
+	const int leftCol = left >> FRACT_BITS;
+	const int rightCol = right >> FRACT_BITS;
+	const int leftSub = left & FRACT_MASK;
+	const int rightSub = right & FRACT_MASK;
+	
+	int ends[4];
+	Mask8::Pixel pixels[4];
+	int count = 0;
+	if (leftCol == rightCol) {
+		ends[count] = leftCol + 1;
+		pixels[count++] = static_cast<Mask8::Pixel>(minValue(((rightSub - leftSub) * dy) >> FRACT_BITS, 0xFF));
+	} else {
+		ends[count] = leftCol + 1;
+		pixels[count++] = static_cast<Mask8::Pixel>(minValue(((FRACT_ONE - leftSub) * dy) >> FRACT_BITS, 0xFF));
+		ends[count] = rightCol;
+		pixels[count++] = static_cast<Mask8::Pixel>(minValue(dy, 0xFF));
+		ends[count] = rightCol + 1;
+		pixels[count++] = static_cast<Mask8::Pixel>(minValue((rightSub * dy) >> FRACT_BITS, 0xFF));
+	}
+	ends[count] = 0x7FFFFFFF;
+	pixels[count++] = 0;
+	
+	int col = minValue(maxValue(leftCol, clipLeft), clipRight);
+	if (col > x) {
+		output.addTransparent(col - x);
+	}
+	for (int i = 0; i < count && col < clipRight; ++i) {
+		const int end = minValue(ends[i], clipRight);
+		if (end > col) {
+			if (pixels[i] == 0) {
+				output.addTransparent(end - col);
+			} else {
+				output.addSolid(end - col, pixels[i]);
+			}
+			col = end;
+		}
+	}
+	if (x + length > col) {
+		output.addTransparent(x + length - col);
+	}
+}
+
+/* --- RoundedRectMask --- */
+
+// Integral of sqrt(1 - t^2) from 0 to u (0 <= u <= 1).
+static double calcQuarterCirclePrimitive(double u)
+{
+	return 0.5 * (u * sqrt(maxValue(1.0 - u * u, 0.0)) + asin(u));
+}
+
+/*
+	Corner ellipse areas for one row band, in normalized quadrant coordinates (u and v are distances from the
+	ellipse center divided by the radii). calcArea(a, b) is the area of {0 <= u <= a, 0 <= v <= b, u^2 + v^2 <= 1}:
+	left of where the circle crosses v = b it is a rectangle, right of it the area under the circle. Since b is one of
+	the two band edges, the crossing terms are computed once per row and the last two columns are remembered since
+	neighbouring pixels share one.
+*/
+struct QuarterDiscRow {
+	void init(double b0, double b1) {
+		lastIndex = 0;
+		lastA[0] = -1.0;
+		lastA[1] = -1.0;
+		b[0] = b0;
+		b[1] = b1;
+		for (int i = 0; i < 2; ++i) {
+			crossing[i] = sqrt(maxValue(1.0 - b[i] * b[i], 0.0));
+			crossingPrimitive[i] = calcQuarterCirclePrimitive(crossing[i]);
+		}
+	}
+	double calcArea(double a, int i) const {
+		return (a <= crossing[i] ? a * b[i] : b[i] * crossing[i] + calcQuarterCirclePrimitive(a) - crossingPrimitive[i]);
+	}
+	void calcAreas(double a, double& area0, double& area1) {
+		int i = 0;
+		if (a != lastA[i] && a != lastA[i = 1]) {
+			i = lastIndex;
+			lastIndex ^= 1;
+			lastA[i] = a;
+			lastAreas[i][0] = calcArea(a, 0);
+			lastAreas[i][1] = calcArea(a, 1);
+		}
+		area0 = lastAreas[i][0];
+		area1 = lastAreas[i][1];
+	}
+	double calcOutsideArea(double a0, double a1) {	// normalized area of [a0, a1] x [b0, b1] outside of the disc
+		if (a1 * a1 + b[1] * b[1] <= 1.0) {
+			return 0.0;
+		}
+		const double boxArea = (a1 - a0) * (b[1] - b[0]);
+		if (a0 * a0 + b[0] * b[0] >= 1.0) {
+			return boxArea;
+		}
+		double area00;
+		double area01;
+		double area10;
+		double area11;
+		calcAreas(a0, area00, area01);
+		calcAreas(a1, area10, area11);
+		return boxArea - (area11 - area01 - area10 + area00);
+	}
+	double b[2];
+	double crossing[2];
+	double crossingPrimitive[2];
+	int lastIndex;
+	double lastA[2];
+	double lastAreas[2][2];
+};
+
+static Mask8::Pixel coverageToMask8(double coverage)
+{
+	return static_cast<Mask8::Pixel>(minValue(maxValue(static_cast<int>(coverage * 256.0 + 1.0e-7), 0), 0xFF));
+}
+
+RoundedRectMask::RoundedRectMask(double left, double top, double width, double height, double radiusX
+		, double radiusY, const IntRect& clipBounds)
+	: left(left), top(top), right(left + width), bottom(top + height), radiusX(radiusX), radiusY(radiusY)
+{
+	assert(width >= 0.0 && height >= 0.0);
+	assert(0.0 <= radiusX && radiusX <= width * 0.5 + EPSILON && 0.0 <= radiusY && radiusY <= height * 0.5 + EPSILON);
+	if (radiusX <= 0.0 || radiusY <= 0.0) {
+		this->radiusX = 0.0;
+		this->radiusY = 0.0;
+	}
+	const double limit = static_cast<double>(0x7FFFFFFF >> POLYGON_FRACTION_BITS);
+	if (!(width > 0.0 && height > 0.0 && fabs(left) < limit && fabs(right) < limit && fabs(top) < limit
+			&& fabs(bottom) < limit)) {
+		bounds = IntRect();
+	} else {
+		bounds.left = static_cast<int>(floor(left));
+		bounds.top = static_cast<int>(floor(top));
+		bounds.width = static_cast<int>(ceil(right)) - bounds.left;
+		bounds.height = static_cast<int>(ceil(bottom)) - bounds.top;
+		bounds = bounds.calcIntersection(clipBounds);
+	}
+}
+
+IntRect RoundedRectMask::calcBounds() const
+{
+	return bounds;
+}
+
+void RoundedRectMask::render(int x, int y, int length, SpanBuffer<Mask8>& output) const
+{
+	assert(0 < length && length <= MAX_RENDER_LENGTH);
+	const int clipLeft = maxValue(x, bounds.left);
+	const int clipRight = minValue(x + length, bounds.calcRight());
+	if (y < bounds.top || y >= bounds.calcBottom() || clipLeft >= clipRight) {
+		output.addTransparent(length);
+		return;
+	}
+	if (clipLeft > x) {
+		output.addTransparent(clipLeft - x);
+	}
+	
+	/*
+		Columns from solidLeft to solidRight are inside horizontally and clear of the corners on this row. Columns
+		outside emptyLeft to emptyRight are outside of the corners. Insets are measured at the rows in the band
+		farthest from and closest to the vertical center.
+	*/
+	const double y0 = y;
+	const double y1 = y + 1.0;
+	double maxInset = 0.0;
+	double minInset = 0.0;
+	if (radiusX > 0.0) {
+		const double farV = minValue(maxValue(maxValue(top + radiusY - y0, y1 - (bottom - radiusY)) / radiusY, 0.0), 1.0);
+		const double nearV = minValue(maxValue(maxValue(top + radiusY - y1, y0 - (bottom - radiusY)) / radiusY, 0.0)
+				, 1.0);
+		maxInset = radiusX * (1.0 - sqrt(1.0 - farV * farV));
+		minInset = radiusX * (1.0 - sqrt(1.0 - nearV * nearV));
+	}
+	const int solidLeft = static_cast<int>(ceil(left + maxInset));
+	const int solidRight = static_cast<int>(floor(right - maxInset));
+	const int emptyLeft = static_cast<int>(floor(left + minInset));
+	const int emptyRight = static_cast<int>(ceil(right - minInset));
+	const double rowCoverage = minValue(y1, bottom) - maxValue(y0, top);
+	
+	// Corner rows (top and bottom) that this row passes through, each used for a left and a right corner.
+	QuarterDiscRow cornerRows[2 * 2];
+	int cornerRowCount = 0;
+	if (radiusX > 0.0) {
+		const double topCenter = top + radiusY;
+		if (y0 < topCenter) {
+			cornerRows[cornerRowCount].init((topCenter - minValue(y1, topCenter)) / radiusY
+					, (topCenter - maxValue(y0, top)) / radiusY);
+			cornerRows[cornerRowCount + 1] = cornerRows[cornerRowCount];
+			cornerRowCount += 2;
+		}
+		const double bottomCenter = bottom - radiusY;
+		if (y1 > bottomCenter) {
+			cornerRows[cornerRowCount].init((maxValue(y0, bottomCenter) - bottomCenter) / radiusY
+					, (minValue(y1, bottom) - bottomCenter) / radiusY);
+			cornerRows[cornerRowCount + 1] = cornerRows[cornerRowCount];
+			cornerRowCount += 2;
+		}
+	}
+	const double cornerScale = radiusX * radiusY;
+	
+	int col = clipLeft;
+	while (col < clipRight) {
+		int end;
+		if (col < emptyLeft || col >= emptyRight) {
+			end = (col < emptyLeft ? minValue(emptyLeft, clipRight) : clipRight);
+			output.addTransparent(end - col);
+		} else if (col >= solidLeft && col < solidRight) {
+			end = minValue(solidRight, clipRight);
+			output.addSolid(end - col, coverageToMask8(rowCoverage));
+		} else {
+			end = minValue(col < solidLeft ? minValue(solidLeft, emptyRight) : emptyRight, clipRight);
+			Mask8::Pixel* pixels = output.addVariable(end - col, false);
+			for (int i = 0; i < end - col; ++i) {
+				const double x0 = maxValue(col + i + 0.0, left);
+				const double x1 = minValue(col + i + 1.0, right);
+				double coverage = 0.0;
+				if (x0 < x1) {
+					coverage = (x1 - x0) * rowCoverage;
+					for (int j = 0; j < cornerRowCount; ++j) {
+						const bool isRight = ((j & 1) != 0);
+						const double u0 = (isRight ? x0 - (right - radiusX) : (left + radiusX) - x1) / radiusX;
+						const double u1 = (isRight ? x1 - (right - radiusX) : (left + radiusX) - x0) / radiusX;
+						if (u1 > 0.0) {
+							coverage -= cornerRows[j].calcOutsideArea(maxValue(u0, 0.0), minValue(u1, 1.0)) * cornerScale;
+						}
+					}
+				}
+				pixels[i] = coverageToMask8(coverage);
+			}
+		}
+		col = end;
+	}
+	if (x + length > clipRight) {
+		output.addTransparent(x + length - clipRight);
+	}
+}
+
 // Optimized specializations
 
 #if (NUXPIXELS_SIMD)
@@ -323,8 +323,10 @@ class Path {
 	public:		Path& close();
 	public:		Path& closeAll();
 	public:		Path& stroke(double width, EndCapStyle endCaps = BUTT, JointStyle joints = BEVEL, double miterLimit = 2.0, double curveQuality = 1.0);
+	public:		void strokeTo(Path& output, double width, EndCapStyle endCaps = BUTT, JointStyle joints = BEVEL, double miterLimit = 2.0, double curveQuality = 1.0) const; /// Like stroke() but replaces the contents of `output` (reusing its memory) and leaves this path unchanged.
 	public:		Path& dash(double dashLength, double gapLength, double dashOffset = 0.0);
 	public:		Path& transform(const AffineTransformation& transformation);
+	public:		Path& clampToRect(const Rect<double>& rect); /// Folds everything outside `rect` onto its border, leaving the filled area inside `rect` unchanged (for either fill rule) while bringing every vertex inside. Call closeAll() first when filling. Non-finite vertices are left as they are.
 	public:		bool empty() const;
 	public:		size_type size() const;
 	public:		const_iterator begin() const;
@@ -590,6 +592,7 @@ template<class T> class Offsetter;
 template<class T> class Renderer {
 	public:		virtual IntRect calcBounds() const = 0;
 	public:		virtual void render(int x, int y, int length, SpanBuffer<T>& output) const = 0;
+	public:		virtual bool isReentrant() const { return false; }	/// true if render() can be called from several threads at once, as long as no two threads render the same row at the same time. Raster<T>::fill() only splits reentrant renderers into bands.
 	public:		Blender<T> operator|(const Renderer<T>& b) const { return Blender<T>(*this, b); }
 	public:		Adder<T> operator+(const Renderer<T>& b) const { return Adder<T>(*this, b); }
 	public:		template<class B> Multiplier<T, B> operator*(const Renderer<B>& b) const { return Multiplier<T, B>(*this, b); }
@@ -599,6 +602,27 @@ template<class T> class Renderer {
 	public:		virtual ~Renderer();
 };
 
+/**
+	ThreadPool keeps worker threads around for running independent jobs, e.g. the bands of a parallel Raster<T>::fill().
+	The thread calling run() takes part in the work, so a pool of n threads starts n - 1 workers. Only one thread at a
+	time may call run() and jobs must not call run() on the same pool.
+
+	example:
+	ThreadPool pool(4);
+	raster.fill(gradient[RadialAscend(500, 500, 400, 400)], raster.calcBounds(), pool);
+**/
+class ThreadPool {
+	public:		typedef void (*Job)(void* data, int index);
+	public:		explicit ThreadPool(int threadCount = 0);	/// 0 = one thread per hardware thread.
+	public:		int getThreadCount() const;
+	public:		void run(int jobCount, Job job, void* data);	/// Calls job(data, index) for every index from 0 to jobCount - 1 and returns when all have finished. If a job throws, remaining jobs are skipped and the exception is rethrown here.
+	public:		~ThreadPool();
+	protected:	ThreadPool(const ThreadPool& that); // N/A
+	protected:	ThreadPool& operator=(const ThreadPool& that); // N/A
+	protected:	class Impl;
+	protected:	Impl* impl;
+};
+
 // FIX : no inlines here (?)
 /**
 	Raster represents an in-memory pixel buffer that can be rendered to. It does not own the memory.
@@ -607,12 +631,17 @@ template<class T> class Raster : public Renderer<T> {
 	public:		Raster(typename T::Pixel* pixels, int stride, const IntRect& bounds, bool opaque);	/// Warning! If opaque is true you must never have transparent pixels in this raster.
 	public:		virtual IntRect calcBounds() const;
 	public:		virtual void render(int x, int y, int length, SpanBuffer<T>& output) const;
+	public:		virtual bool isReentrant() const { return true; }
 	public:		void fill(const Renderer<T>& source, const IntRect& area);
+	public:		void fill(const Renderer<T>& source, const IntRect& area, ThreadPool& pool);	/// Same result as fill(source, area) but splits large areas into bands of rows that are filled on the threads of `pool`. Falls back to a plain fill if `source` is not reentrant. `source` must not read rows of this raster other than the one being filled.
 	public:		typename T::Pixel& operator[](int index) const { return pixels[index]; }
 	public:		typename T::Pixel getPixel(int x, int y) const;
 	public:		void setPixel(int x, int y, const typename T::Pixel& p);
 	public:		Raster<T>& operator=(const Renderer<T>& source);
 	public:		Raster<T>& operator|=(const Renderer<T>& source);
+	public:		void blend(const Renderer<T>& source, ThreadPool& pool);	/// Same result as `*this |= source`, filled in bands on the threads of `pool`.
+	public:		void blendBoth(const Renderer<T>& first, const Renderer<T>& second);	/// Same result as `*this |= first` followed by `*this |= second` but blends both sources row by row so that each row is only brought into cache once.
+	public:		void blendBoth(const Renderer<T>& first, const Renderer<T>& second, ThreadPool& pool);	/// Same as above, in bands on the threads of `pool`.
 	public:		Raster<T>& operator+=(const Renderer<T>& source);
 	// FIX : check that transparent * transparent == transparent before unioning
 	public:		template<class B> Raster<T>& operator*=(const Renderer<B>& source) { (*this) = (*this) * source; return (*this); }
@@ -620,6 +649,13 @@ template<class T> class Raster : public Renderer<T> {
 	public:		int getStride() const { return stride; }
 	public:		bool isOpaque() const { return opaque; }
 	protected:	Raster(); // for SelfContainedRaster
+	protected:	struct Bands;
+	protected:	static int calcBandCount(const IntRect& area, const ThreadPool& pool);
+	protected:	static void fillBand(void* data, int index);
+	protected:	static void blendBothBand(void* data, int index);
+	protected:	void fillRow(const Renderer<T>& source, int y, int left, int right);
+	protected:	void blendBothRows(const Renderer<T>& firstBlender, const IntRect& firstArea, const Renderer<T>& secondBlender
+						, const IntRect& secondArea, int top, int bottom);
 	protected:	typename T::Pixel* pixels;	/// The address of the topmost scanline. The 0,0 coordinate should point to this pixel.
 	protected:	int stride;					/// The stride with which one should offset the pointer for every increasing row (often referred to as "row bytes", although this value is not a byte count but an int count). Can be negative in case the offscreen orientation is upside down (in this case the base address should actually point to the last scanline in memory, which is now the topmost line).
 	protected:	IntRect bounds;				/// Access outside this rect is illegal as it might be outside allocated memory bounds.
@@ -657,12 +693,15 @@ template<class T> class Solid : public Renderer<T> {
 	public:		Solid(const typename T::Pixel& pixel);
 	public:		virtual IntRect calcBounds() const;
 	public:		virtual void render(int x, int y, int length, SpanBuffer<T>& output) const;
+	public:		virtual bool isReentrant() const { return true; }
 	protected:	typename T::Pixel pixel;
 };
 
 /**
 	RLERaster stores spans in run-length encoded form to save memory.
 
+	invert() flips a Mask8 raster in place without decoding its runs to pixels.
+
 	example:
 	RLERaster<Mask8> cache(area, mask);
 **/
@@ -670,23 +709,30 @@ template<class T> class RLERaster : public Renderer<T> {
 	public:		RLERaster(const IntRect& bounds, const Renderer<T>& source = Solid<T>(T::transparent()));
 	public:		virtual IntRect calcBounds() const;
 	public:		virtual void render(int x, int y, int length, SpanBuffer<T>& output) const;
+	public:		virtual bool isReentrant() const { return true; }	/// Each row keeps its own read position.
 	public:		void fill(const Renderer<T>& source);
 	public:		RLERaster<T>& operator=(const Renderer<T>& source);
 	public:		RLERaster<T>& operator|=(const Renderer<T>& source);
 	public:		RLERaster<T>& operator+=(const Renderer<T>& source);
 	public:		template<class B> RLERaster<T>& operator*=(const Renderer<B>& source) { (*this) = (*this) * source; return (*this); }
+	public:		void invert();									/// Same as `*this = ~*this`.
 	public:		void swap(RLERaster<T>& other);
 	public:		bool isOpaque() const;
+	public:		IntRect calcCoverageBounds() const;	/// Bounds of all pixels that are not transparent (empty if there are none). Tracked while filling so this is cheap.
+	public:		size_t calcMemoryUsage() const;		/// Bytes allocated for runs, pixels and row positions.
 	protected:	RLERaster();
 	protected:	void rewind();
 	protected:	IntRect bounds;
+	protected:	IntRect coverageBounds;
 	protected:	std::vector<UInt16> spans;
 	protected:	std::vector<typename T::Pixel> pixels;
+	protected:	struct Cursor {
+					int x;				/// Left edge of the span at spanIndex.
+					size_t spanIndex;
+					size_t pixelIndex;
+				};
 	protected:	std::vector< std::pair<size_t, size_t> > rows;
-	protected:	mutable int lastX;
-	protected:	mutable int lastY;
-	protected:	mutable size_t lastSpanIndex;
-	protected:	mutable size_t lastPixelIndex;
+	protected:	mutable std::vector<Cursor> cursors;	/// Where the last render() of each row ended, so that rendering a row left to right doesn't rescan it from the start.
 	protected:	bool opaque;
 };
 
@@ -700,6 +746,7 @@ template<class T> class SolidRect : public Renderer<T> {
 	public:		SolidRect(const typename T::Pixel& pixel, const IntRect& rect);
 	public:		virtual IntRect calcBounds() const;
 	public:		virtual void render(int x, int y, int length, SpanBuffer<T>& output) const;
+	public:		virtual bool isReentrant() const { return true; }
 	protected:	typename T::Pixel pixel;
 	protected:	IntRect rect;
 };
@@ -715,6 +762,7 @@ template<class T> class Clipper : public Renderer<T> {
 	public:		Clipper(const Renderer<T>& source, const IntRect& rect);
 	public:		virtual IntRect calcBounds() const;
 	public:		virtual void render(int x, int y, int length, SpanBuffer<T>& output) const;
+	public:		virtual bool isReentrant() const { return source.isReentrant(); }
 	protected:	const Renderer<T>& source;
 	protected:	IntRect rect;
 };
@@ -730,6 +778,7 @@ template<class T> class Offsetter : public Renderer<T> {
 	public:		Offsetter(const Renderer<T>& source, int offsetX, int offsetY);
 	public:		virtual IntRect calcBounds() const;
 	public:		virtual void render(int x, int y, int length, SpanBuffer<T>& output) const;
+	public:		virtual bool isReentrant() const { return source.isReentrant(); }
 	protected:	const Renderer<T>& source;
 	protected:	int offsetX;
 	protected:	int offsetY;
@@ -746,6 +795,7 @@ template<class S, class T> class UnaryOperator : public Renderer<T> {
 	protected:	template<class U> void render(int x, int y, int length, const Renderer<U>&, SpanBuffer<T>& output) const;
 	protected:	void render(int x, int y, int length, const Renderer<T>&, SpanBuffer<T>& output) const;
 	public:		virtual void render(int x, int y, int length, SpanBuffer<T>& output) const;
+	public:		virtual bool isReentrant() const { return source.isReentrant(); }
 	protected:	const Renderer<S>& source;
 };
 
@@ -799,6 +849,7 @@ class LinearAscend : public Renderer<Mask8> { // FIX : name? LinearMask, LinearA
 	public:		LinearAscend(double startX, double startY, double endX, double endY);
 	public:		virtual IntRect calcBounds() const;
 	public:		virtual void render(int x, int y, int length, SpanBuffer<Mask8>& output) const;
+	public:		virtual bool isReentrant() const { return true; }
 	protected:	int start;
 	protected:	int dx;
 	protected:	int dy;
@@ -815,6 +866,7 @@ class RadialAscend : public Renderer<Mask8> {
 	public:		RadialAscend(double centerX, double centerY, double width, double height);	// width and height must be non-zero
 	public:		virtual IntRect calcBounds() const;
 	public:		virtual void render(int x, int y, int length, SpanBuffer<Mask8>& output) const;
+	public:		virtual bool isReentrant() const { return true; }
 	protected:	double centerX;
 	protected:	double centerY;
 	protected:	double width;
@@ -831,9 +883,10 @@ class RadialAscend : public Renderer<Mask8> {
 	Texture<ARGB32> tex(image, true, AffineTransformation().scale(2));
 **/
 template<class T> class Texture : public Renderer<T> {
-	public:		Texture(const Raster<T>& image, bool wrap = true, const AffineTransformation& transformation = AffineTransformation(), const IntRect& sourceRect = FULL_RECT);
+	public:		Texture(const Raster<T>& image, bool wrap = true, const AffineTransformation& transformation = AffineTransformation(), const IntRect& sourceRect = FULL_RECT, bool interpolate = true); /// interpolate = false samples the nearest pixel instead of filtering bilinearly (faster, for previews)
 	public:		virtual IntRect calcBounds() const;
 	public:		virtual void render(int x, int y, int length, SpanBuffer<T>& output) const;
+	public:		virtual bool isReentrant() const { return true; }
 	public:		virtual ~Texture();
 	protected:	class Impl;
 	protected:	Impl* impl;
@@ -844,9 +897,9 @@ template<class T> class Texture : public Renderer<T> {
 **/
 template<class A, class B> class BinaryOperator : public Renderer<A> {
 	public:		BinaryOperator(const Renderer<A>& rendererA, const Renderer<B>& rendererB);
+	public:		virtual bool isReentrant() const { return rendererA.isReentrant() && rendererB.isReentrant(); }
 	protected:	const Renderer<A>& rendererA;
 	protected:	const Renderer<B>& rendererB;
-	protected:	mutable typename B::Pixel pixelsB[MAX_RENDER_LENGTH];
 };
 
 /**
@@ -897,6 +950,7 @@ template<class T> class Optimizer : public Renderer<T> {
 	public:		Optimizer(const Renderer<T>& source);
 	public:		virtual IntRect calcBounds() const;
 	public:		virtual void render(int x, int y, int length, SpanBuffer<T>& output) const;
+	public:		virtual bool isReentrant() const { return source.isReentrant(); }
 	protected:	static const typename T::Pixel* outputVariable(const typename T::Pixel* b, const typename T::Pixel* e, bool opaque, SpanBuffer<T>& output);
 	protected:	static const typename T::Pixel* analyzeSolid(const typename T::Pixel* b, const typename T::Pixel* e, SpanBuffer<T>& output);
 	protected:	static const typename T::Pixel* analyzeOpaque(const typename T::Pixel* b, const typename T::Pixel* e, SpanBuffer<T>& output);
@@ -941,19 +995,30 @@ class EvenOddFillRule : public FillRule {
 	query `isValid()`; it returns `false` if any vertex falls outside the fixed-point range and the mask will produce
 	no coverage.
 
+	With `antialiased` false each row is sampled once through the pixel centers instead: every pixel is either fully
+	covered or not, each edge costs the same regardless of its slope and the output consists of solid spans only,
+	which is faster to rasterize and blend. Meant for previews.
+
 	Rendering rows in ascending order is most efficient. Calling `render` with a `y` lower than a prior call rewinds
-	the mask so scanning restarts from the top.
+	the mask so scanning restarts from the top. Since all rows share this scan state a PolygonMask is not reentrant
+	(see Renderer::isReentrant()).
 **/
 class PolygonMask : public Renderer<Mask8> {
 	public:		static NonZeroFillRule nonZeroFillRule;
 	public:		static EvenOddFillRule evenOddFillRule;
+	public:		class Workspace;
 	public:		PolygonMask(const Path& path,
 						const IntRect& clipBounds = FULL_RECT,
-						const FillRule& fillRule = nonZeroFillRule);   /// `clipBounds` is clamped; must cover destination raster.
+						const FillRule& fillRule = nonZeroFillRule,
+						Workspace* workspace = 0,
+						bool antialiased = true);   /// `clipBounds` is clamped; must cover destination raster. `workspace` (if not 0) lends its buffers to this mask until it is destroyed, see Workspace.
 	public:		virtual IntRect calcBounds() const;
 	public:		virtual void render(int x, int y, int length, SpanBuffer<Mask8>& output) const;
 	public:		void rewind() const;
 	public: 	bool isValid() const;	/// false if path had out-of-range vertices
+	public:		static bool isValidPath(const Path& path);	/// false if `path` has out-of-range vertices, i.e. if a PolygonMask of it would not be valid (cheaper than constructing one)
+	public:		size_t getSegmentCount() const { return segments.size(); }	/// Number of non-horizontal edges.
+	public:		static size_t calcSegmentBytes(const Path& path);	/// Upper bound of the memory a PolygonMask of `path` allocates for its edges (coverage buffers of one row come on top).
 	
 	protected:	struct Segment {
 					int topY;			/// Starting y in fixed fraction format (fraction precision = POLYGON_FRACTION_BITS).
@@ -967,6 +1032,25 @@ class PolygonMask : public Renderer<Mask8> {
 					struct Order;
 				};
 
+				/**
+					Workspace holds the buffers a PolygonMask needs so that they can be reused from one mask to the next
+					instead of being allocated for every path. A workspace can only be used by one mask at a time.
+					
+					example:
+					PolygonMask::Workspace workspace;
+					for (int i = 0; i < count; ++i) raster |= Solid<ARGB32>(colors[i]) * PolygonMask(paths[i], raster.calcBounds(), PolygonMask::nonZeroFillRule, &workspace);
+				**/
+	public:		class Workspace {
+					friend class PolygonMask;
+					protected:	std::vector<Segment> segments;
+					protected:	std::vector<Int32> coverageDelta;
+					protected:	std::vector<Segment*> segsVertically;
+					protected:	std::vector<Segment*> segsHorizontally;
+				};
+
+	public:		virtual ~PolygonMask();
+	protected:	void swapWorkspace();
+
 	protected:	std::vector<Segment> segments;
 	protected:	IntRect bounds;
 	protected:	const FillRule& fillRule;
@@ -977,6 +1061,53 @@ class PolygonMask : public Renderer<Mask8> {
 	protected:	mutable std::vector<Segment*> segsVertically;
 	protected:	mutable std::vector<Segment*> segsHorizontally;
 	protected:	bool valid;
+	protected:	const bool antialiased;
+	protected:	Workspace* workspace;
+};
+
+/**
+	RectMask renders a path that is a single axis-aligned rectangle with exactly the coverage PolygonMask would
+	produce (vertices are rounded to the same subpixel grid), but without edge lists or coverage accumulation. The
+	interior is output as solid spans. Use isRect() to check if a path qualifies; the fill rule makes no difference
+	for a rectangle.
+
+	example:
+	if (RectMask::isRect(path)) canvas |= Solid<ARGB32>(0xff0000ff) * RectMask(path, canvas.calcBounds());
+**/
+class RectMask : public Renderer<Mask8> {
+	public:		static bool isRect(const Path& path);	/// false if path is anything but one rectangle or has out-of-range vertices
+	public:		RectMask(const Path& path, const IntRect& clipBounds = FULL_RECT);	/// `path` must pass isRect().
+	public:		virtual IntRect calcBounds() const;
+	public:		virtual void render(int x, int y, int length, SpanBuffer<Mask8>& output) const;
+	public:		virtual bool isReentrant() const { return true; }
+	protected:	int left;	/// Fixed fraction format (fraction precision = POLYGON_FRACTION_BITS), same for the rest.
+	protected:	int top;
+	protected:	int right;
+	protected:	int bottom;
+	protected:	IntRect bounds;
+};
+
+/**
+	RoundedRectMask renders the exact area coverage of an axis-aligned rectangle with elliptic corners (an ellipse if
+	the corner radii are half the width and height) without flattening it into a polygon. Coverage differs slightly
+	from a PolygonMask of the flattened shape. Radii must not exceed half the width and height.
+
+	example:
+	canvas |= Solid<ARGB32>(0xff0000ff) * RoundedRectMask(10.5, 10.5, 100, 50, 8, 8, canvas.calcBounds());
+**/
+class RoundedRectMask : public Renderer<Mask8> {
+	public:		RoundedRectMask(double left, double top, double width, double height, double radiusX, double radiusY
+						, const IntRect& clipBounds = FULL_RECT);
+	public:		virtual IntRect calcBounds() const;
+	public:		virtual void render(int x, int y, int length, SpanBuffer<Mask8>& output) const;
+	public:		virtual bool isReentrant() const { return true; }
+	protected:	double left;
+	protected:	double top;
+	protected:	double right;
+	protected:	double bottom;
+	protected:	double radiusX;
+	protected:	double radiusY;
+	protected:	IntRect bounds;
 };
 
 
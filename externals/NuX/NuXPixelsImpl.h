@@ -539,29 +539,154 @@ template<class T> void Raster<T>::render(int x, int y, int length, SpanBuffer<T>
 	}
 }
 
+template<class T> void Raster<T>::fillRow(const Renderer<T>& source, int y, int left, int right)
+{
+	for (int x = left; x < right; x += MAX_RENDER_LENGTH) {
+		const int length = minValue(right - x, MAX_RENDER_LENGTH);
+		NUXPIXELS_SPAN_ARRAY(T, spanArray);
+		SpanBuffer<T> output(spanArray, pixels + stride * y + x);
+		source.render(x, y, length, output);
+		typename T::Pixel* target = pixels + stride * y + x;
+		typename SpanBuffer<T>::iterator it = output.begin();
+		while (it != output.end()) {
+			const int count = it->getLength();
+			if (it->isSolid()) {
+				fillPixels<T>(count, target, it->getSolidPixel());
+			} else {
+				copyPixels<T>(count, target, it->getVariablePixels());
+			}
+			target += it->getLength();
+			++it;
+		}
+	}
+}
+
 template<class T> void Raster<T>::fill(const Renderer<T>& source, const IntRect& area)
 {
 	assert(area.isEmpty() || bounds.calcUnion(area) == bounds);		// area must be within target raster bounds
 	const int right = area.calcRight();
 	const int bottom = area.calcBottom();
 	for (int y = area.top; y < bottom; ++y) {
-		for (int x = area.left; x < right; x += MAX_RENDER_LENGTH) {
-			const int length = minValue(right - x, MAX_RENDER_LENGTH);
-			NUXPIXELS_SPAN_ARRAY(T, spanArray);
-			SpanBuffer<T> output(spanArray, pixels + stride * y + x);
-			source.render(x, y, length, output);
-			typename T::Pixel* target = pixels + stride * y + x;
-			typename SpanBuffer<T>::iterator it = output.begin();
-			while (it != output.end()) {
-				const int count = it->getLength();
-				if (it->isSolid()) {
-					fillPixels<T>(count, target, it->getSolidPixel());
-				} else {
-					copyPixels<T>(count, target, it->getVariablePixels());
-				}
-				target += it->getLength();
-				++it;
-			}
+		fillRow(source, y, area.left, right);
+	}
+}
+
+/**
+	Bands is what the jobs of a parallel fill share. The area is split into `count` bands of whole rows, band i
+	covering rows `top + height * i / count` up to (but not including) the start of band i + 1.
+**/
+template<class T> struct Raster<T>::Bands {
+	Raster<T>* raster;
+	const Renderer<T>* source;
+	IntRect area;
+	const Renderer<T>* secondSource;	/// Only for blendBoth().
+	IntRect secondArea;
+	int top;
+	int height;
+	int count;
+	int calcBandTop(int index) const { return top + static_cast<int>(static_cast<double>(height) * index / count); }
+};
+
+/**
+	Enough bands to keep all threads busy even if some bands are cheaper than others, but never so few pixels per
+	band that the synchronization would cost more than the filling.
+**/
+template<class T> int Raster<T>::calcBandCount(const IntRect& area, const ThreadPool& pool)
+{
+	const int MIN_BAND_PIXELS = 1 << 14;
+	const int BANDS_PER_THREAD = 4;
+	const int threadCount = pool.getThreadCount();
+	if (threadCount <= 1 || area.isEmpty()) {
+		return 1;
+	}
+	const double pixelCount = static_cast<double>(area.width) * area.height;
+	const int maxCount = minValue(threadCount * BANDS_PER_THREAD, area.height);
+	return maxValue(static_cast<int>(minValue(pixelCount / MIN_BAND_PIXELS, static_cast<double>(maxCount))), 1);
+}
+
+template<class T> void Raster<T>::fillBand(void* data, int index)
+{
+	const Bands& bands = *reinterpret_cast<const Bands*>(data);
+	const int bottom = bands.calcBandTop(index + 1);
+	for (int y = bands.calcBandTop(index); y < bottom; ++y) {
+		bands.raster->fillRow(*bands.source, y, bands.area.left, bands.area.calcRight());
+	}
+}
+
+template<class T> void Raster<T>::fill(const Renderer<T>& source, const IntRect& area, ThreadPool& pool)
+{
+	assert(area.isEmpty() || bounds.calcUnion(area) == bounds);		// area must be within target raster bounds
+	const int bandCount = (source.isReentrant() ? calcBandCount(area, pool) : 1);
+	if (bandCount <= 1) {
+		fill(source, area);
+	} else {
+		Bands bands = { this, &source, area, 0, EMPTY_RECT, area.top, area.height, bandCount };
+		pool.run(bandCount, fillBand, &bands);
+	}
+}
+
+template<class T> void Raster<T>::blend(const Renderer<T>& source, ThreadPool& pool)
+{
+	fill((*this) | source, bounds.calcIntersection(source.calcBounds()), pool);
+}
+
+template<class T> void Raster<T>::blendBothRows(const Renderer<T>& firstBlender, const IntRect& firstArea
+		, const Renderer<T>& secondBlender, const IntRect& secondArea, int top, int bottom)
+{
+	for (int y = top; y < bottom; ++y) {
+		if (y >= firstArea.top && y < firstArea.calcBottom()) {
+			fillRow(firstBlender, y, firstArea.left, firstArea.calcRight());
+		}
+		if (y >= secondArea.top && y < secondArea.calcBottom()) {
+			fillRow(secondBlender, y, secondArea.left, secondArea.calcRight());
+		}
+	}
+}
+
+template<class T> void Raster<T>::blendBothBand(void* data, int index)
+{
+	const Bands& bands = *reinterpret_cast<const Bands*>(data);
+	bands.raster->blendBothRows(*bands.source, bands.area, *bands.secondSource, bands.secondArea
+			, bands.calcBandTop(index), bands.calcBandTop(index + 1));
+}
+
+template<class T> void Raster<T>::blendBoth(const Renderer<T>& first, const Renderer<T>& second)
+{
+	const IntRect firstArea = bounds.calcIntersection(first.calcBounds());
+	const IntRect secondArea = bounds.calcIntersection(second.calcBounds());
+	if (firstArea.isEmpty()) {
+		(*this) |= second;
+	} else if (secondArea.isEmpty()) {
+		(*this) |= first;
+	} else {
+		const Blender<T> firstBlender((*this) | first);
+		const Blender<T> secondBlender((*this) | second);
+		const int top = minValue(firstArea.top, secondArea.top);
+		const int bottom = maxValue(firstArea.calcBottom(), secondArea.calcBottom());
+		blendBothRows(firstBlender, firstArea, secondBlender, secondArea, top, bottom);
+	}
+}
+
+template<class T> void Raster<T>::blendBoth(const Renderer<T>& first, const Renderer<T>& second, ThreadPool& pool)
+{
+	const IntRect firstArea = bounds.calcIntersection(first.calcBounds());
+	const IntRect secondArea = bounds.calcIntersection(second.calcBounds());
+	if (firstArea.isEmpty()) {
+		blend(second, pool);
+	} else if (secondArea.isEmpty()) {
+		blend(first, pool);
+	} else {
+		const Blender<T> firstBlender((*this) | first);
+		const Blender<T> secondBlender((*this) | second);
+		const int top = minValue(firstArea.top, secondArea.top);
+		const int bottom = maxValue(firstArea.calcBottom(), secondArea.calcBottom());
+		const int bandCount = (firstBlender.isReentrant() && secondBlender.isReentrant()
+				? calcBandCount(firstArea.calcUnion(secondArea), pool) : 1);
+		if (bandCount <= 1) {
+			blendBothRows(firstBlender, firstArea, secondBlender, secondArea, top, bottom);
+		} else {
+			Bands bands = { this, &firstBlender, firstArea, &secondBlender, secondArea, top, bottom - top, bandCount };
+			pool.run(bandCount, blendBothBand, &bands);
 		}
 	}
 }
@@ -621,7 +746,7 @@ template<class T> SelfContainedRaster<T>::~SelfContainedRaster() {
 /* --- RLERaster --- */
 
 template<class T> RLERaster<T>::RLERaster(const IntRect& bounds, const Renderer<T>& source) : bounds(bounds), opaque(false) { fill(source); }
-template<class T> RLERaster<T>::RLERaster() : opaque(false) { rewind(); }
+template<class T> RLERaster<T>::RLERaster() : coverageBounds(0, 0, 0, 0), opaque(false) { rewind(); }
 template<class T> IntRect RLERaster<T>::calcBounds() const { return bounds; }
 
 template<class T> void RLERaster<T>::render(int x, int y, int length, SpanBuffer<T>& output) const
@@ -637,17 +762,18 @@ template<class T> void RLERaster<T>::render(int x, int y, int length, SpanBuffer
 			length -= c;
 		}
 		assert(length >= 0);
+		Cursor& cursor = cursors[y - bounds.top];
 		size_t spanIndex;
 		size_t pixelIndex;
 		int sx;
-		if (y != lastY || x < lastX) {
+		if (x < cursor.x) {
 			spanIndex = rows[y - bounds.top].first;
 			pixelIndex = rows[y - bounds.top].second;
 			sx = bounds.left;
 		} else {
-			spanIndex = lastSpanIndex;
-			pixelIndex = lastPixelIndex;
-			sx = lastX;
+			spanIndex = cursor.spanIndex;
+			pixelIndex = cursor.pixelIndex;
+			sx = cursor.x;
 		}
 		while (length > 0 && x < bounds.calcRight()) {
 			int c = minValue(bounds.calcRight() - x, length);
@@ -670,10 +796,9 @@ template<class T> void RLERaster<T>::render(int x, int y, int length, SpanBuffer
 			x += c;
 			length -= c;
 		}
-		lastX = sx;
-		lastY = y;
-		lastSpanIndex = spanIndex;
-		lastPixelIndex = pixelIndex;
+		cursor.x = sx;
+		cursor.spanIndex = spanIndex;
+		cursor.pixelIndex = pixelIndex;
 	}
 	if (length > 0) {
 		output.addTransparent(length);
@@ -682,20 +807,24 @@ template<class T> void RLERaster<T>::render(int x, int y, int length, SpanBuffer
 
 template<class T> void RLERaster<T>::rewind()
 {
-	lastX = bounds.left;
-	lastY = bounds.top;
-	lastSpanIndex = 0;
-	lastPixelIndex = 0;
+	cursors.resize(rows.size());
+	for (size_t i = 0; i < rows.size(); ++i) {
+		cursors[i].x = bounds.left;
+		cursors[i].spanIndex = rows[i].first;
+		cursors[i].pixelIndex = rows[i].second;
+	}
 }
 
 template<class T> void RLERaster<T>::swap(RLERaster<T>& other)
 {
 	bounds.swap(other.bounds);
+	coverageBounds.swap(other.coverageBounds);
 	spans.swap(other.spans);
 	pixels.swap(other.pixels);
 	rows.swap(other.rows);
 	std::swap(opaque, other.opaque);
 	rewind();
+	other.rewind();
 }
 
 template<class T> void RLERaster<T>::fill(const Renderer<T>& source)
@@ -706,6 +835,10 @@ template<class T> void RLERaster<T>::fill(const Renderer<T>& source)
 
 	const int right = bounds.calcRight();
 	const int bottom = bounds.calcBottom();
+	int coverageLeft = right;
+	int coverageTop = bottom;
+	int coverageRight = bounds.left;
+	int coverageBottom = bounds.top;
 	for (int y = bounds.top; y < bottom; ++y) {
 		newRLE.rows.push_back(std::pair<size_t, size_t>(newRLE.spans.size(), newRLE.pixels.size()));
 		bool first = true;
@@ -716,8 +849,16 @@ template<class T> void RLERaster<T>::fill(const Renderer<T>& source)
 			SpanBuffer<T> output(spanArray, rlePixels);
 			source.render(x, y, length, output);
 			typename SpanBuffer<T>::iterator it = output.begin();
+			int spanX = x;
 			while (it != output.end()) {
 				assert(it->getLength() < 0x4000);
+				if (!it->isTransparent()) {
+					coverageLeft = minValue(coverageLeft, spanX);
+					coverageRight = maxValue(coverageRight, spanX + it->getLength());
+					coverageTop = minValue(coverageTop, y);
+					coverageBottom = y + 1;
+				}
+				spanX += it->getLength();
 				const bool opaqueSpan = it->isOpaque();
 				const bool solidSpan = it->isSolid();
 				const UInt16 span = it->getLength() | (solidSpan ? 0x8000 : 0) | (opaqueSpan ? 0x4000 : 0);
@@ -745,11 +886,61 @@ template<class T> void RLERaster<T>::fill(const Renderer<T>& source)
 			}
 		}
 	}
+	newRLE.coverageBounds = (coverageLeft < coverageRight
+			? IntRect(coverageLeft, coverageTop, coverageRight - coverageLeft, coverageBottom - coverageTop) : EMPTY_RECT);
 
 	swap(newRLE);
 }
 
+// Runs stay as they are, only their pixels and opaque flags change.
+template<class T> void RLERaster<T>::invert()
+{
+	for (size_t i = 0; i < pixels.size(); ++i) {
+		pixels[i] = T::invert(pixels[i]);
+	}
+	const int right = bounds.calcRight();
+	const int bottom = bounds.calcBottom();
+	int coverageLeft = right;
+	int coverageTop = bottom;
+	int coverageRight = bounds.left;
+	int coverageBottom = bounds.top;
+	opaque = true;
+	size_t spanIndex = 0;
+	size_t pixelIndex = 0;
+	for (int y = bounds.top; y < bottom; ++y) {
+		for (int x = bounds.left; x < right;) {
+			const int length = (spans[spanIndex] & 0x3FFF);
+			const bool solid = ((spans[spanIndex] & 0x8000) != 0);
+			const int count = (solid ? 1 : length);
+			bool opaqueRun = true;
+			bool transparentRun = true;
+			for (int i = 0; i < count; ++i) {
+				opaqueRun = (opaqueRun && T::isOpaque(pixels[pixelIndex + i]));
+				transparentRun = (transparentRun && T::isTransparent(pixels[pixelIndex + i]));
+			}
+			spans[spanIndex] = static_cast<UInt16>((spans[spanIndex] & 0xBFFF) | (opaqueRun ? 0x4000 : 0));
+			opaque = (opaque && opaqueRun);
+			if (!solid || !transparentRun) {
+				coverageLeft = minValue(coverageLeft, x);
+				coverageRight = maxValue(coverageRight, x + length);
+				coverageTop = minValue(coverageTop, y);
+				coverageBottom = y + 1;
+			}
+			x += length;
+			pixelIndex += count;
+			++spanIndex;
+		}
+	}
+	coverageBounds = (coverageLeft < coverageRight
+			? IntRect(coverageLeft, coverageTop, coverageRight - coverageLeft, coverageBottom - coverageTop) : EMPTY_RECT);
+}
+
 template<class T> bool RLERaster<T>::isOpaque() const { return opaque; }
+template<class T> IntRect RLERaster<T>::calcCoverageBounds() const { return coverageBounds; }
+template<class T> size_t RLERaster<T>::calcMemoryUsage() const {
+	return spans.capacity() * sizeof (UInt16) + pixels.capacity() * sizeof (typename T::Pixel)
+			+ rows.capacity() * sizeof (std::pair<size_t, size_t>) + cursors.capacity() * sizeof (Cursor);
+}
 
 template<class T> RLERaster<T>& RLERaster<T>::operator=(const Renderer<T>& source) { fill(source); return (*this); }
 template<class T> RLERaster<T>& RLERaster<T>::operator|=(const Renderer<T>& source) { (*this) = (*this) | source; return (*this); }
@@ -911,7 +1102,8 @@ template<class T> void Blender<T>::render(int x, int y, int length, SpanBuffer<T
 	}
 
 	NUXPIXELS_SPAN_ARRAY(T, spanArrayB);
-	SpanBuffer<T> spansB(spanArrayB, super::pixelsB);
+	typename T::Pixel pixelArrayB[MAX_RENDER_LENGTH];
+	SpanBuffer<T> spansB(spanArrayB, pixelArrayB);
 	super::rendererB.render(x, y, length, spansB);
 	typename SpanBuffer<T>::iterator beginB = spansB.begin();
 	typename SpanBuffer<T>::iterator endB = spansB.end();
@@ -1000,7 +1192,8 @@ template<class T> void Adder<T>::render(int x, int y, int length, SpanBuffer<T>&
 	assert(0 < length && length <= MAX_RENDER_LENGTH);
 	
 	NUXPIXELS_SPAN_ARRAY(T, spanArrayB);
-	SpanBuffer<T> spansB(spanArrayB, super::pixelsB);
+	typename T::Pixel pixelArrayB[MAX_RENDER_LENGTH];
+	SpanBuffer<T> spansB(spanArrayB, pixelArrayB);
 	super::rendererB.render(x, y, length, spansB);
 	typename SpanBuffer<T>::iterator beginB = spansB.begin();
 	typename SpanBuffer<T>::iterator endB = spansB.end();
@@ -1081,7 +1274,8 @@ template<class A, class B> void Multiplier<A, B>::render(int x, int y, int lengt
 	assert(0 < length && length <= MAX_RENDER_LENGTH);
 	
 	NUXPIXELS_SPAN_ARRAY(B, spanArrayB);
-	SpanBuffer<B> spansB(spanArrayB, super::pixelsB);
+	typename B::Pixel pixelArrayB[MAX_RENDER_LENGTH];
+	SpanBuffer<B> spansB(spanArrayB, pixelArrayB);
 	super::rendererB.render(x, y, length, spansB);
 	typename SpanBuffer<B>::iterator beginB = spansB.begin();
 	typename SpanBuffer<B>::iterator endB = spansB.end();
@@ -1284,7 +1478,7 @@ template<class T> Gradient<T>::Gradient(typename T::Pixel start, typename T::Pix
 **/
 template<class T> class Texture<T>::Impl {
 	friend class Texture<T>;
-	public:		Impl(const Raster<T>& image, bool wrap, const AffineTransformation& transformation, const IntRect& sourceRect);
+	public:		Impl(const Raster<T>& image, bool wrap, const AffineTransformation& transformation, const IntRect& sourceRect, bool interpolate);
 	protected:	int findImage(int span, Fixed32_32& sx, Fixed32_32& sy, SpanBuffer<T>& output) const;
 	protected:	int interpolateEdge(int span, Fixed32_32& sx, Fixed32_32& sy, SpanBuffer<T>& output) const;
 	protected:	int interpolateInside(int span, Fixed32_32& sx, Fixed32_32& sy, SpanBuffer<T>& output) const;
@@ -1297,6 +1491,7 @@ template<class T> class Texture<T>::Impl {
 					, FRACTIONAL_X	///< Fractional horizontal translation, interpolate horizontally only.
 					, FRACTIONAL_Y	///< Fractional vertical translation, interpolate vertically only.
 					, ARBITRARY		///< Arbitrary, interpolate every pixel, slowest algo.
+					, NEAREST		///< Arbitrary without interpolation, picks the nearest pixel.
 				};
 	protected:	IntRect imageBounds;
 	protected:	int imageStride;
@@ -1314,7 +1509,7 @@ template<class T> class Texture<T>::Impl {
 	protected:	int hop;
 };
 
-template<class T> Texture<T>::Impl::Impl(const Raster<T>& image, bool wrap, const AffineTransformation& transformation, const IntRect& sourceRect)
+template<class T> Texture<T>::Impl::Impl(const Raster<T>& image, bool wrap, const AffineTransformation& transformation, const IntRect& sourceRect, bool interpolate)
 	: imageBounds(image.calcBounds().calcIntersection(sourceRect))
 	, imageStride(image.getStride())
 	, imagePixels(image.getPixelPointer() + imageBounds.top * imageStride + imageBounds.left) // Offset image so that 0, 0 is always top-left coordinate.
@@ -1363,6 +1558,12 @@ template<class T> Texture<T>::Impl::Impl(const Raster<T>& image, bool wrap, cons
 			transformType = IDENTITY;
 		} else if (noInterpolation) {
 			transformType = INTEGER;
+		} else if (!interpolate) {
+			// Offset by half a pixel so that truncating the sample position rounds to the nearest pixel.
+			
+			ox = add(ox, toFixed32_32(0, 0x80000000U));
+			oy = add(oy, toFixed32_32(0, 0x80000000U));
+			transformType = NEAREST;
 		} else if (high32(dxx) >= -1 && high32(dxx) <= 0 && high32(dxy) == 0 && low32(dxy) == 0) {
 			transformType = UPSCALE;
 		} else if (!verticalInterpolation) {
@@ -1573,6 +1774,15 @@ template<class T> int Texture<T>::Impl::interpolateInside(int length, Fixed32_32
 		}
 		break;
 		
+		case NEAREST: {
+			typename T::Pixel* const pixels = output.addVariable(spanLength, opaque);
+			for (int i = 0; i < spanLength; ++i) {
+				pixels[i] = *s;
+				s += hop + addCarry(sx, dxx) + (-addCarry(sy, dxy) & imageStride);
+			}
+		}
+		break;
+		
 		default: assert(0);
 	}
 	
@@ -1597,7 +1807,8 @@ template<class T> void Texture<T>::Impl::calcStartPosition(int x, int y, Fixed32
 		case UPSCALE:
 		case FRACTIONAL_X:
 		case FRACTIONAL_Y:
-		case ARBITRARY: {
+		case ARBITRARY:
+		case NEAREST: {
 			// FIX : MUST SUPPORT SIGNED MULT!
 			sx = add(add(ox, multiply(static_cast<UInt32>(x), dxx)), multiply(static_cast<UInt32>(y), dyx));
 			sy = add(add(oy, multiply(static_cast<UInt32>(x), dxy)), multiply(static_cast<UInt32>(y), dyy));
@@ -1608,8 +1819,8 @@ template<class T> void Texture<T>::Impl::calcStartPosition(int x, int y, Fixed32
 	}
 }
 
-template<class T> Texture<T>::Texture(const Raster<T>& image, bool wrap, const AffineTransformation& transformation, const IntRect& sourceRect)
-	: impl(new Impl(image, wrap, transformation, sourceRect))
+template<class T> Texture<T>::Texture(const Raster<T>& image, bool wrap, const AffineTransformation& transformation, const IntRect& sourceRect, bool interpolate)
+	: impl(new Impl(image, wrap, transformation, sourceRect, interpolate))
 {
 }
 
@@ -1652,7 +1863,8 @@ template<class T> void Texture<T>::render(int x, int y, int length, SpanBuffer<T
 	int rowMargin = 1;
 	switch (impl->transformType) {
 		case Impl::IDENTITY:
-		case Impl::INTEGER: {
+		case Impl::INTEGER:
+		case Impl::NEAREST: {
 			colMargin = 0;
 			rowMargin = 0;
 		}
@@ -22,10 +22,17 @@
 **/
 
 #include <algorithm>
+#include <atomic>
+#include <new>
+#include <type_traits>
 #include <iostream>
 #include <cstring>
 #include <locale>
 #include <cmath>
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <thread>
 #include "IVG.h"
 
 namespace IVG {
@@ -46,6 +53,7 @@ using IMPD::UniChar;
 const double DEGREES = PI2 / 360.0;
 const double MIN_CURVE_QUALITY = 0.001;
 const double MAX_CURVE_QUALITY = 100.0;
+const double DRAFT_CURVE_QUALITY = 0.25;
 const double COORDINATE_LIMIT = 1000000.0;
 
 void checkBounds(const IntRect& bounds) {
@@ -352,7 +360,47 @@ bool buildPathFromSVG(const String& svgSource, double curveQuality, Path& path,
 
 /* --- MaskMakerCanvas --- */
 
-MaskMakerCanvas::MaskMakerCanvas(const IntRect& bounds) : mask8RLE(new RLERaster<Mask8>(bounds)) { }
+// Deleter for masks in State that releases their charge (see MemoryBudget).
+class ChargedMaskDeleter {
+	public:		ChargedMaskDeleter(MemoryBudget* budget, size_t bytes) : budget(budget), bytes(bytes) { }
+	public:		void operator()(const RLERaster<Mask8>* mask) const {
+					delete mask;
+					if (budget != 0) budget->release(bytes);
+				}
+	protected:	MemoryBudget* budget;
+	protected:	size_t bytes;
+};
+
+MaskMakerCanvas::MaskMakerCanvas(const IntRect& bounds, const IntRect& clampBounds, MemoryBudget* budget)
+		: bounds(bounds), clampBounds(clampBounds), coverageCharge(budget), touched(0, 0, 0, 0) { }
+
+/*
+	Grows `coverage` to include `area` (which must be inside `bounds`). When it has to grow, it grows by half its size
+	in that direction so that a mask drawn shape by shape is copied a limited number of times.
+*/
+void MaskMakerCanvas::cover(const IntRect& area) {
+	const IntRect oldArea = (coverage.get() != 0 ? coverage->calcBounds() : IntRect(0, 0, 0, 0));
+	IntRect newArea = (oldArea.isEmpty() ? area : oldArea.calcUnion(area));
+	if (newArea == oldArea) {
+		return;
+	}
+	if (!oldArea.isEmpty()) {
+		const int left = (newArea.left < oldArea.left ? newArea.left - oldArea.width / 2 : newArea.left);
+		const int top = (newArea.top < oldArea.top ? newArea.top - oldArea.height / 2 : newArea.top);
+		const int right = newArea.calcRight() + (newArea.calcRight() > oldArea.calcRight() ? oldArea.width / 2 : 0);
+		const int bottom = newArea.calcBottom() + (newArea.calcBottom() > oldArea.calcBottom() ? oldArea.height / 2 : 0);
+		newArea = IntRect(left, top, right - left, bottom - top).calcIntersection(bounds);
+	}
+	const size_t newBytes = static_cast<size_t>(newArea.width) * newArea.height;
+	coverageCharge.add(newBytes);
+	std::unique_ptr< SelfContainedRaster<Mask8> > newCoverage(new SelfContainedRaster<Mask8>(newArea));
+	*newCoverage = Solid<Mask8>(0);
+	if (coverage.get() != 0) {
+		newCoverage->fill(*coverage, oldArea);
+	}
+	coverage.swap(newCoverage);
+	coverageCharge.remove(coverageCharge.getBytes() - newBytes);
+}
 
 void MaskMakerCanvas::parsePaint(Interpreter& impd, IVGExecutor& executor, Context& context, ArgumentsContainer& args
 		, Paint& paint) const {
@@ -360,51 +408,184 @@ void MaskMakerCanvas::parsePaint(Interpreter& impd, IVGExecutor& executor, Conte
 }
 
 void MaskMakerCanvas::blendWithARGB32(const Renderer<ARGB32>& source) {
-	(*mask8RLE) |= Converter<ARGB32, Mask8>(source);
+	blendWithMask8(Converter<ARGB32, Mask8>(source));
 }
 
-void MaskMakerCanvas::blendWithMask8(const Renderer<Mask8>& source) { (*mask8RLE) |= source; }
+void MaskMakerCanvas::blendWithMask8(const Renderer<Mask8>& source) {
+	const IntRect area = bounds.calcIntersection(source.calcBounds());
+	if (!area.isEmpty()) {
+		cover(area);
+		touched = touched.calcUnion(area);
+		*coverage |= source;
+	}
+}
+
+void MaskMakerCanvas::blendPairWithMask8(const Renderer<Mask8>& first, const Renderer<Mask8>& second) {
+	const IntRect area = bounds.calcIntersection(first.calcBounds()).calcUnion(bounds.calcIntersection(second.calcBounds()));
+	if (!area.isEmpty()) {
+		cover(area);
+		touched = touched.calcUnion(area);
+		coverage->blendBoth(first, second);
+	}
+}
 
 void MaskMakerCanvas::defineBounds(const IntRect& newBounds) {
 	(void)newBounds;
 	Interpreter::throwRunTimeError("Bounds cannot be declared for mask");
 }
 
-IntRect MaskMakerCanvas::getBounds() const { return mask8RLE->calcBounds(); }
+IntRect MaskMakerCanvas::getBounds() const { return bounds; }
+
+IntRect MaskMakerCanvas::getClampBounds() const { return clampBounds; }
 
 RLERaster<Mask8>* MaskMakerCanvas::finish(bool invert) {
-	if (invert) (*mask8RLE) = ~(*mask8RLE);
+	// Optimizer turns runs of equal coverage back into solid spans, as blending into the RLERaster would have.
+	std::unique_ptr< RLERaster<Mask8> > mask8RLE(coverage.get() != 0
+			? new RLERaster<Mask8>(bounds, Optimizer<Mask8>(Clipper<Mask8>(*coverage, touched)))
+			: new RLERaster<Mask8>(bounds));
+	if (invert) mask8RLE->invert();
 	return mask8RLE.release();
 }
 
+/* --- MemoryBudget --- */
+
+MemoryBudget::MemoryBudget(size_t maxBytes) : maxBytes(maxBytes), usedBytes(0), peakBytes(0) { }
+
+void MemoryBudget::charge(size_t bytes) {
+	const size_t total = (usedBytes += bytes);
+	if (total < bytes || total > maxBytes) {
+		usedBytes -= bytes;
+		Interpreter::throwRunTimeError(String("Memory budget exceeded (")
+				+ Interpreter::toString(static_cast<double>(maxBytes)) + " bytes)");
+	}
+	size_t peak = peakBytes;
+	while (total > peak && !peakBytes.compare_exchange_weak(peak, total)) { }
+}
+
+void MemoryBudget::release(size_t bytes) {
+	assert(bytes <= usedBytes);
+	usedBytes -= bytes;
+}
+
+MemoryCharge::MemoryCharge(MemoryBudget* budget, size_t bytes) : budget(budget), bytes(0) {
+	add(bytes);
+}
+
+void MemoryCharge::setBudget(MemoryBudget* newBudget) {
+	assert(bytes == 0);
+	budget = newBudget;
+}
+
+void MemoryCharge::add(size_t moreBytes) {
+	if (budget != 0 && moreBytes != 0) {
+		budget->charge(moreBytes);
+		bytes += moreBytes;
+	}
+}
+
+void MemoryCharge::remove(size_t fewerBytes) {
+	if (budget != 0 && fewerBytes != 0) {
+		assert(fewerBytes <= bytes);
+		budget->release(fewerBytes);
+		bytes -= fewerBytes;
+	}
+}
+
+MemoryCharge::~MemoryCharge() {
+	remove(bytes);
+}
+
+/* --- RenderStats --- */
+
+RenderStats::RenderStats() {
+	reset();
+}
+
+void RenderStats::reset() {
+	for (int i = 0; i < PHASE_COUNT; ++i) {
+		seconds[i] = 0.0;
+		calls[i] = 0;
+	}
+	vertexCount = 0;
+	segmentCount = 0;
+	pixelCount = 0;
+	currentPhase = -1;
+}
+
+const char* RenderStats::getPhaseName(Phase phase) {
+	static const char* NAMES[PHASE_COUNT] = {
+		"argument parsing", "path construction", "polygon masks", "blending", "patterns and masks", "loading"
+	};
+	assert(0 <= phase && phase < PHASE_COUNT);
+	return NAMES[phase];
+}
+
+PhaseTimer::PhaseTimer(RenderStats* stats, RenderStats::Phase phase) : stats(stats), previousPhase(-1) {
+	if (stats != 0) {
+		const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		if (stats->currentPhase >= 0) {
+			stats->seconds[stats->currentPhase] += std::chrono::duration<double>(now - stats->phaseStart).count();
+		}
+		previousPhase = stats->currentPhase;
+		stats->currentPhase = phase;
+		stats->phaseStart = now;
+		++stats->calls[phase];
+	}
+}
+
+void PhaseTimer::stop() {
+	if (stats != 0) {
+		const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		stats->seconds[stats->currentPhase] += std::chrono::duration<double>(now - stats->phaseStart).count();
+		stats->currentPhase = previousPhase;	// resumes the interrupted phase
+		stats->phaseStart = now;
+		stats = 0;
+	}
+}
+
+PhaseTimer::~PhaseTimer() {
+	stop();
+}
+
 /* --- Options --- */
 
 void Options::setGamma(double newGamma) {
 	assert(0.0 < gamma);
 	if (gamma != newGamma) {
 		gamma = newGamma;
-		gammaTable = ((fabs(gamma - 1.0) < 0.0001) ? 0 : new GammaTable(gamma));
+		gammaTable = ((fabs(gamma - 1.0) < 0.0001 || draftQuality) ? 0 : new GammaTable(gamma));
 	}
 }
 
 /* --- CombinedMask --- */
 
+// The gamma lookup and mask multiplier are constructed in place when needed, so no heap allocation takes place.
 class CombinedMask {
+	public:		typedef Lookup<Mask8, LookupTable<Mask8> > GammaLookup;
+	public:		typedef Multiplier<Mask8, Mask8> MaskMultiplier;
 	public:		CombinedMask(const Renderer<Mask8>& region, const Renderer<Mask8>* mask, const GammaTable* gammaTable)
-						: output(&region) {
+						: output(&region), lookup(0), multiplier(0) {
 					if (gammaTable != 0) {
-						lookup.reset(new Lookup<Mask8, LookupTable<Mask8> > (*output, *gammaTable));
-						output = lookup.get();
+						lookup = new(&lookupStorage) GammaLookup(*output, *gammaTable);
+						output = lookup;
 					}
 					if (mask != 0) {
-						multiplier.reset(new Multiplier<Mask8, Mask8>(*output, *mask));
-						output = multiplier.get();
+						multiplier = new(&multiplierStorage) MaskMultiplier(*output, *mask);
+						output = multiplier;
 					}
 				}
 	public:		operator const Renderer<Mask8>&() const { return *output; }
+	public:		~CombinedMask() {
+					if (multiplier != 0) multiplier->~MaskMultiplier();
+					if (lookup != 0) lookup->~GammaLookup();
+				}
+	protected:	CombinedMask(const CombinedMask& that); // not copyable, output may point into this object
+	protected:	CombinedMask& operator=(const CombinedMask& that);
 	protected:	const Renderer<Mask8>* output;
-	protected:	std::unique_ptr< Lookup<Mask8, LookupTable<Mask8> > > lookup;
-	protected:	std::unique_ptr< Multiplier<Mask8, Mask8> > multiplier;
+	protected:	GammaLookup* lookup;
+	protected:	MaskMultiplier* multiplier;
+	protected:	std::aligned_storage<sizeof (GammaLookup), alignof(GammaLookup)>::type lookupStorage;
+	protected:	std::aligned_storage<sizeof (MaskMultiplier), alignof(MaskMultiplier)>::type multiplierStorage;
 };
 
 /* --- Colors --- */
@@ -622,6 +803,25 @@ static double calcCurveQualityForTransform(const AffineTransformation& xf) {
 			, square(xf.matrix[0][1]) + square(xf.matrix[1][1]))), MIN_CURVE_QUALITY), MAX_CURVE_QUALITY);
 }
 
+struct BuildPathFontInfo {
+	double mpu;
+	AffineTransformation scaledXF;
+	double effectiveQuality;
+};
+
+static void makeFontInfos(const std::vector<const Font*>& fonts, double size, const AffineTransformation& glyphTransform
+		, double curveQuality, std::vector<BuildPathFontInfo>& fontInfos) {
+	fontInfos.reserve(fonts.size());
+	for (std::vector<const Font*>::const_iterator fontIt = fonts.begin(); fontIt != fonts.end(); ++fontIt) {
+		BuildPathFontInfo fontInfo;
+		assert(*fontIt != 0);
+		fontInfo.mpu = 1.0 / (*fontIt)->getMetrics().upm;
+		fontInfo.scaledXF = AffineTransformation().scale(fontInfo.mpu).transform(glyphTransform).scale(size);
+		fontInfo.effectiveQuality = calcCurveQualityForTransform(fontInfo.scaledXF) * curveQuality;
+		fontInfos.push_back(fontInfo);
+	}
+}
+
 /* --- Gradients --- */
 
 struct GradientSpec {
@@ -696,15 +896,169 @@ GradientSpec::GradientSpec(const Interpreter& impd, const String& source, bool r
 
 /* --- Patterns --- */
 
-PatternBase::PatternBase(int scale) : scale(scale) { }
+/**
+	   Stands in for an inherited painter while a pattern is drawn to find out if the pattern depends on it.
+**/
+class PainterProbe : public Painter {
+	public:		PainterProbe(const std::shared_ptr<const Painter>& painter) : painter(painter), used(false) { }
+	public:		virtual bool isVisible(const Paint& withPaint) const { used = true; return painter->isVisible(withPaint); }
+	public:		virtual void doPaint(Paint& withPaint, Context& inContext, const Rect<double>& sourceBounds
+						, const Renderer<Mask8>& mask) const {
+					used = true;
+					painter->doPaint(withPaint, inContext, sourceBounds, mask);
+				}
+	public:		bool wasUsed() const { return used; }
+	protected:	const std::shared_ptr<const Painter> painter;
+	protected:	mutable bool used;
+};
+
+PatternBase::PatternBase(int scale, MemoryBudget* budget) : scale(scale), imageCharge(budget) { }
 
-void PatternBase::makePattern(Interpreter& impd, IVGExecutor& executor, Context& parentContext, const String& source) {
+void PatternBase::makePattern(Interpreter& impd, IVGExecutor& executor, Context& parentContext, const String& source
+		, bool usedPaints[PatternCache::PAINT_COUNT]) {
 	Context patternContext(*this, parentContext);
-	patternContext.initState.transformation = AffineTransformation().scale(scale);
-	patternContext.initState.mask = 0;
-	patternContext.state.transformation = patternContext.initState.transformation;
-	patternContext.state.mask = 0;
+	State& initState = patternContext.initState;
+	initState.transformation = AffineTransformation().scale(scale);
+	initState.mask = 0;
+	Paint* paints[PatternCache::PAINT_COUNT] = {
+		&initState.fill, &initState.pen.paint, &initState.textStyle.fill, &initState.textStyle.outline.paint
+	};
+	std::shared_ptr<PainterProbe> probes[PatternCache::PAINT_COUNT];
+	if (usedPaints != 0) {
+		for (int i = 0; i < PatternCache::PAINT_COUNT; ++i) {
+			if (static_cast<const Painter*>(paints[i]->painter) != 0) {
+				probes[i].reset(new PainterProbe(paints[i]->painter.getShared()));
+				paints[i]->painter.reset(probes[i]);
+			}
+		}
+	}
+	patternContext.state = initState;
 	executor.runInNewContext(impd, patternContext, source);
+	if (usedPaints != 0) {
+		for (int i = 0; i < PatternCache::PAINT_COUNT; ++i) {
+			usedPaints[i] = (!probes[i] || probes[i]->wasUsed());
+		}
+	}
+}
+
+/* --- PatternCache --- */
+
+PatternCache::PatternCache(size_t maxBytes) : maxBytes(maxBytes), usedBytes(0) { }
+
+bool PatternCache::isCacheable(const String& source) {
+	static const char* const IMPURE_INSTRUCTIONS[] = {
+		"define", "include", "local", "meta", "return", "stop", "trace"
+	};
+	for (String::size_type i = source.find_first_of("$="); i != String::npos; i = source.find_first_of("$=", i + 1)) {
+		String::size_type backslashes = 0;
+		while (backslashes < i && source[i - backslashes - 1] == '\\') {
+			++backslashes;
+		}
+		if ((backslashes & 1) == 0) {	// escaped characters (e.g. glyph \$ in fonts) are literal
+			return false;
+		}
+	}
+	String lower(source);
+	std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+	if (lower.find("def(") != String::npos || lower.find("caret:") != String::npos) {
+		return false;
+	}
+	static const char* const DELIMITERS = " \t\r\n;[]{}";
+	String::size_type i = 0;
+	while ((i = lower.find_first_not_of(DELIMITERS, i)) != String::npos) {
+		const String::size_type e = min(lower.find_first_of(DELIMITERS, i), lower.size());
+		const String token(lower, i, e - i);
+		for (size_t j = 0; j < sizeof (IMPURE_INSTRUCTIONS) / sizeof (*IMPURE_INSTRUCTIONS); ++j) {
+			if (token == IMPURE_INSTRUCTIONS[j]) {
+				return false;
+			}
+		}
+		i = e;
+	}
+	return true;
+}
+
+static bool equalPaints(const Paint& a, const Paint& b) {
+	return static_cast<const Painter*>(a.painter) == static_cast<const Painter*>(b.painter) && a.opacity == b.opacity
+			&& a.relative == b.relative && a.transformation == b.transformation;
+}
+
+static bool equalStrokes(const Stroke& a, const Stroke& b) {
+	return a.width == b.width && a.caps == b.caps && a.joints == b.joints && a.miterLimit == b.miterLimit
+			&& a.dash == b.dash && a.gap == b.gap && a.dashOffset == b.dashOffset;
+}
+
+bool PatternCache::matches(const Entry& entry, const State& state) {
+	const State& other = entry.inheritedState;
+	if (state.options.gamma != other.options.gamma || state.options.curveQuality != other.options.curveQuality
+			|| state.options.patternResolution != other.options.patternResolution
+			|| state.options.draftQuality != other.options.draftQuality
+			|| state.options.analyticShapes != other.options.analyticShapes
+			|| state.options.adaptiveImageResolution != other.options.adaptiveImageResolution
+			|| state.evenOddFillRule != other.evenOddFillRule || state.textCaret.x != other.textCaret.x
+			|| state.textCaret.y != other.textCaret.y || state.textStyle.fontName != other.textStyle.fontName
+			|| state.textStyle.glyphTransform != other.textStyle.glyphTransform
+			|| state.textStyle.size != other.textStyle.size
+			|| state.textStyle.letterSpacing != other.textStyle.letterSpacing) {
+		return false;
+	}
+	return (!entry.usedPaints[FILL_PAINT] || equalPaints(state.fill, other.fill))
+			&& (!entry.usedPaints[PEN_PAINT] || (equalPaints(state.pen.paint, other.pen.paint)
+			&& equalStrokes(state.pen, other.pen)))
+			&& (!entry.usedPaints[TEXT_FILL_PAINT] || equalPaints(state.textStyle.fill, other.textStyle.fill))
+			&& (!entry.usedPaints[TEXT_OUTLINE_PAINT] || (equalPaints(state.textStyle.outline.paint
+			, other.textStyle.outline.paint) && equalStrokes(state.textStyle.outline, other.textStyle.outline)));
+}
+
+std::shared_ptr<const Painter> PatternCache::find(const String& source, int pixelBytes, int scale
+		, unsigned long fontGeneration, const State& inheritedState) {
+	const std::pair<EntryMap::iterator, EntryMap::iterator> range = entries.equal_range(source);
+	for (EntryMap::iterator it = range.first; it != range.second; ++it) {
+		Entry& entry = it->second;
+		if (entry.pixelBytes == pixelBytes && entry.scale == scale && entry.fontGeneration == fontGeneration
+				&& matches(entry, inheritedState)) {
+			uses.splice(uses.begin(), uses, entry.use);
+			return entry.painter;
+		}
+	}
+	return std::shared_ptr<const Painter>();
+}
+
+void PatternCache::store(const String& source, int pixelBytes, int scale, unsigned long fontGeneration
+		, const State& inheritedState, const bool usedPaints[PAINT_COUNT], const std::shared_ptr<const Painter>& painter
+		, size_t bytes) {
+	if (bytes > maxBytes) {
+		return;
+	}
+	while (usedBytes + bytes > maxBytes && !entries.empty()) {
+		EntryMap::iterator oldest = entries.lower_bound(*uses.back().first);
+		while (&oldest->second != uses.back().second) {
+			++oldest;
+		}
+		usedBytes -= oldest->second.bytes;
+		uses.pop_back();
+		entries.erase(oldest);
+	}
+	Entry entry;
+	entry.pixelBytes = pixelBytes;
+	entry.scale = scale;
+	entry.fontGeneration = fontGeneration;
+	entry.inheritedState = inheritedState;
+	entry.inheritedState.transformation = AffineTransformation();
+	entry.inheritedState.mask = 0;
+	std::copy(usedPaints, usedPaints + PAINT_COUNT, entry.usedPaints);
+	entry.painter = painter;
+	entry.bytes = bytes;
+	const EntryMap::iterator it = entries.insert(EntryMap::value_type(source, entry));
+	uses.push_front(UseList::value_type(&it->first, &it->second));
+	it->second.use = uses.begin();
+	usedBytes += bytes;
+}
+
+void PatternCache::clear() {
+	uses.clear();
+	entries.clear();
+	usedBytes = 0;
 }
 
 template<> void PatternPainter<Mask8>::blendWithARGB32(const Renderer<ARGB32>& source) {
@@ -717,25 +1071,147 @@ template<> void PatternPainter<ARGB32>::blendWithMask8(const Renderer<Mask8>& so
 	assert(0);
 }
 
+template<> void PatternPainter<Mask8>::blendPairWithARGB32(const Renderer<ARGB32>& first
+		, const Renderer<ARGB32>& second) {
+	blendWithARGB32(first);
+	blendWithARGB32(second);
+}
+
+template<> void PatternPainter<ARGB32>::blendPairWithMask8(const Renderer<Mask8>& first, const Renderer<Mask8>& second) {
+	(void)first;
+	(void)second;
+	assert(0);
+}
+
 /* --- Masks --- */
 
 FadedMask::FadedMask(const Renderer<Mask8>& mask, Mask8::Pixel opacity)
 		: solid(opacity), multiplier(mask, solid), output(opacity != 255 ? multiplier : mask) { }
 FadedMask::operator const Renderer<Mask8>&() const { return output; }
 
+/* --- PaintCache --- */
+
+PaintCache::PaintCache(size_t maxEntries) : maxEntries(maxEntries) { }
+
+template<> PaintCache::Tables<ARGB32>& PaintCache::accessTables<ARGB32>() { return argb32Tables; }
+template<> PaintCache::Tables<Mask8>& PaintCache::accessTables<Mask8>() { return mask8Tables; }
+
+template<class PIXEL_TYPE> std::shared_ptr<const Painter> PaintCache::internColor(typename PIXEL_TYPE::Pixel color) {
+	Tables<PIXEL_TYPE>& tables = accessTables<PIXEL_TYPE>();
+	std::shared_ptr<const Painter>& painter = tables.colorPainters[color];
+	if (!painter) {
+		if (tables.colorPainters.size() > maxEntries) {
+			tables.colorPainters.clear();
+			return internColor<PIXEL_TYPE>(color);
+		}
+		painter.reset(new ColorPainter<PIXEL_TYPE>(color));
+	}
+	return painter;
+}
+
+template<class PIXEL_TYPE> std::shared_ptr<const Painter> PaintCache::internGradient(bool radial, const double coords[4]
+		, const std::vector<typename Gradient<PIXEL_TYPE>::Stop>& stops) {
+	Tables<PIXEL_TYPE>& tables = accessTables<PIXEL_TYPE>();
+	typename Tables<PIXEL_TYPE>::GradientKey key;
+	key.first.push_back(radial ? 1.0 : 0.0);
+	key.first.insert(key.first.end(), coords, coords + 4);
+	for (typename std::vector<typename Gradient<PIXEL_TYPE>::Stop>::const_iterator it = stops.begin()
+			; it != stops.end(); ++it) {
+		key.second.push_back(std::make_pair(it->position, it->color));
+	}
+	std::shared_ptr<const Painter>& painter = tables.gradientPainters[key];
+	if (!painter) {
+		if (tables.gradientPainters.size() > maxEntries || tables.gradients.size() >= maxEntries) {
+			tables.gradientPainters.clear();
+			tables.gradients.clear();
+			return internGradient<PIXEL_TYPE>(radial, coords, stops);
+		}
+		const int count = IMPD::lossless_cast<int>(stops.size());
+		const typename Gradient<PIXEL_TYPE>::Stop* points = (stops.empty() ? 0 : &stops[0]);
+		std::shared_ptr< const Gradient<PIXEL_TYPE> >& gradient = tables.gradients[key.second];
+		if (!gradient) {
+			gradient.reset(new Gradient<PIXEL_TYPE>(count, points));
+		}
+		if (!radial) {
+			painter.reset(new LinearGradientPainter<PIXEL_TYPE>(coords[0], coords[1], coords[2], coords[3]
+					, gradient, count, points));
+		} else {
+			painter.reset(new RadialGradientPainter<PIXEL_TYPE>(coords[0], coords[1], coords[2], coords[3]
+					, gradient, count, points));
+		}
+	}
+	return painter;
+}
+
+void PaintCache::clear() {
+	argb32Tables = Tables<ARGB32>();
+	mask8Tables = Tables<Mask8>();
+}
+
+/* --- Paint --- */
+
+void Paint::doPaint(Context& inContext, const Rect<double>& sourceBounds, const Renderer<Mask8>& mask) {
+	assert(isVisible());
+	const Painter* p = painter;
+	if (p != 0) {
+		RenderStats* const stats = inContext.accessState().options.stats;
+		const PhaseTimer timer(stats, RenderStats::BLENDING);
+		if (stats != 0) {
+			const IntRect bounds = mask.calcBounds().calcIntersection(inContext.accessCanvas().getBounds());
+			if (bounds.width > 0 && bounds.height > 0) {
+				stats->pixelCount += static_cast<size_t>(bounds.width) * bounds.height;
+			}
+		}
+		p->doPaint(*this, inContext, sourceBounds, mask);
+	}
+}
+
 /* --- Canvas --- */
 
 template<> void Canvas::blend<ARGB32>(const Renderer<ARGB32>& source) { blendWithARGB32(source); }
 template<> void Canvas::blend<Mask8>(const Renderer<Mask8>& source) { blendWithMask8(source); }
+template<> void Canvas::blendPair<ARGB32>(const Renderer<ARGB32>& first, const Renderer<ARGB32>& second) {
+	blendPairWithARGB32(first, second);
+}
+template<> void Canvas::blendPair<Mask8>(const Renderer<Mask8>& first, const Renderer<Mask8>& second) {
+	blendPairWithMask8(first, second);
+}
+void Canvas::enqueue(DrawCommand* command) {
+	delete command;
+	Interpreter::throwRunTimeError("Canvas does not support deferred drawing");
+}
 
 template<class PIXEL_TYPE> void Canvas::parsePaintOfType(Interpreter& impd, IVGExecutor& executor, Context& context, ArgumentsContainer& args, Paint& paint) const {
 	const String* s;
 
 	// Important to parse pattern first so that we don't apply other attributes (e.g. "relative") before we draw the texture.
 	if ((s = args.fetchOptional("pattern", false)) != 0) {
-		std::unique_ptr< PatternPainter<PIXEL_TYPE> > patternPainter(new PatternPainter<PIXEL_TYPE>(context.calcPatternScale()));
-		patternPainter->makePattern(impd, executor, context, *s);
-		paint.painter = patternPainter.release();
+		PatternCache& patternCache = executor.accessPatternCache();
+		const int scale = context.calcPatternScale();
+		const int pixelBytes = sizeof (typename PIXEL_TYPE::Pixel);
+		const unsigned long fontGeneration = executor.getFontGeneration();
+		std::shared_ptr<const Painter> cachedPainter = patternCache.find(*s, pixelBytes, scale, fontGeneration
+				, context.accessState());
+		if (cachedPainter) {
+			paint.painter.reset(cachedPainter);
+		} else {
+			const PhaseTimer timer(context.accessState().options.stats, RenderStats::PATTERNS_AND_MASKS);
+			std::shared_ptr< PatternPainter<PIXEL_TYPE> > patternPainter(new PatternPainter<PIXEL_TYPE>(scale
+					, context.accessState().options.memoryBudget));
+			if (PatternCache::isCacheable(*s)) {
+				const State inheritedState(context.accessState());
+				bool usedPaints[PatternCache::PAINT_COUNT];
+				patternPainter->makePattern(impd, executor, context, *s, usedPaints);
+				const size_t bytes = (patternPainter->isVisible(paint)
+						? static_cast<size_t>(patternPainter->getBounds().width) * patternPainter->getBounds().height
+						* pixelBytes : 0);
+				patternCache.store(*s, pixelBytes, scale, fontGeneration, inheritedState, usedPaints, patternPainter
+						, bytes);
+			} else {
+				patternPainter->makePattern(impd, executor, context, *s);
+			}
+			paint.painter.reset(patternPainter);
+		}
 	} else if ((s = args.fetchOptional("gradient")) != 0) {
 		GradientSpec spec(impd, *s, true);
 		vector< typename Gradient<PIXEL_TYPE>::Stop > stops(spec.stops.size());
@@ -748,82 +1224,370 @@ template<class PIXEL_TYPE> void Canvas::parsePaintOfType(Interpreter& impd, IVGE
 		}
 		assert(outIt == stops.end());
 		
-		if (!spec.isRadial) {
-			paint.painter = new LinearGradientPainter<PIXEL_TYPE>(
-					spec.coords[0], spec.coords[1], spec.coords[2], spec.coords[3]
-					, IMPD::lossless_cast<int>(stops.size()), (stops.empty() ? 0 : &stops[0]));
-		} else {	// NuXPixels radial ascend goes to max in the center
-			paint.painter = new RadialGradientPainter<PIXEL_TYPE>(
-					spec.coords[0], spec.coords[1], spec.coords[2], spec.coords[3]
-					, IMPD::lossless_cast<int>(stops.size()), (stops.empty() ? 0 : &stops[0]));
-		}
+		// NuXPixels radial ascend goes to max in the center
+		paint.painter.reset(executor.accessPaintCache().internGradient<PIXEL_TYPE>(spec.isRadial, spec.coords, stops));
 	} else if ((s = args.fetchOptional(0)) != 0) {
-		paint.painter = new ColorPainter<PIXEL_TYPE>(parseColor<PIXEL_TYPE>(impd, *s));
+		paint.painter.reset(executor.accessPaintCache().internColor<PIXEL_TYPE>(parseColor<PIXEL_TYPE>(impd, *s)));
 	}
 	if ((s = args.fetchOptional("opacity")) != 0) paint.opacity = parseOpacity(impd, *s);
 	if ((s = args.fetchOptional("relative")) != 0) paint.relative = impd.toBool(*s);
 	if ((s = args.fetchOptional("transform", false)) != 0) paint.transformation = parseTransformationBlock(impd, *s);
 }
 
+/* --- FillCatchingCanvas --- */
+
+/*
+	Context::draw() lets the fill paint blend into a FillCatchingCanvas. When it does, the path is stroked into a
+	StrokeCatchingCanvas that holds on to the fill renderer, so the stroke paint's blend can pass both renderers to
+	Canvas::blendPair() and have them composited in a single pass over the destination. The result is identical to
+	filling and then stroking. Painters blend exactly once per doPaint(), which is what makes this work (a second
+	blend of the fill would land on top of the stroke), so both canvases assert it.
+*/
+
+template<class PIXEL_TYPE> class StrokeCatchingCanvas : public Canvas {
+	public:		StrokeCatchingCanvas(Canvas& target, const Renderer<PIXEL_TYPE>& fillSource)
+						: target(target), fillSource(fillSource), caught(false) { }
+	public:		virtual void parsePaint(Interpreter& impd, IVGExecutor& executor, Context& context
+						, ArgumentsContainer& args, Paint& paint) const {
+					target.parsePaint(impd, executor, context, args, paint);
+				}
+	public:		virtual void blendWithARGB32(const Renderer<ARGB32>& source) { blendStroke(source); }
+	public:		virtual void blendWithMask8(const Renderer<Mask8>& source) { blendStroke(source); }
+	public:		virtual void defineBounds(const IntRect& newBounds) { target.defineBounds(newBounds); }
+	public:		virtual IntRect getBounds() const { return target.getBounds(); }
+	public:		virtual IntRect getClampBounds() const { return target.getClampBounds(); }
+	public:		bool hasCaught() const { return caught; }
+	protected:	void blendStroke(const Renderer<PIXEL_TYPE>& source) {
+					assert(!caught);
+					if (!caught) {
+						target.blendPair(fillSource, source);
+						caught = true;
+					} else {
+						target.blend(source);
+					}
+				}
+	protected:	template<class T> void blendStroke(const Renderer<T>& source) {	// fill and stroke of different pixel types
+					assert(!caught);
+					if (!caught) {
+						target.blend(fillSource);
+						caught = true;
+					}
+					target.blend(source);
+				}
+	protected:	Canvas& target;
+	protected:	const Renderer<PIXEL_TYPE>& fillSource;
+	protected:	bool caught;
+};
+
+class FillCatchingCanvas : public Canvas {
+	public:		FillCatchingCanvas(Context& context, const Path& path, const Rect<double>& pathBounds)
+						: context(context), target(*context.canvas), path(path), pathBounds(pathBounds), stroked(false) {
+					context.canvas = this;
+				}
+	public:		virtual void parsePaint(Interpreter& impd, IVGExecutor& executor, Context& context
+						, ArgumentsContainer& args, Paint& paint) const {
+					target.parsePaint(impd, executor, context, args, paint);
+				}
+	public:		virtual void blendWithARGB32(const Renderer<ARGB32>& source) { catchFill(source); }
+	public:		virtual void blendWithMask8(const Renderer<Mask8>& source) { catchFill(source); }
+	public:		virtual void defineBounds(const IntRect& newBounds) { target.defineBounds(newBounds); }
+	public:		virtual IntRect getBounds() const { return target.getBounds(); }
+	public:		virtual IntRect getClampBounds() const { return target.getClampBounds(); }
+	public:		void finish() {	// strokes the path unless that has already happened together with the fill
+					context.canvas = &target;
+					if (!stroked) {
+						stroked = true;
+						context.stroke(path, context.state.pen, pathBounds, 1.0);
+					}
+				}
+	public:		virtual ~FillCatchingCanvas() { context.canvas = &target; }
+	protected:	template<class T> void catchFill(const Renderer<T>& source) {
+					assert(!stroked);
+					if (stroked) {
+						target.blend(source);
+					} else {
+						stroked = true;
+						StrokeCatchingCanvas<T> strokeCatcher(target, source);
+						context.canvas = &strokeCatcher;
+						context.stroke(path, context.state.pen, pathBounds, 1.0);
+						context.canvas = this;
+						if (!strokeCatcher.hasCaught()) {
+							target.blend(source);
+						}
+					}
+				}
+	protected:	Context& context;
+	protected:	Canvas& target;
+	protected:	const Path& path;
+	protected:	const Rect<double> pathBounds;
+	protected:	bool stroked;
+};
+
 /* --- Context --- */
 
-Context::Context(Canvas& canvas, const AffineTransformation& initialTransform) : canvas(canvas) {
+Context::Context(Canvas& canvas, const AffineTransformation& initialTransform, const Options& initialOptions)
+		: canvas(&canvas) {
 	initState.transformation = initialTransform;
+	initState.options = initialOptions;
+	if (initState.options.draftQuality) {
+		initState.options.gammaTable = 0;
+	}
+	state.options = initState.options;
 	state.transformation = initState.transformation;
 	initState.textStyle.fill.painter = new ColorPainter<ARGB32>(0xFF000000);
 	state.textStyle.fill.painter = initState.textStyle.fill.painter;
 }
 
 Context::Context(Canvas& canvas, Context& parentContext)
-		: canvas(canvas), initState(parentContext.state), state(parentContext.state) { }
+		: canvas(&canvas), initState(parentContext.state), state(parentContext.state) { }
+
+/*
+	Paths reaching more than the size of the clamp bounds (see Canvas::getClampBounds()) outside them are folded onto
+	that distance with Path::clampToRect(). This keeps the rasterizer from walking edges far outside the canvas and
+	lets extreme zoom work (vertices beyond the range of PolygonMask would otherwise throw). Clamping moves the
+	starting points of edges that cross the clamp rect, which may change their rounding, so tiles must clamp against
+	the bounds of the whole document (or TiledRenderer would differ from a single-threaded render).
+*/
+static const int MAX_SAFE_COORDINATE = 1 << 22;
+
+static Rect<double> calcClampRect(const IntRect& clampBounds) {
+	return Rect<double>(clampBounds.left - static_cast<double>(clampBounds.width)
+			, clampBounds.top - static_cast<double>(clampBounds.height), clampBounds.width * 3.0, clampBounds.height * 3.0);
+}
+
+static bool isInsideClampRect(const Rect<double>& bounds, const Rect<double>& clampRect) {
+	return (bounds.left >= clampRect.left && bounds.top >= clampRect.top
+			&& bounds.calcRight() <= clampRect.calcRight() && bounds.calcBottom() <= clampRect.calcBottom());
+}
+
+static void clampFarGeometry(Path& devicePath, const IntRect& clampBounds) {
+	const Rect<double> clampRect = calcClampRect(clampBounds);
+	if (!isInsideClampRect(devicePath.calcFloatBounds(), clampRect)) {
+		devicePath.clampToRect(clampRect);
+	}
+}
+
+bool Context::isCulled(const Rect<double>& bounds, double margin) const {
+	const AffineTransformation& xf = state.transformation;
+	const double left = bounds.left - margin;
+	const double top = bounds.top - margin;
+	const double right = bounds.calcRight() + margin;
+	const double bottom = bounds.calcBottom() + margin;
+	const Vertex corners[4] = {
+		xf.transform(Vertex(left, top)), xf.transform(Vertex(right, top))
+		, xf.transform(Vertex(left, bottom)), xf.transform(Vertex(right, bottom))
+	};
+	double minX = corners[0].x;
+	double minY = corners[0].y;
+	double maxX = minX;
+	double maxY = minY;
+	for (int i = 1; i < 4; ++i) {
+		minX = minValue(minX, corners[i].x);
+		minY = minValue(minY, corners[i].y);
+		maxX = maxValue(maxX, corners[i].x);
+		maxY = maxValue(maxY, corners[i].y);
+	}
+	
+	// Leave non-finite coordinates to the rasterizer so that they still throw.
+	if (!isfinite(minX) || !isfinite(minY) || !isfinite(maxX) || !isfinite(maxY)) {
+		return false;
+	}
+	
+	IntRect visible = canvas->getBounds();
+	const RLERaster<Mask8>* mask = state.mask;
+	if (mask != 0) {
+		visible = visible.calcIntersection(mask->calcCoverageBounds());
+	}
+	return (visible.width <= 0 || visible.height <= 0
+			|| maxX <= visible.left || minX >= visible.calcRight() || maxY <= visible.top || minY >= visible.calcBottom());
+}
 
 void Context::stroke(const Path& path, Stroke& stroke, const Rect<double>& paintSourceBounds, double widthMultiplier) {
-	if (stroke.paint.isVisible() && stroke.width > EPSILON) {
-		Path strokePath(path);
+	if (stroke.paint.isVisible() && stroke.width > EPSILON && !path.empty()) {
+		// Miter joints reach at most miterLimit half-widths out, square caps sqrt(2) and everything else one.
+		const double reach = maxValue(stroke.joints == Path::MITER ? stroke.miterLimit : 1.0, 1.5);
+		if (isCulled(path.calcFloatBounds(), stroke.width * widthMultiplier * 0.5 * reach)) {
+			return;
+		}
+		RenderStats* const stats = state.options.stats;
+		PhaseTimer pathTimer(stats, RenderStats::PATH_CONSTRUCTION);
+		const Path* source = &path;
 		if (stroke.gap > EPSILON) {
 			double l = stroke.dash + stroke.gap;
 			double dashOffset = fmod(fmod(stroke.dashOffset, l) + l, l);  // floor modulo trick
-			strokePath.dash(stroke.dash, stroke.gap, dashOffset);
+			dashedPath = path;
+			dashedPath.dash(stroke.dash, stroke.gap, dashOffset);
+			source = &dashedPath;
 		}
-		strokePath.stroke(stroke.width * widthMultiplier, stroke.caps, stroke.joints, stroke.miterLimit
+		source->strokeTo(strokePath, stroke.width * widthMultiplier, stroke.caps, stroke.joints, stroke.miterLimit
 				, calcCurveQuality());
 		strokePath.transform(state.transformation);
-		PolygonMask polygonMask(strokePath, canvas.getBounds());
-		if (!polygonMask.isValid()) {
-			Interpreter::throwRunTimeError("Vertices outside valid coordinate range");
+		clampFarGeometry(strokePath, canvas->getClampBounds());
+		pathTimer.stop();
+		if (stats != 0) stats->vertexCount += strokePath.size();
+		const MemoryCharge pathCharge(state.options.memoryBudget, (source->size() + strokePath.size())
+				* sizeof (Path::Instruction) + PolygonMask::calcSegmentBytes(strokePath));
+		if (canvas->isDeferred()) {
+			defer(RectMask::isRect(strokePath) ? DrawCommand::RECT : DrawCommand::POLYGON, strokePath
+					, PolygonMask::nonZeroFillRule, stroke.paint, paintSourceBounds);
+		} else if (RectMask::isRect(strokePath)) {	// e.g. horizontal and vertical lines with butt caps
+			stroke.paint.doPaint(*this, paintSourceBounds, CombinedMask(RectMask(strokePath, canvas->getBounds())
+					, state.mask, state.options.gammaTable));
+		} else {
+			PhaseTimer maskTimer(stats, RenderStats::POLYGON_MASK);
+			PolygonMask polygonMask(strokePath, canvas->getBounds(), PolygonMask::nonZeroFillRule, &strokeWorkspace
+					, !state.options.draftQuality);
+			maskTimer.stop();
+			if (stats != 0) stats->segmentCount += polygonMask.getSegmentCount();
+			if (!polygonMask.isValid()) {
+				Interpreter::throwRunTimeError("Vertices outside valid coordinate range");
+			}
+			stroke.paint.doPaint(*this, paintSourceBounds, CombinedMask(polygonMask, state.mask
+					, state.options.gammaTable));
 		}
-		stroke.paint.doPaint(*this, paintSourceBounds, CombinedMask(polygonMask, state.mask, state.options.gammaTable));
 	}
 }
 
 void Context::fill(const Path& path, Paint& fill, bool evenOddFillRule, const Rect<double>& paintSourceBounds) {
-	if (fill.isVisible()) {
+	if (fill.isVisible() && !path.empty() && !isCulled(path.calcFloatBounds(), 0.0)) {
 		const FillRule* fillRule = evenOddFillRule
 				? static_cast<const FillRule*>(&PolygonMask::evenOddFillRule)
 				: static_cast<const FillRule*>(&PolygonMask::nonZeroFillRule);
-		Path fillPath(path);
+		RenderStats* const stats = state.options.stats;
+		PhaseTimer pathTimer(stats, RenderStats::PATH_CONSTRUCTION);
+		fillPath = path;
 		fillPath.closeAll();
 		fillPath.transform(state.transformation);
-		PolygonMask polygonMask(fillPath, canvas.getBounds(), *fillRule);
-		if (!polygonMask.isValid()) {
-			Interpreter::throwRunTimeError("Vertices outside valid coordinate range");
+		clampFarGeometry(fillPath, canvas->getClampBounds());
+		pathTimer.stop();
+		if (stats != 0) stats->vertexCount += fillPath.size();
+		const MemoryCharge pathCharge(state.options.memoryBudget, fillPath.size() * sizeof (Path::Instruction)
+				+ PolygonMask::calcSegmentBytes(fillPath));
+		if (canvas->isDeferred()) {
+			defer(RectMask::isRect(fillPath) ? DrawCommand::RECT : DrawCommand::POLYGON, fillPath, *fillRule, fill
+					, paintSourceBounds);
+		} else if (RectMask::isRect(fillPath)) {
+			fill.doPaint(*this, paintSourceBounds, CombinedMask(RectMask(fillPath, canvas->getBounds()), state.mask
+					, state.options.gammaTable));
+		} else {
+			PhaseTimer maskTimer(stats, RenderStats::POLYGON_MASK);
+			PolygonMask polygonMask(fillPath, canvas->getBounds(), *fillRule, &fillWorkspace
+					, !state.options.draftQuality);
+			maskTimer.stop();
+			if (stats != 0) stats->segmentCount += polygonMask.getSegmentCount();
+			if (!polygonMask.isValid()) {
+				Interpreter::throwRunTimeError("Vertices outside valid coordinate range");
+			}
+			fill.doPaint(*this, paintSourceBounds, CombinedMask(polygonMask, state.mask, state.options.gammaTable));
 		}
-		fill.doPaint(*this, paintSourceBounds, CombinedMask(polygonMask, state.mask, state.options.gammaTable));
 	}
 }
 
 void Context::draw(const Path& path) {
 	const Rect<double> pathBounds(path.calcFloatBounds());
-	fill(path, state.fill, state.evenOddFillRule, pathBounds);
-	stroke(path, state.pen, pathBounds, 1.0);
+	if (state.fill.isVisible() && state.pen.paint.isVisible() && state.pen.width > EPSILON && !canvas->isDeferred()) {
+		FillCatchingCanvas fillCatcher(*this, path, pathBounds);
+		fill(path, state.fill, state.evenOddFillRule, pathBounds);
+		fillCatcher.finish();
+	} else {
+		fill(path, state.fill, state.evenOddFillRule, pathBounds);
+		stroke(path, state.pen, pathBounds, 1.0);
+	}
+}
+
+void Context::drawRoundedRect(const Path& path, const Rect<double>& rect, double radiusX, double radiusY) {
+	const AffineTransformation& xf = state.transformation;
+	const bool straight = (xf.matrix[0][1] == 0.0 && xf.matrix[1][0] == 0.0);
+	const bool swapped = (xf.matrix[0][0] == 0.0 && xf.matrix[1][1] == 0.0);
+	if (!state.options.analyticShapes || !(straight || swapped) || !state.fill.isVisible() || isCulled(rect, 0.0)) {
+		draw(path);
+		return;
+	}
+	const Vertex p0 = xf.transform(Vertex(rect.left, rect.top));
+	const Vertex p1 = xf.transform(Vertex(rect.calcRight(), rect.calcBottom()));
+	const double deviceRadiusX = (straight ? radiusX * fabs(xf.matrix[0][0]) : radiusY * fabs(xf.matrix[0][1]));
+	const double deviceRadiusY = (straight ? radiusY * fabs(xf.matrix[1][1]) : radiusX * fabs(xf.matrix[1][0]));
+	const double left = min(p0.x, p1.x);
+	const double top = min(p0.y, p1.y);
+	const double width = fabs(p1.x - p0.x);
+	const double height = fabs(p1.y - p0.y);
+	// Shapes reaching outside the clamp rect take the path route so that they are clamped like any other fill.
+	if (!isInsideClampRect(Rect<double>(left, top, width, height), calcClampRect(canvas->getClampBounds()))) {
+		draw(path);
+		return;
+	}
+	const Rect<double> pathBounds(path.calcFloatBounds());
+	if (canvas->isDeferred()) {
+		std::unique_ptr<DrawCommand> command(new DrawCommand(DrawCommand::ROUNDED_RECT, state, state.fill, pathBounds));
+		command->rect = Rect<double>(left, top, width, height);
+		command->radiusX = min(deviceRadiusX, width * 0.5);
+		command->radiusY = min(deviceRadiusY, height * 0.5);
+		canvas->enqueue(command.release());
+		stroke(path, state.pen, pathBounds, 1.0);
+		return;
+	}
+	const RoundedRectMask mask(left, top, width, height, min(deviceRadiusX, width * 0.5)
+			, min(deviceRadiusY, height * 0.5), canvas->getBounds());
+	FillCatchingCanvas fillCatcher(*this, path, pathBounds);
+	state.fill.doPaint(*this, pathBounds, CombinedMask(mask, state.mask, state.options.gammaTable));
+	fillCatcher.finish();
+}
+
+void Context::defer(DrawCommand::Shape shape, const Path& devicePath, const FillRule& fillRule, const Paint& paint
+		, const Rect<double>& sourceBounds) {
+	// Check here (not when rasterizing later) so that the error is reported for the right instruction.
+	if (shape == DrawCommand::POLYGON && !PolygonMask::isValidPath(devicePath)) {
+		Interpreter::throwRunTimeError("Vertices outside valid coordinate range");
+		return;
+	}
+	std::unique_ptr<DrawCommand> command(new DrawCommand(shape, state, paint, sourceBounds));
+	command->charge.add(devicePath.size() * sizeof (Path::Instruction)
+			+ (shape == DrawCommand::POLYGON ? PolygonMask::calcSegmentBytes(devicePath) : 0));
+	command->path = devicePath;
+	command->fillRule = &fillRule;
+	canvas->enqueue(command.release());
 }
 
 void Context::resetState() {
 	state = initState;
 }
 
+/* --- DrawCommand --- */
+
+DrawCommand::DrawCommand(Shape shape, const State& state, const Paint& paint, const Rect<double>& sourceBounds)
+		: shape(shape), fillRule(&PolygonMask::nonZeroFillRule), radiusX(0.0), radiusY(0.0), paint(paint)
+		, sourceBounds(sourceBounds), transformation(state.transformation), mask(state.mask)
+		, gammaTable(state.options.gammaTable), draftQuality(state.options.draftQuality)
+		, charge(state.options.memoryBudget, sizeof (DrawCommand)) {
+}
+
+void DrawCommand::execute(Context& replayContext, PolygonMask::Workspace& workspace) {
+	replayContext.accessState().transformation = transformation;
+	replayContext.accessState().options.draftQuality = draftQuality;
+	const IntRect bounds = replayContext.accessCanvas().getBounds();
+	switch (shape) {
+		case POLYGON: {
+			PolygonMask polygonMask(path, bounds, *fillRule, &workspace, !draftQuality);
+			assert(polygonMask.isValid());	// checked by Context::defer()
+			paint.doPaint(replayContext, sourceBounds, CombinedMask(polygonMask, mask, gammaTable));
+			break;
+		}
+		case RECT: {
+			paint.doPaint(replayContext, sourceBounds, CombinedMask(RectMask(path, bounds), mask, gammaTable));
+			break;
+		}
+		case ROUNDED_RECT: {
+			const RoundedRectMask roundedRectMask(rect.left, rect.top, rect.width, rect.height, radiusX, radiusY
+					, bounds);
+			paint.doPaint(replayContext, sourceBounds, CombinedMask(roundedRectMask, mask, gammaTable));
+			break;
+		}
+	}
+}
+
 double Context::calcCurveQuality() const {
-	return calcCurveQualityForTransform(state.transformation) * state.options.curveQuality;
+	return calcCurveQualityForTransform(state.transformation) * state.options.curveQuality
+			* (state.options.draftQuality ? DRAFT_CURVE_QUALITY : 1.0);
 }
 
 int Context::calcPatternScale() const {
@@ -861,8 +1625,39 @@ enum IVGInstruction {
 
 /* --- IVGExecutor --- */
 
-IVGExecutor::IVGExecutor(Canvas& canvas, const NuXPixels::AffineTransformation& initialTransform)
-		: rootContext(canvas, initialTransform), currentContext(&rootContext) { }
+static std::atomic<unsigned long> fontIdCounter(0);	// also numbers font generations
+
+IVGExecutor::IVGExecutor(Canvas& canvas, const NuXPixels::AffineTransformation& initialTransform
+		, const Options& initialOptions)
+		: rootContext(canvas, initialTransform, initialOptions), currentContext(&rootContext), fontGeneration(0)
+		, svgPathCache(&ownSVGPathCache), textLayoutCache(&ownTextLayoutCache)
+		, glyphBitmapCache(0), patternCache(&ownPatternCache), imageOrderLimit(~static_cast<size_t>(0))
+		, definedImagesCharge(initialOptions.memoryBudget), embeddedFontsCharge(initialOptions.memoryBudget)
+		, recordingDefinitions(true), reusingDefinitions(false) { }
+
+void IVGExecutor::setTextLayoutCache(TextLayoutCache* sharedCache) {
+	textLayoutCache = (sharedCache != 0 ? sharedCache : &ownTextLayoutCache);
+}
+
+void IVGExecutor::setSVGPathCache(SVGPathCache* sharedCache) {
+	svgPathCache = (sharedCache != 0 ? sharedCache : &ownSVGPathCache);
+}
+
+void IVGExecutor::setGlyphBitmapCache(GlyphBitmapCache* cache) {
+	glyphBitmapCache = cache;
+}
+
+void IVGExecutor::setPatternCache(PatternCache* sharedCache) {
+	patternCache = (sharedCache != 0 ? sharedCache : &ownPatternCache);
+}
+
+PatternCache& IVGExecutor::accessPatternCache() {
+	return *patternCache;
+}
+
+PaintCache& IVGExecutor::accessPaintCache() {
+	return paintCache;
+}
 
 void IVGExecutor::parseStroke(Interpreter& impd, ArgumentsContainer& args, Stroke& stroke) {
 	const String* s;
@@ -955,6 +1750,11 @@ bool IVGExecutor::load(Interpreter& impd, const WideString& filename, String& co
 	return false;
 }
 
+static size_t calcRasterBytes(const Raster<ARGB32>& raster) {
+	const IntRect bounds = raster.calcBounds();
+	return static_cast<size_t>(bounds.width) * bounds.height * sizeof (ARGB32::Pixel);
+}
+
 Image IVGExecutor::loadImage(Interpreter& impd, const WideString& imageSource, const IntRect* sourceRectangle
 		, bool forStretching, double forXSize, bool xSizeIsRelative, double forYSize, bool ySizeIsRelative) {
 	(void)impd; (void)imageSource; (void)sourceRectangle; (void)forStretching;
@@ -968,15 +1768,125 @@ std::vector<const Font*> IVGExecutor::lookupFonts(Interpreter& impd, const WideS
 	return std::vector<const Font*>();
 }
 
-std::vector<const Font*> IVGExecutor::lookupExternalOrInternalFonts(Interpreter& impd, const WideString& name
-		, const UniString& forString) {
-	if (lastFontName != name) {
-		lastFontName = name;
-		const FontMap::const_iterator it = embeddedFonts.find(name);
-		lastFontPointers = (it != embeddedFonts.end()
-				? std::vector<const Font*>(1, &it->second) : lookupFonts(impd, name, forString));
+struct GlyphPlacement {
+	int fontIndex;
+	const Font::Glyph* glyph;
+	GlyphBitmapCache::OutlinePointer outline;
+	double x;
+};
+
+bool IVGExecutor::fillTextWithGlyphBitmaps(const UniString& text, const FontChain& fontChain, double anchorRatio
+		, double& advance, const char*& errorString) {
+	State& state = currentContext->accessState();
+	const TextStyle& style = state.textStyle;
+	const AffineTransformation& xf = state.transformation;
+	if (glyphBitmapCache == 0 || style.fill.relative || (style.outline.paint.isVisible() && style.outline.width > EPSILON)
+			|| xf.matrix[0][1] != 0.0 || xf.matrix[1][0] != 0.0) {
+		return false;
+	}
+	const AffineTransformation emXF = style.glyphTransform.transform(xf);
+	const double emSize = style.size * sqrt(max(square(emXF.matrix[0][0]) + square(emXF.matrix[1][0])
+			, square(emXF.matrix[0][1]) + square(emXF.matrix[1][1])));
+	if (!(emSize < glyphBitmapCache->getMaxPixelSize())) {
+		return false;
+	}
+	
+	const std::vector<const Font*>& fonts = fontChain.getFonts();
+	assert(!fonts.empty());
+	std::vector<BuildPathFontInfo> fontInfos;
+	makeFontInfos(fonts, style.size, style.glyphTransform, currentContext->calcCurveQuality(), fontInfos);
+	std::vector<GlyphPlacement> placements;
+	placements.reserve(text.size());
+	errorString = 0;
+	advance = 0.0;
+	const Font* lastFont = 0;
+	UniChar lastCharacter = 0;
+	for (UniString::const_iterator it = text.begin(); it != text.end(); ++it) {
+		GlyphPlacement placement;
+		UniChar thisCharacter = *it;
+		placement.fontIndex = 0;
+		placement.glyph = fontChain.findGlyph(thisCharacter, placement.fontIndex);
+		if (placement.glyph == 0) {
+			placement.fontIndex = 0;
+			thisCharacter = 0;
+			placement.glyph = fonts[0]->findGlyph(thisCharacter);
+		}
+		const Font* font = fonts[placement.fontIndex];
+		const BuildPathFontInfo& fontInfo = fontInfos[placement.fontIndex];
+		const char* thisError = 0;
+		if (placement.glyph != 0) {
+			placement.outline = glyphBitmapCache->lookupOutline(*font, *placement.glyph, fontInfo.effectiveQuality
+					, thisError);
+		}
+		if (placement.outline) {
+			advance += (font == lastFont ? font->findKerningAdjust(lastCharacter, thisCharacter) * fontInfo.mpu
+					* style.size : 0.0);
+			lastFont = font;
+			lastCharacter = thisCharacter;
+			placement.x = advance;
+			advance += (placement.glyph->advance * fontInfo.mpu + style.letterSpacing) * style.size;
+			placements.push_back(placement);
+		} else if (errorString == 0) {
+			errorString = (placement.glyph == 0 ? "Missing glyph" : thisError);
+		}
 	}
-	return lastFontPointers;
+	state.textCaret.x -= advance * anchorRatio;
+	
+	if (style.fill.isVisible()) {
+		const int subpixelSteps = glyphBitmapCache->getSubpixelSteps();
+		const double MAX_ORIGIN = 0x3FFFFFFF;
+		std::vector< std::pair<GlyphBitmapCache::BitmapPointer, IntPoint> > bitmaps;
+		bitmaps.reserve(placements.size());
+		IntRect bounds;
+		for (std::vector<GlyphPlacement>::const_iterator it = placements.begin(); it != placements.end(); ++it) {
+			const BuildPathFontInfo& fontInfo = fontInfos[it->fontIndex];
+			const AffineTransformation glyphToDevice = fontInfo.scaledXF.translate(it->x, 0.0)
+					.translate(state.textCaret.x, state.textCaret.y).transform(xf);
+			const double originX = floor(glyphToDevice.matrix[0][2]);
+			const double originY = floor(glyphToDevice.matrix[1][2] + 0.5);
+			if (fabs(originX) < MAX_ORIGIN && fabs(originY) < MAX_ORIGIN) {
+				const int subpixelBucket = minValue(static_cast<int>((glyphToDevice.matrix[0][2] - originX)
+						* subpixelSteps), subpixelSteps - 1);
+				const GlyphBitmapCache::BitmapPointer bitmap = glyphBitmapCache->lookupBitmap(*fonts[it->fontIndex]
+						, *it->glyph, fontInfo.effectiveQuality, *it->outline, glyphToDevice, subpixelBucket);
+				if (bitmap) {
+					const IntPoint origin(static_cast<int>(originX), static_cast<int>(originY));
+					bitmaps.push_back(std::make_pair(bitmap, origin));
+					bounds = bounds.calcUnion(bitmap->calcBounds().offset(origin.x, origin.y));
+				}
+			}
+		}
+		bounds = bounds.calcIntersection(currentContext->accessCanvas().getBounds());
+		if (bounds.width > 0 && bounds.height > 0) {
+			SelfContainedRaster<Mask8> coverage(bounds);
+			coverage = Solid<Mask8>(Mask8::transparent());
+			for (std::vector< std::pair<GlyphBitmapCache::BitmapPointer, IntPoint> >::const_iterator it = bitmaps.begin()
+					; it != bitmaps.end(); ++it) {
+				coverage |= Offsetter<Mask8>(*it->first, it->second.x, it->second.y);
+			}
+			state.textStyle.fill.doPaint(*currentContext, Rect<double>()
+					, CombinedMask(coverage, state.mask, state.options.gammaTable));
+		}
+	}
+	return true;
+}
+
+const FontChain& IVGExecutor::lookupExternalOrInternalFonts(Interpreter& impd, const WideString& name
+		, const UniString& forString) {
+	rootContext.accessCanvas().noteFontUse(name);
+	FontChainMap::iterator it = fontChainCache.find(name);
+	if (it == fontChainCache.end()) {
+		const PhaseTimer timer(currentContext->accessState().options.stats, RenderStats::LOADING);
+		const FontMap::const_iterator embeddedIt = embeddedFonts.find(name);
+		it = fontChainCache.insert(FontChainMap::value_type(name, FontChain(embeddedIt != embeddedFonts.end()
+				? std::vector<const Font*>(1, &embeddedIt->second) : lookupFonts(impd, name, forString)))).first;
+	}
+	return it->second;
+}
+
+void IVGExecutor::clearFontCache() {
+	fontChainCache.clear();
+	fontGeneration = ++fontIdCounter;	// unique, like font ids, so that cached patterns never match
 }
 
 void IVGExecutor::executeDefine(Interpreter& impd, ArgumentsContainer& args) {
@@ -990,13 +1900,25 @@ void IVGExecutor::executeDefine(Interpreter& impd, ArgumentsContainer& args) {
 		if (embeddedFonts.find(name) != embeddedFonts.end()) {
 			Interpreter::throwRunTimeError(String("Duplicate font definition: ") + String(name.begin(), name.end()));
 		}
-		IVG::FontParser fontParser(this);
-		FormatInfo fontFormatInfo;	// Fresh format scope for embedded font documents.
-		Interpreter newInterpreter(fontParser, impd, fontFormatInfo);
-		newInterpreter.run(definition);
-		embeddedFonts[name] = fontParser.finalizeFont();
-		lastFontName = WideString();	// must reset cache cause there is no guarantee that STL preserves pointers after insertion
-		lastFontPointers.clear();
+		freezeDefinedImages(impd);	// the new font must not change the text of images defined before it
+		if (reuseDefinition(true, name, definition, 0.0)) {
+			const FontMap::iterator it = previousFonts.find(name);
+			assert(it != previousFonts.end());
+			std::swap(embeddedFonts[name], it->second);	// still charged
+			previousFonts.erase(it);
+		} else {
+			const PhaseTimer timer(currentContext->accessState().options.stats, RenderStats::LOADING);
+			embeddedFontsCharge.add(definition.size());	// glyph paths are kept as text
+			IVG::FontParser fontParser(this);
+			FormatInfo fontFormatInfo;	// Fresh format scope for embedded font documents.
+			Interpreter newInterpreter(fontParser, impd, fontFormatInfo);
+			newInterpreter.run(definition);
+			embeddedFonts[name] = fontParser.finalizeFont();
+		}
+		clearFontCache();	// an embedded font now takes precedence over any external font with the same name
+		
+		// The font id is kept when reusing the definition, so patterns cached by a previous run still match.
+		fontGeneration = embeddedFonts[name].getId();
 	} else if (typeLower == "image") {
 		const WideString name = impd.unescapeToWide(args.fetchRequired(1, true));
 		const String& definition = args.fetchRequired(2, false);
@@ -1010,19 +1932,217 @@ void IVGExecutor::executeDefine(Interpreter& impd, ArgumentsContainer& args) {
 		if (definedImages.find(name) != definedImages.end()) {
 			Interpreter::throwRunTimeError(String("Duplicate image definition: ") + String(name.begin(), name.end()));
 		}
+		if (reuseDefinition(false, name, definition, resolution)) {
+			const ImageMap::iterator it = previousImages.find(name);
+			assert(it != previousImages.end() && it->second.order == definedImages.size());
+			definedImages.insert(*it);	// rasters are still charged
+			previousImages.erase(it);
+			return;
+		}
 
-		SelfContainedARGB32Canvas offscreenCanvas(resolution);
-		Context imageContext(offscreenCanvas, AffineTransformation().scale(resolution));
-		runInNewContext(impd, imageContext, definition);
-		Image& image = definedImages[name];
-		image.xResolution = resolution;
-		image.yResolution = resolution;
-		image.raster = offscreenCanvas.relinquishRaster();
+		// Definitions that don't depend on variables or have side effects are rasterized on first use (see
+		// findDefinedImage()).
+		const bool lazy = PatternCache::isCacheable(definition);
+		Image image;
+		if (!lazy) {
+			image = rasterizeImage(impd, definition, resolution);
+		}
+		const size_t order = definedImages.size();
+		ImageDefinition& newDefinition = definedImages[name];
+		newDefinition.resolution = resolution;
+		newDefinition.order = order;
+		if (lazy) {
+			newDefinition.source = definition;
+		} else {
+			newDefinition.rasters.push_back(image);
+		}
 	} else {
 		Interpreter::throwBadSyntax(String("Invalid define instruction type: ") + type);
 	}
 }
 
+Image IVGExecutor::rasterizeImage(Interpreter& impd, const String& source, double resolution) {
+	const PhaseTimer timer(rootContext.getInitialOptions().stats, RenderStats::PATTERNS_AND_MASKS);
+	SelfContainedARGB32Canvas offscreenCanvas(resolution);
+	offscreenCanvas.setMemoryBudget(rootContext.getInitialOptions().memoryBudget);
+	Context imageContext(offscreenCanvas, AffineTransformation().scale(resolution), rootContext.getInitialOptions());
+	runInNewContext(impd, imageContext, source);
+	Image image;
+	image.xResolution = resolution;
+	image.yResolution = resolution;
+	std::unique_ptr< SelfContainedRaster<ARGB32> > raster(offscreenCanvas.relinquishRaster());
+	definedImagesCharge.add(calcRasterBytes(*raster));	// taken over from offscreenCanvas
+	image.raster = raster.release();
+	return image;
+}
+
+static const int MAX_IMAGE_OCTAVES = 4;			// adaptive resolutions stay within 1/16 to 16 times the declared one
+static const size_t MAX_IMAGE_RESOLUTIONS = 4;	// rasters kept per defined image
+
+/*
+	Returns 0 if there is no defined image called `name`, or if it was defined after the image currently being
+	rasterized (which could not have used it if it had been rasterized when it was defined). `forScale` is the number
+	of pixels per image unit wanted with Options::adaptiveImageResolution, or 0 for the declared resolution.
+*/
+const Image* IVGExecutor::findDefinedImage(Interpreter& impd, const WideString& name, double forScale) {
+	const ImageMap::iterator it = definedImages.find(name);
+	if (it == definedImages.end() || it->second.order >= imageOrderLimit) {
+		return 0;
+	}
+	ImageDefinition& definition = it->second;
+	if (definition.source.empty()) {
+		assert(!definition.rasters.empty());
+		return &definition.rasters[0];
+	}
+	double resolution = definition.resolution;
+	if (forScale > 0.0) {
+		const double octave = ceil(log2(forScale / definition.resolution) - 0.001);
+		resolution = ldexp(resolution, static_cast<int>(maxValue(minValue(octave, double(MAX_IMAGE_OCTAVES))
+				, double(-MAX_IMAGE_OCTAVES))));
+	}
+	for (size_t i = 0; i < definition.rasters.size(); ++i) {
+		if (definition.rasters[i].xResolution == resolution) {
+			std::rotate(definition.rasters.begin(), definition.rasters.begin() + i, definition.rasters.begin() + i + 1);
+			return &definition.rasters[0];
+		}
+	}
+	const size_t lastOrderLimit = imageOrderLimit;
+	Image image;
+	try {
+		imageOrderLimit = definition.order;
+		image = rasterizeImage(impd, definition.source, resolution);
+		imageOrderLimit = lastOrderLimit;
+	}
+	catch (...) {
+		imageOrderLimit = lastOrderLimit;
+		throw;
+	}
+	if (definition.rasters.size() >= MAX_IMAGE_RESOLUTIONS) {
+		definedImagesCharge.remove(calcRasterBytes(*definition.rasters.back().raster));
+		delete definition.rasters.back().raster;
+		definition.rasters.pop_back();
+	}
+	definition.rasters.insert(definition.rasters.begin(), image);
+	return &definition.rasters[0];
+}
+
+// Rasterizes the images that are still waiting for their first use and stops rasterizing them again later.
+void IVGExecutor::freezeDefinedImages(Interpreter& impd) {
+	for (ImageMap::iterator it = definedImages.begin(); it != definedImages.end(); ++it) {
+		if (!it->second.source.empty()) {
+			if (it->second.rasters.empty()) {
+				findDefinedImage(impd, it->first, 0.0);
+			}
+			it->second.source.clear();
+		}
+	}
+}
+
+/*
+	Records the definition for the next run and returns true if the previous run's font or image can be taken over,
+	i.e. if this and all definitions before it are identical to the previous run and free of variables (fonts and
+	images may use the fonts and images defined before them). At the first difference the rest of the previous run's
+	definitions are discarded together with the cached patterns, which may have used them.
+*/
+bool IVGExecutor::reuseDefinition(bool isFont, const WideString& name, const String& source, double resolution) {
+	const bool freeOfVariables = PatternCache::isCacheable(source);
+	const size_t index = definitionRecords.size();
+	const bool reuse = (reusingDefinitions && freeOfVariables && index < previousDefinitionRecords.size()
+			&& previousDefinitionRecords[index].isFont == isFont && previousDefinitionRecords[index].name == name
+			&& previousDefinitionRecords[index].resolution == resolution
+			&& previousDefinitionRecords[index].source == source);
+	if (reusingDefinitions && !reuse) {
+		reusingDefinitions = false;
+		discardPreviousDefinitions();
+		patternCache->clear();
+	}
+	recordingDefinitions = (recordingDefinitions && freeOfVariables);
+	if (recordingDefinitions) {
+		DefinitionRecord record;
+		record.isFont = isFont;
+		record.name = name;
+		record.source = source;
+		record.resolution = resolution;
+		definitionRecords.push_back(record);
+	}
+	return reuse;
+}
+
+void IVGExecutor::discardPreviousDefinitions() {
+	for (size_t i = 0; i < previousDefinitionRecords.size(); ++i) {
+		const DefinitionRecord& record = previousDefinitionRecords[i];
+		if (record.isFont && previousFonts.find(record.name) != previousFonts.end()) {
+			embeddedFontsCharge.remove(record.source.size());
+		}
+	}
+	previousDefinitionRecords.clear();
+	previousFonts.clear();
+	definedImagesCharge.remove(deleteRasters(previousImages));
+	previousImages.clear();
+}
+
+size_t IVGExecutor::deleteRasters(ImageMap& images) {
+	size_t bytes = 0;
+	for (ImageMap::iterator it = images.begin(); it != images.end(); ++it) {
+		for (size_t i = 0; i < it->second.rasters.size(); ++i) {
+			bytes += calcRasterBytes(*it->second.rasters[i].raster);
+			delete it->second.rasters[i].raster;
+		}
+		it->second.rasters.clear();
+	}
+	return bytes;
+}
+
+void IVGExecutor::restart(Canvas& newCanvas) {
+	if (reusingDefinitions && definitionRecords.size() < previousDefinitionRecords.size()) {
+		patternCache->clear();	// the previous run defined more, which its patterns may have used
+	}
+	discardPreviousDefinitions();
+	
+	/*
+		Keep the recorded definitions for the next run and delete the rest. A recorded font is missing if its
+		definition failed, and nothing after it is kept.
+	*/
+	
+	size_t keptFontBytes = 0;
+	size_t keptCount = 0;
+	for (; keptCount < definitionRecords.size(); ++keptCount) {
+		const DefinitionRecord& record = definitionRecords[keptCount];
+		if (record.isFont) {
+			const FontMap::iterator it = embeddedFonts.find(record.name);
+			if (it == embeddedFonts.end()) {
+				break;
+			}
+			std::swap(previousFonts[record.name], it->second);
+			embeddedFonts.erase(it);
+			keptFontBytes += record.source.size();
+		} else {
+			const ImageMap::iterator it = definedImages.find(record.name);
+			if (it == definedImages.end()) {
+				break;
+			}
+			previousImages.insert(*it);
+			definedImages.erase(it);
+		}
+	}
+	definitionRecords.resize(keptCount);
+	embeddedFontsCharge.remove(embeddedFontsCharge.getBytes() - keptFontBytes);
+	embeddedFonts.clear();
+	definedImagesCharge.remove(deleteRasters(definedImages));
+	definedImages.clear();
+	previousDefinitionRecords.swap(definitionRecords);
+	definitionRecords.clear();
+	recordingDefinitions = true;
+	reusingDefinitions = true;
+	clearFontCache();
+	fontGeneration = 0;
+	
+	imageOrderLimit = ~static_cast<size_t>(0);
+	rootContext.setCanvas(newCanvas);
+	rootContext.resetState();
+	currentContext = &rootContext;
+}
+
 /* Built with QuickHashGen */
 static int findAlignmentKeyword(size_t n /* string length */, const char* s /* string (zero terminated) */) {
 	static const char* STRINGS[6] = {
@@ -1142,16 +2262,19 @@ void IVGExecutor::executeImage(Interpreter& impd, ArgumentsContainer& args) {
 
 	State& state = currentContext->accessState();
 
-	const ImageMap::const_iterator it = definedImages.find(imageName);
+	const AffineTransformation xf = imageXF.transform(state.transformation);
+	const double xfXScale = sqrt(square(xf.matrix[0][0]) + square(xf.matrix[1][0]));
+	const double xfYScale = sqrt(square(xf.matrix[0][1]) + square(xf.matrix[1][1]));
+	rootContext.accessCanvas().noteImageUse(imageName);
+	const bool adaptive = (rootContext.getInitialOptions().adaptiveImageResolution && !doFitWidth && !doFitHeight);
+	const Image* definedImage = findDefinedImage(impd, imageName, adaptive ? maxValue(xfXScale, xfYScale) : 0.0);
 	Image image;
-	if (it != definedImages.end()) {
-		image = it->second;
+	if (definedImage != 0) {
+		image = *definedImage;
 	} else {
-		const AffineTransformation xf = imageXF.transform(state.transformation);
-		const double xfXScale = sqrt(square(xf.matrix[0][0]) + square(xf.matrix[1][0]));
-		const double xfYScale = sqrt(square(xf.matrix[0][1]) + square(xf.matrix[1][1]));
 		const double forXSize = (doFitWidth ? fitWidth : xfXScale);
 		const double forYSize = (doFitHeight ? fitHeight : xfYScale);
+		const PhaseTimer timer(state.options.stats, RenderStats::LOADING);
 		image = loadImage(impd, imageName, gotSourceRectangle ? &sourceRectangle : 0
 				, doStretch, forXSize, !doFitWidth, forYSize, !doFitHeight);
 		if (image.raster == 0) {
@@ -1223,7 +2346,8 @@ void IVGExecutor::executeImage(Interpreter& impd, ArgumentsContainer& args) {
 		raster = &subRaster;
 	}
 	
-	Texture<ARGB32> texture(*raster, false, textureTransform);
+	Texture<ARGB32> texture(*raster, false, textureTransform, FULL_RECT
+			, !currentContext->accessState().options.draftQuality);
 	Renderer<ARGB32>* renderer = &texture;
 	Solid<Mask8> opacitySolid(opacity);
 	Multiplier<ARGB32, Mask8> opacityMultiplier(*renderer, opacitySolid);
@@ -1236,6 +2360,14 @@ void IVGExecutor::executeImage(Interpreter& impd, ArgumentsContainer& args) {
 	if (state.mask != 0) {
 		renderer = &maskMultiplier;
 	}
+	RenderStats* const stats = state.options.stats;
+	const PhaseTimer timer(stats, RenderStats::BLENDING);
+	if (stats != 0) {
+		const IntRect blendBounds = renderer->calcBounds().calcIntersection(canvas.getBounds());
+		if (blendBounds.width > 0 && blendBounds.height > 0) {
+			stats->pixelCount += static_cast<size_t>(blendBounds.width) * blendBounds.height;
+		}
+	}
 	canvas.blend(*renderer);
 }
 
@@ -1245,7 +2377,10 @@ bool IVGExecutor::execute(Interpreter& impd, const String& instruction, const St
 		return false;
 	}
 	
+	RenderStats* const stats = currentContext->accessState().options.stats;
+	PhaseTimer parseTimer(stats, RenderStats::ARGUMENT_PARSING);
 	ArgumentsContainer args(ArgumentsContainer::parse(impd, arguments));
+	parseTimer.stop();
 	double numbers[6];
 
 	IVGInstruction ivgInstruction = static_cast<IVGInstruction>(foundInstruction);
@@ -1264,6 +2399,7 @@ bool IVGExecutor::execute(Interpreter& impd, const String& instruction, const St
 			Path p;
 			if (s == 0) {
 				p.addRect(numbers[0], numbers[1], numbers[2], numbers[3]);
+				currentContext->draw(p);
 			} else {
 				double rounded[2];
 				const int count = parseNumberList(impd, *s, rounded, 1, 2);
@@ -1273,10 +2409,13 @@ bool IVGExecutor::execute(Interpreter& impd, const String& instruction, const St
 				if (rounded[0] < 0.0 || rounded[1] < 0.0) {
 					impd.throwRunTimeError(String("Negative rounded corner radius: ") + impd.toString(numbers[numbers[0] < 0.0 ? 0 : 1]));
 				}
-				p.addRoundedRect(numbers[0], numbers[1], numbers[2], numbers[3], min(rounded[0], numbers[2] * 0.5)
-						, min(rounded[1], numbers[3] * 0.5), currentContext->calcCurveQuality());
+				const double radiusX = min(rounded[0], numbers[2] * 0.5);
+				const double radiusY = min(rounded[1], numbers[3] * 0.5);
+				p.addRoundedRect(numbers[0], numbers[1], numbers[2], numbers[3], radiusX, radiusY
+						, currentContext->calcCurveQuality());
+				currentContext->drawRoundedRect(p, Rect<double>(numbers[0], numbers[1], numbers[2], numbers[3])
+						, radiusX, radiusY);
 			}
-			currentContext->draw(p);
 			break;
 		}
 
@@ -1304,13 +2443,15 @@ bool IVGExecutor::execute(Interpreter& impd, const String& instruction, const St
 		case PATH_INSTRUCTION: { // PATH
 			const String* s = args.fetchOptional("svg");
 			if (s != 0) {
-				Path p;
-				const char* errorString;
-				if (!buildPathFromSVG(*s, currentContext->calcCurveQuality(), p, errorString)) {
+				const char* errorString = 0;
+				PhaseTimer pathTimer(stats, RenderStats::PATH_CONSTRUCTION);
+				SVGPathCache::PathPointer p = svgPathCache->lookup(*s, currentContext->calcCurveQuality(), errorString);
+				pathTimer.stop();
+				if (!p) {
 					impd.throwBadSyntax(errorString);
 				}
 				args.throwIfAnyUnfetched();
-				currentContext->draw(p);
+				currentContext->draw(*p);
 			} else {
 				args.throwIfAnyUnfetched();
 				impd.throwBadSyntax("Invalid PATH arguments (missing svg argument)");
@@ -1404,7 +2545,8 @@ bool IVGExecutor::execute(Interpreter& impd, const String& instruction, const St
 			} else {
 				p.addEllipse(numbers[0], numbers[1], rx, ry, currentContext->calcCurveQuality());
 			}
-			currentContext->draw(p);
+			currentContext->drawRoundedRect(p, Rect<double>(numbers[0] - rx, numbers[1] - ry, rx * 2.0, ry * 2.0)
+					, rx, ry);
 			break;
 		}
 
@@ -1440,18 +2582,28 @@ bool IVGExecutor::execute(Interpreter& impd, const String& instruction, const St
 			if (s != 0) inverted = impd.toBool(*s);
 
 			args.throwIfAnyUnfetched();
-			MaskMakerCanvas maskMaker(currentContext->accessCanvas().getBounds());
+			if (currentContext->accessState().mask != 0) {
+				currentContext->accessCanvas().sync();	// the mask block renders the current mask, which may be in use
+			}
+			const PhaseTimer timer(stats, RenderStats::PATTERNS_AND_MASKS);
+			MemoryBudget* const budget = currentContext->accessState().options.memoryBudget;
+			MaskMakerCanvas maskMaker(currentContext->accessCanvas().getBounds()
+					, currentContext->accessCanvas().getClampBounds(), budget);
 			Context maskContext(maskMaker, *currentContext);
 			State& maskState = maskContext.accessState();
 			maskState.pen = Stroke();
 			maskState.fill = Paint();
-			maskState.fill.painter = new ColorPainter<Mask8>(0xFF);
+			maskState.fill.painter.reset(paintCache.internColor<Mask8>(0xFF));
 			maskState.textStyle.fill = Paint();
-			maskState.textStyle.fill.painter = new ColorPainter<Mask8>(0xFF);
+			maskState.textStyle.fill.painter.reset(paintCache.internColor<Mask8>(0xFF));
 			maskState.textStyle.outline = Stroke();
 			maskState.evenOddFillRule = false;
 			runInNewContext(impd, maskContext, block);
-			currentContext->accessState().mask = maskMaker.finish(inverted);
+			std::unique_ptr< RLERaster<Mask8> > mask(maskMaker.finish(inverted));
+			const size_t maskBytes = mask->calcMemoryUsage();
+			if (budget != 0) budget->charge(maskBytes);
+			currentContext->accessState().mask.reset(std::shared_ptr< const RLERaster<Mask8> >(mask.release()
+					, ChargedMaskDeleter(budget, maskBytes)));
 			break;
 		}
 		
@@ -1534,30 +2686,39 @@ bool IVGExecutor::execute(Interpreter& impd, const String& instruction, const St
 			if (state.textStyle.fontName.empty()) {
 				Interpreter::throwRunTimeError("Need to set font before writing");
 			}
-			std::vector<const Font*> fonts = lookupExternalOrInternalFonts(impd, state.textStyle.fontName, text);
+			const FontChain& fonts = lookupExternalOrInternalFonts(impd, state.textStyle.fontName, text);
 			if (fonts.empty()) {
 				Interpreter::throwRunTimeError(String("Missing font: ")
 						+ String(state.textStyle.fontName.begin(), state.textStyle.fontName.end()));
 			}
 			
 			double advance;
-			const char* errorString;
-			Path textPath;
-			bool success = buildPathForString(text, fonts, state.textStyle.size, state.textStyle.glyphTransform
-					, state.textStyle.letterSpacing, currentContext->calcCurveQuality(), textPath, advance
-					, errorString);
-			if (!success) {
-				trace(impd, WideString(errorString, errorString + strlen(errorString)));
-			}
-			switch (anchor) {
-				case LEFT_ANCHOR: break;
-				case CENTER_ANCHOR: state.textCaret.x -= advance * 0.5; break;
-				case RIGHT_ANCHOR: state.textCaret.x -= advance; break;
+			const char* errorString = 0;
+			const double anchorRatio = (anchor == CENTER_ANCHOR ? 0.5 : (anchor == RIGHT_ANCHOR ? 1.0 : 0.0));
+			if (fillTextWithGlyphBitmaps(text, fonts, anchorRatio, advance, errorString)) {
+				if (errorString != 0) {
+					trace(impd, WideString(errorString, errorString + strlen(errorString)));
+				}
+			} else {
+				Path textPath;
+				PhaseTimer pathTimer(stats, RenderStats::PATH_CONSTRUCTION);
+				bool success = textLayoutCache->buildPathForString(text, fonts, state.textStyle.size
+						, state.textStyle.glyphTransform, state.textStyle.letterSpacing, currentContext->calcCurveQuality()
+						, textPath, advance, errorString);
+				pathTimer.stop();
+				if (!success) {
+					trace(impd, WideString(errorString, errorString + strlen(errorString)));
+				}
+				switch (anchor) {
+					case LEFT_ANCHOR: break;
+					case CENTER_ANCHOR: state.textCaret.x -= advance * 0.5; break;
+					case RIGHT_ANCHOR: state.textCaret.x -= advance; break;
+				}
+				textPath.transform(AffineTransformation().translate(state.textCaret.x, state.textCaret.y));
+				const Rect<double> pathBounds(textPath.calcFloatBounds());
+				currentContext->stroke(textPath, state.textStyle.outline, pathBounds, 2.0);
+				currentContext->fill(textPath, state.textStyle.fill, false, pathBounds);
 			}
-			textPath.transform(AffineTransformation().translate(state.textCaret.x, state.textCaret.y));
-			const Rect<double> pathBounds(textPath.calcFloatBounds());
-			currentContext->stroke(textPath, state.textStyle.outline, pathBounds, 2.0);
-			currentContext->fill(textPath, state.textStyle.fill, false, pathBounds);
 			switch (anchor) {
 				case LEFT_ANCHOR: // Fall through
 				case CENTER_ANCHOR: state.textCaret.x += advance; break;
@@ -1576,27 +2737,158 @@ bool IVGExecutor::execute(Interpreter& impd, const String& instruction, const St
 }
 
 IVGExecutor::~IVGExecutor() {
-	for (ImageMap::iterator it = definedImages.begin(); it != definedImages.end(); ++it) {
-		delete it->second.raster;
-		it->second.raster = 0;
+	deleteRasters(definedImages);
+	deleteRasters(previousImages);
+}
+
+/* --- ImageCache --- */
+
+ImageCache::ImageCache(size_t maxBytes) : maxBytes(maxBytes), usedBytes(0) { }
+
+// Averages 2x2 pixels (premultiplied, so this is correct for alpha too). Odd edges repeat their last row or column.
+static SelfContainedRaster<ARGB32>* halveImage(const Raster<ARGB32>& source) {
+	const IntRect bounds = source.calcBounds();
+	assert(bounds.left == 0 && bounds.top == 0);
+	const int width = (bounds.width + 1) >> 1;
+	const int height = (bounds.height + 1) >> 1;
+	SelfContainedRaster<ARGB32>* half = new SelfContainedRaster<ARGB32>(IntRect(0, 0, width, height), source.isOpaque());
+	const ARGB32::Pixel* sourcePixels = source.getPixelPointer();
+	const int sourceStride = source.getStride();
+	ARGB32::Pixel* halfPixels = half->getPixelPointer();
+	const int halfStride = half->getStride();
+	for (int y = 0; y < height; ++y) {
+		const ARGB32::Pixel* row0 = sourcePixels + (y * 2) * sourceStride;
+		const ARGB32::Pixel* row1 = sourcePixels + minValue(y * 2 + 1, bounds.height - 1) * sourceStride;
+		for (int x = 0; x < width; ++x) {
+			const int x0 = x * 2;
+			const int x1 = minValue(x0 + 1, bounds.width - 1);
+			const UInt32 p00 = row0[x0];
+			const UInt32 p01 = row0[x1];
+			const UInt32 p10 = row1[x0];
+			const UInt32 p11 = row1[x1];
+			const UInt32 rb = (p00 & 0x00FF00FF) + (p01 & 0x00FF00FF) + (p10 & 0x00FF00FF) + (p11 & 0x00FF00FF)
+					+ 0x00020002;
+			const UInt32 ag = ((p00 >> 8) & 0x00FF00FF) + ((p01 >> 8) & 0x00FF00FF) + ((p10 >> 8) & 0x00FF00FF)
+					+ ((p11 >> 8) & 0x00FF00FF) + 0x00020002;
+			halfPixels[y * halfStride + x] = ((rb >> 2) & 0x00FF00FF) | (((ag >> 2) & 0x00FF00FF) << 8);
+		}
+	}
+	return half;
+}
+
+Image ImageCache::lookup(const WideString& imageSource, const IntRect* sourceRectangle, double forXSize
+		, bool xSizeIsRelative, double forYSize, bool ySizeIsRelative, RasterPointer& holder) {
+	EntryMap::iterator it = entries.find(imageSource);
+	if (it == entries.end()) {
+		SelfContainedRaster<ARGB32>* decoded = decodeImage(imageSource);
+		Entry entry;
+		if (decoded != 0) {
+			entry.levels.push_back(RasterPointer(decoded));
+			entry.bytes = calcRasterBytes(*decoded);
+		} else {	// remember the failure so that the image isn't decoded again on every reference
+			entry.bytes = sizeof (Entry) + imageSource.size() * sizeof (WideString::value_type);
+		}
+		charge.add(entry.bytes);
+		it = entries.insert(EntryMap::value_type(imageSource, entry)).first;
+		uses.push_front(&it->first);
+		it->second.use = uses.begin();
+		usedBytes += entry.bytes;
+	}
+	Entry& entry = it->second;
+	uses.splice(uses.begin(), uses, entry.use);
+	if (entry.levels.empty()) {
+		trim();
+		return Image();
+	}
+	
+	const IntRect fullBounds = entry.levels[0]->calcBounds();
+	size_t level = 0;
+	if (sourceRectangle == 0 && fullBounds.width > 0 && fullBounds.height > 0) {
+		// Scale wanted relative to the full size image.
+		const double scale = maxValue(xSizeIsRelative ? forXSize : forXSize / fullBounds.width
+				, ySizeIsRelative ? forYSize : forYSize / fullBounds.height);
+		int width = fullBounds.width;
+		int height = fullBounds.height;
+		while ((width > 1 || height > 1) && ((width + 1) >> 1) >= scale * fullBounds.width
+				&& ((height + 1) >> 1) >= scale * fullBounds.height) {
+			width = (width + 1) >> 1;
+			height = (height + 1) >> 1;
+			++level;
+		}
+		while (entry.levels.size() <= level) {
+			const RasterPointer half(halveImage(*entry.levels.back()));
+			const size_t halfBytes = calcRasterBytes(*half);
+			charge.add(halfBytes);
+			entry.levels.push_back(half);
+			entry.bytes += halfBytes;
+			usedBytes += halfBytes;
+		}
 	}
+	trim();
+	
+	holder = entry.levels[level];
+	const IntRect levelBounds = holder->calcBounds();
+	Image image;
+	image.raster = holder.get();
+	image.xResolution = static_cast<double>(levelBounds.width) / fullBounds.width;
+	image.yResolution = static_cast<double>(levelBounds.height) / fullBounds.height;
+	return image;
+}
+
+void ImageCache::trim() {
+	while (usedBytes > maxBytes && entries.size() > 1) {	// never evicts the most recently used entry
+		const EntryMap::iterator oldest = entries.find(*uses.back());
+		usedBytes -= oldest->second.bytes;
+		charge.remove(oldest->second.bytes);
+		uses.pop_back();
+		entries.erase(oldest);
+	}
+}
+
+void ImageCache::setMemoryBudget(MemoryBudget* budget) { charge.setBudget(budget); }
+
+void ImageCache::clear() {
+	charge.remove(charge.getBytes());
+	uses.clear();
+	entries.clear();
+	usedBytes = 0;
 }
 
 /* --- ARGB32Canvas --- */
 
-ARGB32Canvas::ARGB32Canvas(Raster<ARGB32>& output) : argb32Raster(output) { }
+ARGB32Canvas::ARGB32Canvas(Raster<ARGB32>& output) : argb32Raster(output), threadPool(0) { }
 
 void ARGB32Canvas::parsePaint(Interpreter& impd, IVGExecutor& executor, Context& context, ArgumentsContainer& args, Paint& paint) const {
 	parsePaintOfType<ARGB32>(impd, executor, context, args, paint);
 }
 
-void ARGB32Canvas::blendWithARGB32(const Renderer<ARGB32>& source) { argb32Raster |= source; }
+void ARGB32Canvas::blendWithARGB32(const Renderer<ARGB32>& source) {
+	if (threadPool != 0) argb32Raster.blend(source, *threadPool);
+	else argb32Raster |= source;
+}
+void ARGB32Canvas::blendPairWithARGB32(const Renderer<ARGB32>& first, const Renderer<ARGB32>& second) {
+	if (threadPool != 0) argb32Raster.blendBoth(first, second, *threadPool);
+	else argb32Raster.blendBoth(first, second);
+}
 void ARGB32Canvas::defineBounds(const IntRect& newBounds) { (void)newBounds; }
 IntRect ARGB32Canvas::getBounds() const { return argb32Raster.calcBounds(); }
+void ARGB32Canvas::setThreadPool(ThreadPool* pool) { threadPool = pool; }
 
 /* --- SelfContainedARGB32Canvas --- */
 
-SelfContainedARGB32Canvas::SelfContainedARGB32Canvas(double rescaleBounds) : rescaleBounds(rescaleBounds) { }
+static IntRect calcRescaledBounds(const IntRect& bounds, double rescaleBounds) {
+	if (rescaleBounds == 1.0) {
+		return bounds;
+	}
+	return expandToIntRect(Rect<double>(bounds.left * rescaleBounds, bounds.top * rescaleBounds
+			, bounds.width * rescaleBounds, bounds.height * rescaleBounds));
+}
+
+SelfContainedARGB32Canvas::SelfContainedARGB32Canvas(double rescaleBounds) : rescaleBounds(rescaleBounds)
+		, hasViewport(false), threadPool(0), rasterCharge(0) { }
+
+SelfContainedARGB32Canvas::SelfContainedARGB32Canvas(const IntRect& viewport, double rescaleBounds)
+		: rescaleBounds(rescaleBounds), hasViewport(true), viewport(viewport), threadPool(0), rasterCharge(0) { }
 
 void SelfContainedARGB32Canvas::parsePaint(Interpreter& impd, IVGExecutor& executor, Context& context, ArgumentsContainer& args, Paint& paint) const {
 	parsePaintOfType<ARGB32>(impd, executor, context, args, paint);
@@ -1606,31 +2898,596 @@ void SelfContainedARGB32Canvas::checkBoundsDeclared() const {
 	if (raster.get() == 0) Interpreter::throwRunTimeError("Undeclared bounds");
 }
 
+Raster<ARGB32>& SelfContainedARGB32Canvas::accessTarget() const {
+	checkBoundsDeclared();
+	return (clippedRaster.get() != 0 ? *clippedRaster : *raster);
+}
+
 void SelfContainedARGB32Canvas::defineBounds(const IntRect& newBounds) {
-	IntRect scaledBounds = newBounds;
-	if (rescaleBounds != 1.0) {
-		scaledBounds = expandToIntRect(Rect<double>(newBounds.left * rescaleBounds
-				, newBounds.top * rescaleBounds, newBounds.width * rescaleBounds, newBounds.height * rescaleBounds));
-	}
 	if (raster.get() != 0) Interpreter::throwRunTimeError("Multiple bounds declarations");
+	if (hasViewport) {
+		/*
+			The rescaled document may be far larger than any raster we could allocate (that is the point of a
+			viewport), so only the unscaled bounds and the viewport size are checked like ordinary bounds. The
+			viewport may lie anywhere within the coordinate range of the rasterizer. The intersection is calculated
+			in floating point to avoid integer overflow at extreme scales.
+		*/
+		checkBounds(newBounds);
+		if (viewport.left < -MAX_SAFE_COORDINATE || viewport.left >= MAX_SAFE_COORDINATE
+				|| viewport.top < -MAX_SAFE_COORDINATE || viewport.top >= MAX_SAFE_COORDINATE) {
+			Interpreter::throwRunTimeError(String("viewport position out of range [-4194304..4194303]: ")
+					+ Interpreter::toString(viewport.left) + "," + Interpreter::toString(viewport.top));
+		}
+		checkBounds(IntRect(0, 0, viewport.width, viewport.height));
+		rasterCharge.add(static_cast<size_t>(viewport.width) * viewport.height * sizeof (ARGB32::Pixel));
+		const Rect<double> scaledBounds(newBounds.left * rescaleBounds, newBounds.top * rescaleBounds
+				, newBounds.width * rescaleBounds, newBounds.height * rescaleBounds);
+		const IntRect clipBounds = expandToIntRect(scaledBounds.calcIntersection(Rect<double>(viewport.left
+				, viewport.top, viewport.width, viewport.height)));
+		/*
+			Clamp against the whole document like a full render would, but no further than a quarter of the safe
+			coordinate range around the viewport so that the clamp rect stays within reach of PolygonMask.
+		*/
+		const double margin = MAX_SAFE_COORDINATE / 4;
+		clampBounds = expandToIntRect(scaledBounds.calcIntersection(Rect<double>(viewport.left - margin
+				, viewport.top - margin, viewport.width + margin * 2.0, viewport.height + margin * 2.0)));
+		raster.reset(new SelfContainedRaster<ARGB32>(viewport));
+		(*raster) = Solid<ARGB32>(ARGB32::transparent());
+		clippedRaster.reset(new Raster<ARGB32>(raster->getPixelPointer(), raster->getStride(), clipBounds, false));
+		return;
+	}
+	const IntRect scaledBounds = calcRescaledBounds(newBounds, rescaleBounds);
 	checkBounds(scaledBounds);
+	rasterCharge.add(static_cast<size_t>(scaledBounds.width) * scaledBounds.height * sizeof (ARGB32::Pixel));
 	raster.reset(new SelfContainedRaster<ARGB32>(scaledBounds));
 	(*raster) = Solid<ARGB32>(ARGB32::transparent());
 }
 
-void SelfContainedARGB32Canvas::blendWithARGB32(const Renderer<ARGB32>& source) { checkBoundsDeclared(); (*raster) |= source; }
-IntRect SelfContainedARGB32Canvas::getBounds() const { checkBoundsDeclared(); return raster->calcBounds(); }
+void SelfContainedARGB32Canvas::blendWithARGB32(const Renderer<ARGB32>& source) {
+	if (threadPool != 0) accessTarget().blend(source, *threadPool);
+	else accessTarget() |= source;
+}
+void SelfContainedARGB32Canvas::blendPairWithARGB32(const Renderer<ARGB32>& first, const Renderer<ARGB32>& second) {
+	if (threadPool != 0) accessTarget().blendBoth(first, second, *threadPool);
+	else accessTarget().blendBoth(first, second);
+}
+void SelfContainedARGB32Canvas::setThreadPool(ThreadPool* pool) { threadPool = pool; }
+void SelfContainedARGB32Canvas::setMemoryBudget(MemoryBudget* budget) { rasterCharge.setBudget(budget); }
+IntRect SelfContainedARGB32Canvas::getBounds() const { return accessTarget().calcBounds(); }
+IntRect SelfContainedARGB32Canvas::getClampBounds() const { return (hasViewport ? clampBounds : getBounds()); }
 SelfContainedRaster<ARGB32>* SelfContainedARGB32Canvas::accessRaster() { checkBoundsDeclared(); return raster.get(); }
-SelfContainedRaster<ARGB32>* SelfContainedARGB32Canvas::relinquishRaster() { checkBoundsDeclared(); return raster.release(); }
+SelfContainedRaster<ARGB32>* SelfContainedARGB32Canvas::relinquishRaster() {
+	checkBoundsDeclared();
+	clippedRaster.reset();
+	rasterCharge.remove(rasterCharge.getBytes());
+	return raster.release();
+}
+
+/* --- TiledRenderer --- */
+
+/*
+	Interprets the document for TiledRenderer. Fills and strokes are recorded as DrawCommands and binned by the tiles
+	their device bounds touch. replay() rasterizes every tile on the threads of the pool, each running its own
+	commands in order through a canvas limited to the tile, so PolygonMask only scans the rows of that tile. Anything
+	that is blended directly (images, glyph bitmaps and wipes) first replays what has been recorded so far and is then
+	blended into the whole raster in bands on the same threads.
+	
+	Tiles span the full width of the raster. Some renderers are not exactly independent of where a span starts (e.g.
+	RadialAscend groups pixels four by four from the start of each span), but every row is rendered the same way
+	regardless of which rows are rendered with it.
+*/
+class TiledRenderer::RecordingCanvas : public Canvas {
+	public:		RecordingCanvas(TiledRenderer& renderer, double rescaleBounds)
+						: renderer(renderer), rescaleBounds(rescaleBounds), tileHeight(0) { }
+	public:		virtual void parsePaint(Interpreter& impd, IVGExecutor& executor, Context& context, ArgumentsContainer& args
+						, Paint& paint) const {
+					parsePaintOfType<ARGB32>(impd, executor, context, args, paint);
+				}
+	public:		virtual void blendWithARGB32(const Renderer<ARGB32>& source) {
+					replay();
+					accessTarget().blendWithARGB32(source);
+				}
+	public:		virtual void blendPairWithARGB32(const Renderer<ARGB32>& first, const Renderer<ARGB32>& second) {
+					replay();
+					accessTarget().blendPairWithARGB32(first, second);
+				}
+	public:		virtual void defineBounds(const IntRect& newBounds);
+	public:		virtual IntRect getBounds() const {
+					if (target.get() == 0) Interpreter::throwRunTimeError("Undeclared bounds");
+					return target->getBounds();
+				}
+	public:		virtual bool isDeferred() const { return true; }
+	public:		virtual void enqueue(DrawCommand* command);
+	public:		virtual void sync() { replay(); }
+	public:		virtual ~RecordingCanvas();
+	protected:	struct Tile {
+					Tile(Raster<ARGB32>& raster, const IntRect& area)
+							: view(raster.getPixelPointer(), raster.getStride(), area, false), canvas(view)
+							, context(canvas, AffineTransformation()) { }
+					Raster<ARGB32> view;
+					ARGB32Canvas canvas;
+					Context context;
+					PolygonMask::Workspace workspace;
+					std::vector<size_t> commands;				// indices into RecordingCanvas::commands, in order
+				};
+	protected:	static void replayTile(void* data, int index);
+	protected:	void replay();
+	protected:	void discardCommands();
+	protected:	ARGB32Canvas& accessTarget() {
+					if (target.get() == 0) Interpreter::throwRunTimeError("Undeclared bounds");
+					return *target;
+				}
+	protected:	TiledRenderer& renderer;
+	protected:	const double rescaleBounds;
+	protected:	int tileHeight;
+	protected:	std::unique_ptr<ARGB32Canvas> target;			// the whole raster, for direct blends
+	protected:	std::vector<Tile*> tiles;						// owned
+	protected:	std::vector<DrawCommand*> commands;				// owned, replayed and discarded by replay()
+	protected:	RecordingCanvas(const RecordingCanvas& that); // N/A
+	protected:	RecordingCanvas& operator=(const RecordingCanvas& that); // N/A
+};
+
+/*
+	Recorded commands (and the device paths and polygon edges charged for them) are replayed once this many have
+	piled up, so that memory stays bounded while there are still enough of them per replay to keep every thread busy.
+*/
+static const size_t MAX_RECORDED_COMMANDS = 1024;
+
+void TiledRenderer::RecordingCanvas::defineBounds(const IntRect& newBounds) {
+	if (target.get() != 0) Interpreter::throwRunTimeError("Multiple bounds declarations");
+	const IntRect bounds = calcRescaledBounds(newBounds, rescaleBounds);
+	checkBounds(bounds);
+	renderer.rasterCharge.add(static_cast<size_t>(bounds.width) * bounds.height * sizeof (ARGB32::Pixel));
+	renderer.raster.reset(new SelfContainedRaster<ARGB32>(bounds));
+	renderer.raster->fill(Solid<ARGB32>(ARGB32::transparent()), bounds, renderer.pool);
+	target.reset(new ARGB32Canvas(*renderer.raster));
+	target->setThreadPool(&renderer.pool);
+	const int threads = renderer.pool.getThreadCount();
+	tileHeight = renderer.tileHeight;
+	if (tileHeight <= 0) {
+		tileHeight = (threads == 1 ? bounds.height : maxValue((bounds.height + threads * 4 - 1) / (threads * 4), 32));
+	}
+	for (int y = bounds.top; y < bounds.calcBottom(); y += tileHeight) {
+		tiles.push_back(0);
+		tiles.back() = new Tile(*renderer.raster, IntRect(bounds.left, y, bounds.width
+				, minValue(tileHeight, bounds.calcBottom() - y)));
+	}
+}
+
+void TiledRenderer::RecordingCanvas::enqueue(DrawCommand* command) {
+	std::unique_ptr<DrawCommand> owned(command);
+	const IntRect bounds = getBounds();
+	IntRect drawBounds = expandToIntRect(command->shape == DrawCommand::ROUNDED_RECT ? command->rect
+			: command->path.calcFloatBounds()).calcIntersection(bounds);
+	const RLERaster<Mask8>* mask = command->mask;
+	if (mask != 0) {
+		drawBounds = drawBounds.calcIntersection(mask->calcCoverageBounds());
+	}
+	if (drawBounds.width <= 0 || drawBounds.height <= 0) {
+		return;	// blends nothing anywhere
+	}
+	const int firstTile = (drawBounds.top - bounds.top) / tileHeight;
+	const int lastTile = (drawBounds.calcBottom() - 1 - bounds.top) / tileHeight;
+	commands.reserve(commands.size() + 1);
+	for (int i = firstTile; i <= lastTile; ++i) {
+		tiles[i]->commands.push_back(commands.size());
+	}
+	commands.push_back(owned.release());
+	if (commands.size() >= MAX_RECORDED_COMMANDS) {
+		replay();
+	}
+}
+
+void TiledRenderer::RecordingCanvas::replayTile(void* data, int index) {
+	RecordingCanvas& canvas = *static_cast<RecordingCanvas*>(data);
+	Tile& tile = *canvas.tiles[index];
+	for (size_t i = 0; i < tile.commands.size(); ++i) {
+		canvas.commands[tile.commands[i]]->execute(tile.context, tile.workspace);
+	}
+}
+
+void TiledRenderer::RecordingCanvas::replay() {
+	if (!commands.empty()) {
+		try {
+			renderer.pool.run(static_cast<int>(tiles.size()), replayTile, this);
+		}
+		catch (...) {
+			discardCommands();
+			throw;
+		}
+		discardCommands();
+	}
+}
+
+void TiledRenderer::RecordingCanvas::discardCommands() {
+	for (size_t i = 0; i < commands.size(); ++i) {
+		delete commands[i];
+	}
+	commands.clear();
+	for (size_t i = 0; i < tiles.size(); ++i) {
+		tiles[i]->commands.clear();
+	}
+}
+
+TiledRenderer::RecordingCanvas::~RecordingCanvas() {
+	discardCommands();
+	for (size_t i = 0; i < tiles.size(); ++i) {
+		delete tiles[i];
+	}
+}
+
+TiledRenderer::TiledRenderer(int threadCount, int tileHeight) : tileHeight(tileHeight), pool(threadCount)
+		, rasterCharge(0) { }
+
+void TiledRenderer::setMemoryBudget(MemoryBudget* budget) {
+	raster.reset();
+	rasterCharge.remove(rasterCharge.getBytes());
+	rasterCharge.setBudget(budget);
+}
+
+IVGExecutor* TiledRenderer::createExecutor(Canvas& canvas, const AffineTransformation& initialTransform) {
+	return new IVGExecutor(canvas, initialTransform);
+}
+
+void TiledRenderer::render(const String& source, double scale) {
+	raster.reset();
+	rasterCharge.remove(rasterCharge.getBytes());
+	try {
+		RecordingCanvas canvas(*this, scale);
+		const std::unique_ptr<IVGExecutor> executor(createExecutor(canvas, AffineTransformation().scale(scale)));
+		STLMapVariables vars;
+		FormatInfo formatInfo;
+		Interpreter impd(*executor, vars, formatInfo);
+		impd.run(source);
+		canvas.sync();
+		if (raster.get() == 0) Interpreter::throwRunTimeError("Undeclared bounds");
+	}
+	catch (...) {
+		raster.reset();
+		rasterCharge.remove(rasterCharge.getBytes());
+		throw;
+	}
+}
+
+SelfContainedRaster<ARGB32>* TiledRenderer::accessRaster() {
+	if (raster.get() == 0) Interpreter::throwRunTimeError("Undeclared bounds");
+	return raster.get();
+}
+
+SelfContainedRaster<ARGB32>* TiledRenderer::relinquishRaster() {
+	if (raster.get() == 0) Interpreter::throwRunTimeError("Undeclared bounds");
+	rasterCharge.remove(rasterCharge.getBytes());
+	return raster.release();
+}
+
+/* --- AnimationRenderer --- */
+
+AnimationRenderer::AnimationRenderer(const String& source, double scale, const String& timeVariable)
+		: source(source), scale(scale), timeVariable(timeVariable) { }
+
+IVGExecutor* AnimationRenderer::createExecutor(Canvas& canvas, const AffineTransformation& initialTransform) {
+	return new IVGExecutor(canvas, initialTransform);
+}
+
+void AnimationRenderer::renderFrame(double time) {
+	std::unique_ptr<SelfContainedARGB32Canvas> frameCanvas(new SelfContainedARGB32Canvas(scale));
+	if (executor.get() == 0) {
+		executor.reset(createExecutor(*frameCanvas, AffineTransformation().scale(scale)));
+	} else {
+		executor->restart(*frameCanvas);
+	}
+	canvas.reset(frameCanvas.release());
+	STLMapVariables vars;
+	vars.declare(timeVariable, Interpreter::toString(time));
+	FormatInfo formatInfo;
+	Interpreter impd(*executor, vars, formatInfo);
+	impd.run(source);
+}
+
+SelfContainedRaster<ARGB32>* AnimationRenderer::accessRaster() {
+	if (canvas.get() == 0) Interpreter::throwRunTimeError("Undeclared bounds");
+	return canvas->accessRaster();
+}
+
+SelfContainedRaster<ARGB32>* AnimationRenderer::relinquishRaster() {
+	if (canvas.get() == 0) Interpreter::throwRunTimeError("Undeclared bounds");
+	return canvas->relinquishRaster();
+}
+
+/* --- BatchRenderer --- */
+
+BatchRenderer::BatchRenderer(int threadCount) : pool(threadCount), jobs(0) {
+	freeCaches.reserve(pool.getThreadCount());	// so that returning caches never allocates
+}
+
+BatchRenderer::~BatchRenderer() {
+	for (size_t i = 0; i < freeCaches.size(); ++i) {
+		delete freeCaches[i];
+	}
+}
+
+IVGExecutor* BatchRenderer::createExecutor(Canvas& canvas, const AffineTransformation& initialTransform) {
+	return new IVGExecutor(canvas, initialTransform);
+}
+
+void BatchRenderer::finishJob(int index, Job& job) {
+	(void)index;
+	(void)job;
+}
+
+void BatchRenderer::renderJob(Job& job, Caches& caches) {
+	SelfContainedARGB32Canvas canvas(job.scale);
+	{
+		const std::unique_ptr<IVGExecutor> executor(createExecutor(canvas, AffineTransformation().scale(job.scale)));
+		executor->setSVGPathCache(&caches.svgPaths);
+		executor->setTextLayoutCache(&caches.textLayouts);
+		STLMapVariables vars;
+		for (StringStringMap::const_iterator it = job.variables.begin(); it != job.variables.end(); ++it) {
+			vars.declare(it->first, it->second);
+		}
+		FormatInfo formatInfo;
+		Interpreter impd(*executor, vars, formatInfo);
+		impd.run(job.source);
+	}
+	job.raster.reset(canvas.relinquishRaster());
+}
+
+// Must be called from a catch block.
+static std::string describeCurrentException() {
+	try {
+		throw;
+	}
+	catch (const IMPD::Exception& x) {
+		return (x.hasStatement() ? x.getError() + " in statement: " + x.getStatement() : x.getError());
+	}
+	catch (const std::exception& x) {
+		return x.what();
+	}
+	catch (...) {
+		return "General exception";
+	}
+}
+
+void BatchRenderer::runJob(void* data, int index) {
+	BatchRenderer& renderer = *static_cast<BatchRenderer*>(data);
+	Job& job = (*renderer.jobs)[index];
+	job.raster.reset();
+	job.error.clear();
+	
+	Caches* caches = 0;
+	{
+		std::lock_guard<std::mutex> lock(renderer.cachesMutex);
+		if (!renderer.freeCaches.empty()) {
+			caches = renderer.freeCaches.back();
+			renderer.freeCaches.pop_back();
+		}
+	}
+	try {
+		if (caches == 0) {
+			caches = new Caches;
+		}
+		renderer.renderJob(job, *caches);
+	}
+	catch (...) {
+		job.raster.reset();
+		job.error = describeCurrentException();
+	}
+	if (caches != 0) {
+		std::lock_guard<std::mutex> lock(renderer.cachesMutex);
+		renderer.freeCaches.push_back(caches);
+	}
+	try {
+		renderer.finishJob(index, job);
+	}
+	catch (...) {
+		job.error = describeCurrentException();
+	}
+}
+
+void BatchRenderer::render(std::vector<Job>& jobs) {
+	this->jobs = &jobs;
+	pool.run(static_cast<int>(jobs.size()), runJob, this);
+	this->jobs = 0;
+}
+
+/* --- PipelinedCanvas --- */
+
+/*
+	Single producer, single consumer ring buffer. The interpreting thread writes slots at `tail` and the raster
+	thread frees them at `head` once it has rasterized them, so `head == tail` means that everything has been drawn.
+	Passing commands never takes a lock. The mutex and condition variable are only used by a thread that has to
+	wait (for a free slot, a command or the queue to drain), and only touched by the other side if `waiters` says
+	that someone is waiting. All atomics are sequentially consistent, so a waiter either sees the new index or is
+	seen in `waiters`.
+*/
+class PipelinedCanvas::Queue {
+	public:		Queue(int size) : slots(size, static_cast<DrawCommand*>(0)), head(0), tail(0), waiters(0), quit(false)
+						, failed(false) { }
+	public:		~Queue() {
+					for (size_t i = 0; i < slots.size(); ++i) delete slots[i];
+				}
+	public:		void notify() {
+					if (waiters > 0) {
+						std::lock_guard<std::mutex> lock(mutex);
+						wake.notify_all();
+					}
+				}
+	public:		void waitForSlot() {
+					if (tail - head == slots.size()) {
+						std::unique_lock<std::mutex> lock(mutex);
+						++waiters;
+						while (tail - head == slots.size()) wake.wait(lock);
+						--waiters;
+					}
+				}
+	public:		bool waitForCommand() {	// false on quit
+					if (head == tail) {
+						std::unique_lock<std::mutex> lock(mutex);
+						++waiters;
+						while (head == tail && !quit) wake.wait(lock);
+						--waiters;
+					}
+					return (head != tail);
+				}
+	public:		void waitUntilDrained() {
+					if (head != tail) {
+						std::unique_lock<std::mutex> lock(mutex);
+						++waiters;
+						while (head != tail) wake.wait(lock);
+						--waiters;
+					}
+				}
+	public:		void throwIfFailed() {
+					if (failed) std::rethrow_exception(error);
+				}
+	public:		std::vector<DrawCommand*> slots;
+	public:		std::atomic<size_t> head;
+	public:		std::atomic<size_t> tail;
+	public:		std::atomic<int> waiters;
+	public:		std::atomic<bool> quit;
+	public:		std::atomic<bool> failed;
+	public:		std::exception_ptr error;	// written by the raster thread before failed is set
+	public:		std::mutex mutex;
+	public:		std::condition_variable wake;
+	public:		std::thread thread;
+};
+
+PipelinedCanvas::PipelinedCanvas(Canvas& target, int queueSize) : target(target), queue(new Queue(maxValue(queueSize, 1))) {
+	queue->thread = std::thread(&PipelinedCanvas::rasterize, this);
+}
+
+void PipelinedCanvas::rasterize() {
+	Context replayContext(target, AffineTransformation());
+	PolygonMask::Workspace workspace;
+	while (queue->waitForCommand()) {
+		const size_t index = queue->head % queue->slots.size();
+		if (!queue->failed) {	// after a failure, commands are only discarded
+			try {
+				queue->slots[index]->execute(replayContext, workspace);
+			}
+			catch (...) {
+				queue->error = std::current_exception();
+				queue->failed = true;
+			}
+		}
+		delete queue->slots[index];
+		queue->slots[index] = 0;
+		++queue->head;
+		queue->notify();
+	}
+}
+
+void PipelinedCanvas::enqueue(DrawCommand* command) {
+	std::unique_ptr<DrawCommand> owned(command);
+	queue->throwIfFailed();
+	queue->waitForSlot();
+	queue->slots[queue->tail % queue->slots.size()] = owned.release();
+	++queue->tail;
+	queue->notify();
+}
+
+void PipelinedCanvas::sync() {
+	queue->waitUntilDrained();
+	queue->throwIfFailed();
+}
+
+void PipelinedCanvas::parsePaint(Interpreter& impd, IVGExecutor& executor, Context& context, ArgumentsContainer& args
+		, Paint& paint) const {
+	target.parsePaint(impd, executor, context, args, paint);
+}
+
+void PipelinedCanvas::blendWithARGB32(const Renderer<ARGB32>& source) {
+	sync();
+	target.blendWithARGB32(source);
+}
+
+void PipelinedCanvas::blendWithMask8(const Renderer<Mask8>& source) {
+	sync();
+	target.blendWithMask8(source);
+}
+
+void PipelinedCanvas::blendPairWithARGB32(const Renderer<ARGB32>& first, const Renderer<ARGB32>& second) {
+	sync();
+	target.blendPairWithARGB32(first, second);
+}
+
+void PipelinedCanvas::blendPairWithMask8(const Renderer<Mask8>& first, const Renderer<Mask8>& second) {
+	sync();
+	target.blendPairWithMask8(first, second);
+}
+
+void PipelinedCanvas::defineBounds(const IntRect& newBounds) {
+	sync();
+	target.defineBounds(newBounds);
+}
+
+IntRect PipelinedCanvas::getBounds() const { return target.getBounds(); }	// bounds never change once defined
+
+IntRect PipelinedCanvas::getClampBounds() const { return target.getClampBounds(); }
+
+PipelinedCanvas::~PipelinedCanvas() {
+	{
+		std::lock_guard<std::mutex> lock(queue->mutex);
+		queue->quit = true;
+	}
+	queue->wake.notify_all();
+	queue->thread.join();
+}
+
+/* --- DryRunCanvas --- */
+
+DryRunCanvas::Stats::Stats() : drawBounds(0, 0, 0, 0), drawCount(0), vertexCount(0) { }
+
+DryRunCanvas::DryRunCanvas(double rescaleBounds) : rescaleBounds(rescaleBounds), declared(false) { }
+
+void DryRunCanvas::parsePaint(Interpreter& impd, IVGExecutor& executor, Context& context, ArgumentsContainer& args
+		, Paint& paint) const {
+	parsePaintOfType<ARGB32>(impd, executor, context, args, paint);
+}
+
+void DryRunCanvas::addDraw(const IntRect& drawBounds) {
+	stats.drawBounds = stats.drawBounds.calcUnion(drawBounds.calcIntersection(getBounds()));
+	++stats.drawCount;
+}
+
+void DryRunCanvas::blendWithARGB32(const Renderer<ARGB32>& source) { addDraw(source.calcBounds()); }
+void DryRunCanvas::blendWithMask8(const Renderer<Mask8>& source) { addDraw(source.calcBounds()); }
+
+void DryRunCanvas::enqueue(DrawCommand* command) {
+	std::unique_ptr<DrawCommand> owned(command);
+	IntRect drawBounds = expandToIntRect(command->shape == DrawCommand::ROUNDED_RECT ? command->rect
+			: command->path.calcFloatBounds());
+	const RLERaster<Mask8>* mask = command->mask;
+	if (mask != 0) {
+		drawBounds = drawBounds.calcIntersection(mask->calcCoverageBounds());
+	}
+	addDraw(drawBounds);
+	stats.vertexCount += command->path.size();
+}
+
+void DryRunCanvas::defineBounds(const IntRect& newBounds) {
+	if (declared) Interpreter::throwRunTimeError("Multiple bounds declarations");
+	bounds = calcRescaledBounds(newBounds, rescaleBounds);
+	checkBounds(bounds);
+	declared = true;
+}
+
+IntRect DryRunCanvas::getBounds() const {
+	if (!declared) Interpreter::throwRunTimeError("Undeclared bounds");
+	return bounds;
+}
+
+void DryRunCanvas::noteFontUse(const WideString& fontName) { stats.fontNames.insert(fontName); }
+void DryRunCanvas::noteImageUse(const WideString& imageName) { stats.imageNames.insert(imageName); }
 
 /* --- Font --- */
 
 Font::Metrics::Metrics() : upm(0.0), ascent(0.0), descent(0.0), linegap(0.0) { }
 
-Font::Font() { }
+Font::Font() : id(0) { }
 
 Font::Font(const Metrics& metrics, const std::vector<Font::Glyph>& glyphs
-		, const std::vector<KerningPair>& kerningPairs) : metrics(metrics), glyphs(glyphs), kerningPairs(kerningPairs) {
+		, const std::vector<KerningPair>& kerningPairs) : id(++fontIdCounter), metrics(metrics), glyphs(glyphs) {
 	if (!glyphs.empty()) {
 		for (std::vector<Font::Glyph>::const_iterator it = glyphs.begin() + 1; it != glyphs.end(); ++it) {
 			assert(it->character > (it - 1)->character);
@@ -1641,6 +3498,25 @@ Font::Font(const Metrics& metrics, const std::vector<Font::Glyph>& glyphs
 			assert(it->characters > (it - 1)->characters);
 		}
 	}
+	
+	// Two-level table for the Basic Multilingual Plane. Only pages with glyphs are allocated.
+	bmpPageOffsets.assign(256, -1);
+	for (int i = 0; i < static_cast<int>(glyphs.size()); ++i) {
+		const UniChar c = glyphs[i].character;
+		if (c < 0x10000) {
+			int& pageOffset = bmpPageOffsets[c >> 8];
+			if (pageOffset < 0) {
+				pageOffset = static_cast<int>(bmpGlyphIndices.size());
+				bmpGlyphIndices.resize(bmpGlyphIndices.size() + 256, -1);
+			}
+			bmpGlyphIndices[pageOffset + (c & 0xFF)] = i;
+		}
+	}
+	
+	kerningMap.reserve(kerningPairs.size());
+	for (std::vector<Font::KerningPair>::const_iterator it = kerningPairs.begin(); it != kerningPairs.end(); ++it) {
+		kerningMap[(static_cast<uint64_t>(it->characters.first) << 32) | it->characters.second] = it->adjust;
+	}
 }
 
 static bool compareGlyphWithCharacter(const Font::Glyph& glyph, UniChar character) {
@@ -1648,73 +3524,118 @@ static bool compareGlyphWithCharacter(const Font::Glyph& glyph, UniChar characte
 }
 
 const Font::Glyph* Font::findGlyph(UniChar forCharacter) const {
+	if (forCharacter < 0x10000) {
+		if (bmpPageOffsets.empty()) {
+			return 0;
+		}
+		const int pageOffset = bmpPageOffsets[forCharacter >> 8];
+		const int index = (pageOffset >= 0 ? bmpGlyphIndices[pageOffset + (forCharacter & 0xFF)] : -1);
+		return (index >= 0 ? &glyphs[index] : 0);
+	}
 	const std::vector<Glyph>::const_iterator it = std::lower_bound(glyphs.begin(), glyphs.end(), forCharacter
 			, compareGlyphWithCharacter);
 	return (it != glyphs.end() && it->character == forCharacter ? &(*it) : 0);
 }
 
-static bool compareKerningPairWithCharPair(const Font::KerningPair& kerningPair, const std::pair<UniChar, UniChar>& charPair) {
-	return kerningPair.characters < charPair;
-}
-
 const double Font::findKerningAdjust(UniChar characterA, UniChar characterB) const {
-	const std::pair<UniChar, UniChar> charPair(characterA, characterB);
-	const std::vector<KerningPair>::const_iterator it = std::lower_bound(kerningPairs.begin(), kerningPairs.end()
-			, charPair, compareKerningPairWithCharPair);
-	return (it != kerningPairs.end() && it->characters == charPair ? it->adjust : 0.0);
+	if (kerningMap.empty()) {
+		return 0.0;
+	}
+	const KerningMap::const_iterator it = kerningMap.find((static_cast<uint64_t>(characterA) << 32) | characterB);
+	return (it != kerningMap.end() ? it->second : 0.0);
 }
 
 const Font::Metrics& Font::getMetrics() const {
 	return metrics;
 }
 
-struct BuildPathFontInfo {
-	double mpu;
-	AffineTransformation scaledXF;
-	double effectiveQuality;
-};
+unsigned long Font::getId() const {
+	return id;
+}
+
+/* --- FontChain --- */
+
+FontChain::FontChain() { }
+
+FontChain::FontChain(const std::vector<const Font*>& fonts) : fonts(fonts), latinFontIndices(256, UNKNOWN_FONT) { }
+
+bool FontChain::empty() const { return fonts.empty(); }
+
+const std::vector<const Font*>& FontChain::getFonts() const { return fonts; }
+
+int FontChain::probeFonts(UniChar character) const {
+	for (int i = 0; i < static_cast<int>(fonts.size()); ++i) {
+		if (fonts[i]->findGlyph(character) != 0) {
+			return i;
+		}
+	}
+	return NO_FONT;
+}
+
+const Font::Glyph* FontChain::findGlyph(UniChar character, int& fontIndex) const {
+	int index;
+	if (character < 256) {
+		index = latinFontIndices[character];
+		if (index == UNKNOWN_FONT) {
+			index = latinFontIndices[character] = probeFonts(character);
+		}
+	} else {
+		const std::unordered_map<UniChar, int>::const_iterator it = otherFontIndices.find(character);
+		index = (it != otherFontIndices.end() ? it->second : (otherFontIndices[character] = probeFonts(character)));
+	}
+	if (index == NO_FONT) {
+		return 0;
+	}
+	fontIndex = index;
+	return fonts[index]->findGlyph(character);
+}
 
 bool buildPathForString(const UniString& string, const std::vector<const Font*>& fonts, double size
 		, const AffineTransformation& glyphTransform, double letterSpacing, double curveQuality, Path& path
 		, double& advance, const char*& errorString, UniChar lastCharacter) {
+	return buildPathForString(string, FontChain(fonts), size, glyphTransform, letterSpacing, curveQuality, path
+			, advance, errorString, lastCharacter);
+}
+
+bool buildPathForString(const UniString& string, const FontChain& fontChain, double size
+		, const AffineTransformation& glyphTransform, double letterSpacing, double curveQuality, Path& path
+		, double& advance, const char*& errorString, UniChar lastCharacter, SVGPathCache* glyphPathCache) {
+	const std::vector<const Font*>& fonts = fontChain.getFonts();
 	assert(!fonts.empty());
 	std::vector<BuildPathFontInfo> fontInfos;
-	fontInfos.reserve(fonts.size());
-	for (std::vector<const Font*>::const_iterator fontIt = fonts.begin(); fontIt != fonts.end(); ++fontIt) {
-		BuildPathFontInfo fontInfo;
-		assert(*fontIt != 0);
-		fontInfo.mpu = 1.0 / (*fontIt)->getMetrics().upm;
-		fontInfo.scaledXF = AffineTransformation().scale(fontInfo.mpu).transform(glyphTransform).scale(size);
-		fontInfo.effectiveQuality = calcCurveQualityForTransform(fontInfo.scaledXF) * curveQuality;
-		fontInfos.push_back(fontInfo);
-	}
+	makeFontInfos(fonts, size, glyphTransform, curveQuality, fontInfos);
 	bool success = true;
 	advance = 0.0;
 	const Font* lastFont = 0;
 	for (UniString::const_iterator it = string.begin(); it != string.end(); ++it) {
 		UniChar thisCharacter = *it;
 		Path glyphPath;
-		const IVG::Font::Glyph* glyph = 0;
-		std::vector<BuildPathFontInfo>::const_iterator fontInfoIt = fontInfos.begin();
-		std::vector<const Font*>::const_iterator fontIt = fonts.begin();
-		while (fontIt != fonts.end() && (glyph = (*fontIt)->findGlyph(thisCharacter)) == 0) {
-			++fontIt;
-			++fontInfoIt;
-		}
+		int fontIndex = 0;
+		const IVG::Font::Glyph* glyph = fontChain.findGlyph(thisCharacter, fontIndex);
 		if (glyph == 0) {
-			fontIt = fonts.begin();
-			fontInfoIt = fontInfos.begin();
+			fontIndex = 0;
 			thisCharacter = 0;
 			glyph = fonts[0]->findGlyph(thisCharacter);
 		}
+		const Font* font = fonts[fontIndex];
+		const BuildPathFontInfo& fontInfo = fontInfos[fontIndex];
 		const char* thisError = 0;
-		if (glyph != 0 && IVG::buildPathFromSVG(glyph->svgPath, fontInfoIt->effectiveQuality, glyphPath, thisError)) {
-			advance += (*fontIt == lastFont
-					? (*fontIt)->findKerningAdjust(lastCharacter, thisCharacter) * fontInfoIt->mpu * size : 0.0);
-			lastFont = *fontIt;
+		bool built = false;
+		if (glyph != 0 && glyphPathCache != 0) {
+			SVGPathCache::PathPointer cached = glyphPathCache->lookup(glyph->svgPath, fontInfo.effectiveQuality, thisError);
+			if (cached) {
+				glyphPath = *cached;
+				built = true;
+			}
+		} else if (glyph != 0) {
+			built = IVG::buildPathFromSVG(glyph->svgPath, fontInfo.effectiveQuality, glyphPath, thisError);
+		}
+		if (built) {
+			advance += (font == lastFont ? font->findKerningAdjust(lastCharacter, thisCharacter) * fontInfo.mpu * size : 0.0);
+			lastFont = font;
 			lastCharacter = thisCharacter;
-			glyphPath.transform(fontInfoIt->scaledXF.translate(advance, 0.0));
-			advance += (glyph->advance * fontInfoIt->mpu + letterSpacing) * size;
+			glyphPath.transform(fontInfo.scaledXF.translate(advance, 0.0));
+			advance += (glyph->advance * fontInfo.mpu + letterSpacing) * size;
 			path.append(glyphPath);
 		} else {
 			if (success) {
@@ -1726,6 +3647,192 @@ bool buildPathForString(const UniString& string, const std::vector<const Font*>&
 	return success;
 }
 
+/* --- TextLayoutCache --- */
+
+bool TextLayoutCache::Key::operator<(const Key& other) const {
+	if (string != other.string) return string < other.string;
+	if (fontIds != other.fontIds) return fontIds < other.fontIds;
+	return std::lexicographical_compare(parameters, parameters + 3 + 6, other.parameters, other.parameters + 3 + 6);
+}
+
+TextLayoutCache::TextLayoutCache(size_t maxEntries) : maxEntries(maxEntries) { }
+
+bool TextLayoutCache::buildPathForString(const UniString& string, const FontChain& fonts, double size
+		, const AffineTransformation& glyphTransform, double letterSpacing, double curveQuality, Path& path
+		, double& advance, const char*& errorString) {
+	Key key;
+	key.string = string;
+	for (std::vector<const Font*>::const_iterator it = fonts.getFonts().begin(); it != fonts.getFonts().end(); ++it) {
+		key.fontIds.push_back((*it)->getId());
+	}
+	key.parameters[0] = size;
+	key.parameters[1] = letterSpacing;
+	key.parameters[2] = curveQuality;
+	std::copy(&glyphTransform.matrix[0][0], &glyphTransform.matrix[0][0] + 6, key.parameters + 3);
+	
+	LayoutMap::iterator it = layouts.find(key);
+	if (it == layouts.end()) {
+		if (layouts.size() >= maxEntries && !layouts.empty()) {
+			layouts.erase(*uses.back());
+			uses.pop_back();
+		}
+		it = layouts.insert(LayoutMap::value_type(key, Layout())).first;
+		uses.push_front(&it->first);
+		Layout& layout = it->second;
+		layout.use = uses.begin();
+		layout.errorString = 0;
+		if (!IVG::buildPathForString(string, fonts, size, glyphTransform, letterSpacing, curveQuality, layout.path
+				, layout.advance, layout.errorString, 0, &glyphPaths)) {
+			assert(layout.errorString != 0);
+		}
+	}
+	uses.splice(uses.begin(), uses, it->second.use);
+	path.append(it->second.path);
+	advance = it->second.advance;
+	errorString = it->second.errorString;
+	return (errorString == 0);
+}
+
+void TextLayoutCache::clear() {
+	uses.clear();
+	layouts.clear();
+	glyphPaths.clear();
+}
+
+/* --- SVGPathCache --- */
+
+SVGPathCache::SVGPathCache(size_t maxBytes) : maxBytes(maxBytes), usedBytes(0) { }
+
+SVGPathCache::PathPointer SVGPathCache::lookup(const String& svgSource, double curveQuality, const char*& errorString) {
+	const Key key(curveQuality, svgSource);
+	EntryMap::iterator it = entries.find(key);
+	if (it == entries.end()) {
+		Entry entry;
+		entry.errorString = 0;
+		Path* path = new Path();
+		entry.path.reset(path);
+		entry.bytes = sizeof (Entry) + svgSource.size();
+		if (buildPathFromSVG(svgSource, curveQuality, *path, entry.errorString)) {
+			entry.bytes += path->size() * sizeof (Path::Instruction);
+		} else {
+			entry.path.reset();
+			if (entry.errorString == 0) entry.errorString = "Unknown error";
+		}
+		if (entry.bytes > maxBytes) {
+			errorString = entry.errorString;
+			return entry.path;
+		}
+		while (usedBytes + entry.bytes > maxBytes && !entries.empty()) {
+			const EntryMap::iterator oldest = entries.find(*uses.back());
+			usedBytes -= oldest->second.bytes;
+			uses.pop_back();
+			entries.erase(oldest);
+		}
+		usedBytes += entry.bytes;
+		it = entries.insert(EntryMap::value_type(key, entry)).first;
+		uses.push_front(&it->first);
+		it->second.use = uses.begin();
+	}
+	uses.splice(uses.begin(), uses, it->second.use);
+	errorString = it->second.errorString;
+	return it->second.path;
+}
+
+void SVGPathCache::clear() {
+	uses.clear();
+	entries.clear();
+	usedBytes = 0;
+}
+
+/* --- GlyphBitmapCache --- */
+
+bool GlyphBitmapCache::Key::operator<(const Key& other) const {
+	if (fontId != other.fontId) return fontId < other.fontId;
+	if (character != other.character) return character < other.character;
+	if (subpixelBucket != other.subpixelBucket) return subpixelBucket < other.subpixelBucket;
+	return std::lexicographical_compare(parameters, parameters + 1 + 4, other.parameters, other.parameters + 1 + 4);
+}
+
+GlyphBitmapCache::GlyphBitmapCache(double maxPixelSize, int subpixelSteps, size_t maxBytes)
+		: maxPixelSize(maxPixelSize), subpixelSteps(subpixelSteps), maxBytes(maxBytes), usedBytes(0) {
+	assert(subpixelSteps >= 1);
+}
+
+double GlyphBitmapCache::getMaxPixelSize() const { return maxPixelSize; }
+int GlyphBitmapCache::getSubpixelSteps() const { return subpixelSteps; }
+
+void GlyphBitmapCache::reserveBytes(size_t bytes) {
+	if (usedBytes + bytes > maxBytes) {
+		clear();
+	}
+	usedBytes += bytes;
+}
+
+GlyphBitmapCache::OutlinePointer GlyphBitmapCache::lookupOutline(const Font& font, const Font::Glyph& glyph
+		, double curveQuality, const char*& errorString) {
+	Key key;
+	key.fontId = font.getId();
+	key.character = glyph.character;
+	key.subpixelBucket = -1;
+	std::fill(key.parameters, key.parameters + 1 + 4, 0.0);
+	key.parameters[0] = curveQuality;
+	std::map<Key, Outline>::const_iterator it = outlines.find(key);
+	if (it == outlines.end()) {
+		Outline outline;
+		outline.errorString = 0;
+		Path* path = new Path();
+		outline.path.reset(path);
+		size_t bytes = sizeof (Outline);
+		if (buildPathFromSVG(glyph.svgPath, curveQuality, *path, outline.errorString)) {
+			bytes += path->size() * sizeof (Path::Instruction);
+		} else {
+			outline.path.reset();
+			if (outline.errorString == 0) outline.errorString = "Unknown error";
+		}
+		reserveBytes(bytes);
+		it = outlines.insert(std::map<Key, Outline>::value_type(key, outline)).first;
+	}
+	errorString = it->second.errorString;
+	return it->second.path;
+}
+
+GlyphBitmapCache::BitmapPointer GlyphBitmapCache::lookupBitmap(const Font& font, const Font::Glyph& glyph
+		, double curveQuality, const Path& outline, const AffineTransformation& glyphToDevice, int subpixelBucket) {
+	assert(0 <= subpixelBucket && subpixelBucket < subpixelSteps);
+	Key key;
+	key.fontId = font.getId();
+	key.character = glyph.character;
+	key.subpixelBucket = subpixelBucket;
+	key.parameters[0] = curveQuality;
+	key.parameters[1] = glyphToDevice.matrix[0][0];
+	key.parameters[2] = glyphToDevice.matrix[0][1];
+	key.parameters[3] = glyphToDevice.matrix[1][0];
+	key.parameters[4] = glyphToDevice.matrix[1][1];
+	std::map<Key, BitmapPointer>::const_iterator it = bitmaps.find(key);
+	if (it == bitmaps.end()) {
+		Path devicePath(outline);
+		devicePath.transform(AffineTransformation(glyphToDevice.matrix[0][0], glyphToDevice.matrix[0][1]
+				, static_cast<double>(subpixelBucket) / subpixelSteps, glyphToDevice.matrix[1][0]
+				, glyphToDevice.matrix[1][1], 0.0));
+		BitmapPointer bitmap;
+		const IntRect bounds = devicePath.calcIntBounds();
+		if (!devicePath.empty() && bounds.width > 0 && bounds.height > 0) {
+			SelfContainedRaster<Mask8>* raster = new SelfContainedRaster<Mask8>(bounds);
+			bitmap.reset(raster);
+			(*raster) = PolygonMask(devicePath, bounds);
+		}
+		reserveBytes(sizeof (BitmapPointer) + (bounds.width > 0 && bounds.height > 0 ? bounds.width * bounds.height : 0));
+		it = bitmaps.insert(std::map<Key, BitmapPointer>::value_type(key, bitmap)).first;
+	}
+	return it->second;
+}
+
+void GlyphBitmapCache::clear() {
+	outlines.clear();
+	bitmaps.clear();
+	usedBytes = 0;
+}
+
 /* --- FontParser --- */
 
 FontParser::FontParser(Executor* parentExecutor) : parentExecutor(parentExecutor) { }
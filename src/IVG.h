@@ -58,8 +58,13 @@
 
 #include "assert.h" // Note: I always include assert.h like this so that you can override it with a "local" file.
 #include "IMPD.h"
+#include <atomic>
+#include <chrono>
 #include <cmath>
+#include <list>
 #include <memory>
+#include <mutex>
+#include <unordered_map>
 #include <NuX/NuXPixels.h>
 
 namespace IVG {
@@ -71,43 +76,149 @@ inline double square(double d) { return d * d; }
 void checkBounds(const NuXPixels::IntRect& bounds);
 
 /**
-	Small helper that wraps a pointer which might live on the heap.
-	- If you assign a freshly created object it is kept in a std::unique_ptr
-	  and deleted automatically when the Inheritable instance goes away.
-	- If you only pass in an existing object the class just stores the pointer
-	  and never attempts to free it.
+	Small helper that holds a reference-counted pointer to an immutable heap object.
+	- If you assign a freshly created object it is owned by the Inheritable
+	  instance and deleted automatically when the last copy goes away.
+	- Copies share the object, so a child context inheriting its parent's state
+	  (or a cache holding on to a painter) keeps it alive.
 	
 	IVG keeps optional gamma tables, painters and masks in stack classes using
 	this wrapper so dynamic helpers are cleaned up through RAII without extra
 	code.
 **/
 template<class T> class Inheritable {
-	public:		Inheritable() : inherited(0) { }
-	public:		Inheritable(const Inheritable<T>& c) : inherited(c.inherited) { }
-	public:		Inheritable(const T* o) : inherited(o), owned(const_cast<T*>(o)) { }
-	public:		Inheritable& operator=(T* o) { inherited = o; owned.reset(o); return *this; }
-	public:		Inheritable& operator=(const Inheritable<T>& c) {
-					inherited = c.inherited;
-					if (inherited != owned.get()) owned.reset();
-					return *this;
-				}
-	public:		bool operator==(T* o) const { return inherited == o; }
-	public:		bool operator!=(T* o) const { return inherited != o; }
-	public:		operator const T*() const { return inherited; }
+	public:		Inheritable() { }
+	public:		Inheritable(const T* o) : shared(o) { }
+	public:		Inheritable& operator=(T* o) { shared.reset(o); return *this; }
+	public:		void reset(const std::shared_ptr<const T>& o) { shared = o; }
+	public:		const std::shared_ptr<const T>& getShared() const { return shared; }
+	public:		bool operator==(T* o) const { return shared.get() == o; }
+	public:		bool operator!=(T* o) const { return shared.get() != o; }
+	public:		operator const T*() const { return shared.get(); }
 	public:		virtual ~Inheritable() { }
-	protected:	const T* inherited;
-	protected:	std::unique_ptr<T> owned;
+	protected:	std::shared_ptr<const T> shared;
+};
+
+/**
+	   Limits the memory a render may allocate. Pass it in Options::memoryBudget and the rasters of patterns, masks and
+	   defined images, embedded fonts and the paths and polygon edges of each fill and stroke are charged to it. A
+	   charge that would bring the total above `maxBytes` throws an IMPD run-time error, so a document can not exhaust
+	   memory with many large patterns or images (checkBounds() only limits the size of each one). Canvases created by
+	   the host charge their own raster, and an ImageCache its decoded images, only if given the budget with their
+	   setMemoryBudget().
+	   
+	   Thread-safe, so several executors may share one budget (e.g. the jobs of a BatchRenderer). The budget must
+	   outlive everything charged to it, including patterns kept in a PatternCache shared between renders.
+**/
+class MemoryBudget {
+	public:		MemoryBudget(size_t maxBytes);
+	public:		void charge(size_t bytes);								///< Throws if the total would exceed `maxBytes`.
+	public:		void release(size_t bytes);
+	public:		size_t getUsedBytes() const { return usedBytes; }
+	public:		size_t getPeakBytes() const { return peakBytes; }		///< Highest total charged so far.
+	protected:	const size_t maxBytes;
+	protected:	std::atomic<size_t> usedBytes;
+	protected:	std::atomic<size_t> peakBytes;
+	protected:	MemoryBudget(const MemoryBudget& that); // N/A
+	protected:	MemoryBudget& operator=(const MemoryBudget& that); // N/A
+};
+
+/**
+	   Bytes charged to a MemoryBudget for as long as the MemoryCharge exists. Does nothing without a budget.
+**/
+class MemoryCharge {
+	public:		MemoryCharge(MemoryBudget* budget = 0, size_t bytes = 0);			///< Throws like add().
+	public:		void setBudget(MemoryBudget* newBudget);							///< Only while nothing is charged.
+	public:		void add(size_t moreBytes);											///< Throws (without charging) if the budget is exceeded.
+	public:		void remove(size_t fewerBytes);
+	public:		size_t getBytes() const { return bytes; }
+	public:		~MemoryCharge();
+	protected:	MemoryBudget* budget;
+	protected:	size_t bytes;
+	protected:	MemoryCharge(const MemoryCharge& that); // N/A
+	protected:	MemoryCharge& operator=(const MemoryCharge& that); // N/A
+};
+
+/**
+	   Time and counts of a render split by phase, to find out where a slow document spends its time without a
+	   profiler. Pass it in Options::stats and it accumulates over everything the executor renders until reset().
+	   
+	   Phases are timed exclusively: time spent in a phase nested inside another (e.g. blending inside a pattern) is
+	   only counted for the inner phase. Time outside all phases (mostly the IMPD interpreter itself) is not counted,
+	   so compare the sum with the total time of the render. Fills and strokes rasterized later on other threads
+	   (PipelinedCanvas and TiledRenderer) are only counted up to their path construction.
+	   
+	   Not thread-safe. Give every executor of a BatchRenderer its own stats (or none).
+**/
+class RenderStats {
+	public:		enum Phase {
+					ARGUMENT_PARSING			///< Splitting the arguments of instructions.
+					, PATH_CONSTRUCTION			///< Building SVG and text paths, dashing, stroking and transforming to device space.
+					, POLYGON_MASK				///< Constructing PolygonMasks from device space paths.
+					, BLENDING					///< Rendering spans and blending them into the canvas.
+					, PATTERNS_AND_MASKS		///< Rendering patterns, masks and defined images.
+					, LOADING					///< Looking up fonts and images from the host and parsing embedded fonts.
+					, PHASE_COUNT
+				};
+	public:		RenderStats();
+	public:		void reset();
+	public:		static const char* getPhaseName(Phase phase);
+	public:		double seconds[PHASE_COUNT];
+	public:		size_t calls[PHASE_COUNT];					///< Number of times each phase was entered.
+	public:		size_t vertexCount;							///< Device path vertices of fills and strokes.
+	public:		size_t segmentCount;						///< Edges of PolygonMasks.
+	public:		size_t pixelCount;							///< Pixels within the (clipped) bounds of every blend.
+	protected:	friend class PhaseTimer;
+	protected:	int currentPhase;							///< -1 outside all phases.
+	protected:	std::chrono::steady_clock::time_point phaseStart;
+};
+
+/**
+	   Times a phase of RenderStats for as long as the PhaseTimer exists, pausing the phase it interrupts. Does nothing
+	   without stats.
+**/
+class PhaseTimer {
+	public:		PhaseTimer(RenderStats* stats, RenderStats::Phase phase);
+	public:		void stop();												///< Ends the phase before destruction.
+	public:		~PhaseTimer();
+	protected:	RenderStats* stats;
+	protected:	int previousPhase;
+	protected:	PhaseTimer(const PhaseTimer& that); // N/A
+	protected:	PhaseTimer& operator=(const PhaseTimer& that); // N/A
 };
 
 /**
 	   Global rendering options controlling gamma and quality settings.
+	   
+	   `analyticShapes` can only be set by the host (see IVGExecutor's constructor). When enabled, filled `ELLIPSE`
+	   and rounded `RECT` under transformations without rotation or shear use exact area coverage
+	   (NuXPixels::RoundedRectMask) instead of flattened polygons. Edges are more accurate, so output differs
+	   slightly from the default.
+	   
+	   `adaptiveImageResolution` is also host-only. When enabled, images from `define image` are rasterized at the
+	   resolution each `IMAGE` instruction needs (rounded up to a power of two times the declared `resolution`)
+	   instead of at the declared resolution. Images placed with `width` or `height` still use the declared resolution.
+	   
+	   `memoryBudget` is host-only too (0 for no limit). See MemoryBudget. So is `stats` (0 for none). See
+	   RenderStats.
+	   
+	   `draftQuality` is a host-only preview tier that trades accuracy for speed: curves are flattened with a quarter
+	   of the `curveQuality`, polygons are rasterized without antialiasing, the `gamma` correction is skipped, images
+	   and patterns are sampled nearest-neighbor instead of bilinearly. Follow up with a regular render for the final
+	   result.
 **/
 class Options {
-	public:		Options() : gamma(1.0), curveQuality(1.0), patternResolution(1.0) { }
+	public:		Options() : gamma(1.0), curveQuality(1.0), patternResolution(1.0), analyticShapes(false)
+						, adaptiveImageResolution(false), draftQuality(false), memoryBudget(0), stats(0) { }
 	public:		void setGamma(double newGamma);
 	public:		double gamma;
 	public:		double curveQuality;
 	public:		double patternResolution;
+	public:		bool analyticShapes;
+	public:		bool adaptiveImageResolution;
+	public:		bool draftQuality;
+	public:		MemoryBudget* memoryBudget;
+	public:		RenderStats* stats;
 	public:		Inheritable<NuXPixels::GammaTable> gammaTable;
 };
 
@@ -139,11 +250,7 @@ class Paint {
 							&& static_cast<const Painter*>(painter)->isVisible(*this));
 				}
 	public:		void doPaint(Context& inContext, const Rect<double>& sourceBounds
-						, const NuXPixels::Renderer<NuXPixels::Mask8>& mask) {
-					assert(isVisible());
-					const Painter* p = painter;
-					if (p != 0) p->doPaint(*this, inContext, sourceBounds, mask);
-				}
+						, const NuXPixels::Renderer<NuXPixels::Mask8>& mask);
 };
 
 /**
@@ -192,9 +299,36 @@ class Font {
 	public:		const Glyph* findGlyph(IMPD::UniChar forCharacter) const;
 	public:		const double findKerningAdjust(IMPD::UniChar characterA, IMPD::UniChar characterB) const;
 	public:		const Metrics& getMetrics() const;
+	public:		unsigned long getId() const;	// unique for every constructed font (copies share the id), 0 for an empty font
+	protected:	unsigned long id;
 	protected:	Metrics metrics;
 	protected:	std::vector<Glyph> glyphs;
-	protected:	std::vector<KerningPair> kerningPairs;
+	protected:	std::vector<int> bmpPageOffsets;	// 256 offsets into bmpGlyphIndices (or -1 if page is empty)
+	protected:	std::vector<int> bmpGlyphIndices;	// 256 indices into glyphs per page (or -1 if missing)
+	protected:	typedef std::unordered_map<uint64_t, double> KerningMap;	// key is (characterA << 32) | characterB
+	protected:	KerningMap kerningMap;
+};
+
+/**
+	   An ordered list of fonts to search for glyphs, as returned by IVGExecutor::lookupFonts(). Remembers which font
+	   provides the glyph for each character so that fallback fonts are only probed once per character.
+**/
+class FontChain {
+	public:		FontChain();
+	public:		FontChain(const std::vector<const Font*>& fonts);
+	public:		bool empty() const;
+	public:		const std::vector<const Font*>& getFonts() const;
+	
+				/**
+					Finds the glyph for `character` in the first font that has it. Returns 0 if no font has the glyph.
+					Otherwise `fontIndex` is set to the index of the font in the chain.
+				**/
+	public:		const Font::Glyph* findGlyph(IMPD::UniChar character, int& fontIndex) const;
+	protected:	enum { UNKNOWN_FONT = -2, NO_FONT = -1 };
+	protected:	int probeFonts(IMPD::UniChar character) const;
+	protected:	std::vector<const Font*> fonts;
+	protected:	mutable std::vector<int> latinFontIndices;		// direct table for 0-255, UNKNOWN_FONT until probed
+	protected:	mutable std::unordered_map<IMPD::UniChar, int> otherFontIndices;
 };
 
 /**
@@ -219,6 +353,127 @@ class FontParser : public IMPD::Executor {
 	protected:	KerningPairsMap kerningPairs;
 };
 
+/**
+	   Caches the paths produced by buildPathFromSVG() so that a `PATH` inside a loop, or a glyph shared by many strings,
+	   is only parsed and flattened once. The key is the SVG source and the exact curve quality (so output is identical
+	   to parsing every time). Paths are cached in source coordinates; the caller applies its transformation after
+	   lookup. The least recently used paths are discarded when the estimated size of the cache exceeds `maxBytes`.
+	   Not thread-safe.
+**/
+class SVGPathCache {
+	public:		typedef std::shared_ptr<const NuXPixels::Path> PathPointer;
+	public:		SVGPathCache(size_t maxBytes = 4 * 1024 * 1024);
+	
+				/**
+					Returns the path for `svgSource` built with `curveQuality`, parsing it on first use. Returns a null
+					pointer and sets `errorString` if the source is invalid.
+				**/
+	public:		PathPointer lookup(const IMPD::String& svgSource, double curveQuality, const char*& errorString);
+	public:		void clear();
+	protected:	typedef std::pair<double, IMPD::String> Key;
+	protected:	typedef std::list<const Key*> UseList;		///< Keys of `entries`, most recently used first.
+	protected:	struct Entry {
+					PathPointer path;
+					const char* errorString;	// 0 if successful
+					size_t bytes;
+					UseList::iterator use;
+				};
+	protected:	typedef std::map<Key, Entry> EntryMap;
+	protected:	const size_t maxBytes;
+	protected:	size_t usedBytes;
+	protected:	EntryMap entries;
+	protected:	UseList uses;
+	protected:	SVGPathCache(const SVGPathCache& that); // N/A
+	protected:	SVGPathCache& operator=(const SVGPathCache& that); // N/A
+};
+
+/**
+	   Caches the paths and advances produced by buildPathForString() so that repeated strings (labels, legends, axis
+	   ticks etc) only need to be built once. The key includes the string, the font chain (by font id), size, letter
+	   spacing, glyph transform and curve quality. Paths are cached untranslated, so place them with Path::transform()
+	   after lookup. The least recently used layout is discarded when `maxEntries` is exceeded. Glyph outlines are kept
+	   in an SVGPathCache, so different strings with the same glyphs share the parsing. Not thread-safe.
+**/
+class TextLayoutCache {
+	public:		TextLayoutCache(size_t maxEntries = 256);
+	public:		bool buildPathForString(const IMPD::UniString& string, const FontChain& fonts, double size
+						, const NuXPixels::AffineTransformation& glyphTransform, double letterSpacing, double curveQuality
+						, NuXPixels::Path& path, double& advance, const char*& errorString);
+	public:		void clear();
+	protected:	struct Key {
+					bool operator<(const Key& other) const;
+					IMPD::UniString string;
+					std::vector<unsigned long> fontIds;
+					double parameters[3 + 6];	// size, letter spacing, curve quality and glyph transform matrix
+				};
+	protected:	typedef std::list<const Key*> UseList;		///< Keys of `layouts`, most recently used first.
+	protected:	struct Layout {
+					NuXPixels::Path path;
+					double advance;
+					const char* errorString;	// 0 if successful
+					UseList::iterator use;
+				};
+	protected:	typedef std::map<Key, Layout> LayoutMap;
+	protected:	const size_t maxEntries;
+	protected:	LayoutMap layouts;
+	protected:	UseList uses;
+	protected:	SVGPathCache glyphPaths;
+	protected:	TextLayoutCache(const TextLayoutCache& that); // N/A
+	protected:	TextLayoutCache& operator=(const TextLayoutCache& that); // N/A
+};
+
+/**
+	   Optional cache of pre-rasterized glyph coverage for small text, installed with
+	   IVGExecutor::setGlyphBitmapCache(). Text with an em size below `maxPixelSize` device pixels that is not rotated,
+	   outlined or painted with relative paint is then composed from cached glyph bitmaps instead of being rasterized
+	   as vectors. This is an approximation: glyphs are positioned with 1 / `subpixelSteps` pixel precision horizontally
+	   and whole pixels vertically. Bitmaps are keyed on font id, glyph, curve quality, glyph-to-device matrix (without
+	   translation) and subpixel offset. Everything is discarded when the cache grows beyond `maxBytes`. Not thread-safe.
+**/
+class GlyphBitmapCache {
+	public:		typedef std::shared_ptr<const NuXPixels::Path> OutlinePointer;
+	public:		typedef std::shared_ptr< const NuXPixels::SelfContainedRaster<NuXPixels::Mask8> > BitmapPointer;
+	public:		GlyphBitmapCache(double maxPixelSize = 32.0, int subpixelSteps = 4, size_t maxBytes = 4 * 1024 * 1024);
+	public:		double getMaxPixelSize() const;
+	public:		int getSubpixelSteps() const;
+	
+				/**
+					Returns the untransformed outline of `glyph` built with `curveQuality`. Returns a null pointer and sets
+					`errorString` if the glyph's svg path is invalid.
+				**/
+	public:		OutlinePointer lookupOutline(const Font& font, const Font::Glyph& glyph, double curveQuality
+						, const char*& errorString);
+	
+				/**
+					Returns the coverage of `outline` (previously returned by lookupOutline() for the same arguments) when
+					transformed with `glyphToDevice` (ignoring translation) and offset `subpixelBucket` / `subpixelSteps`
+					pixels to the right. The bitmap bounds are relative to the glyph origin. Returns a null pointer for
+					empty glyphs.
+				**/
+	public:		BitmapPointer lookupBitmap(const Font& font, const Font::Glyph& glyph, double curveQuality
+						, const NuXPixels::Path& outline, const NuXPixels::AffineTransformation& glyphToDevice
+						, int subpixelBucket);
+	public:		void clear();
+	protected:	struct Key {
+					bool operator<(const Key& other) const;
+					unsigned long fontId;
+					IMPD::UniChar character;
+					int subpixelBucket;		// -1 for outlines
+					double parameters[1 + 4];	// curve quality and glyph-to-device matrix (zero for outlines)
+				};
+	protected:	struct Outline {
+					OutlinePointer path;
+					const char* errorString;
+				};
+	protected:	void reserveBytes(size_t bytes);
+	protected:	const double maxPixelSize;
+	protected:	const int subpixelSteps;
+	protected:	const size_t maxBytes;
+	protected:	size_t usedBytes;
+	protected:	std::map<Key, Outline> outlines;
+	protected:	std::map<Key, BitmapPointer> bitmaps;
+};
+
 /**
 	   Holds font name and painting settings for drawing text.
 **/
@@ -247,6 +502,30 @@ class State {
 	public:		Inheritable< NuXPixels::RLERaster<NuXPixels::Mask8> > mask;
 };
 
+/**
+	   A fill or stroke that has been prepared in device space but not yet rasterized, together with what it needs
+	   from the drawing state at the time (see PipelinedCanvas). Paints, masks and gamma tables are shared, not
+	   copied, which is safe since they are never modified once they are part of a State.
+**/
+class DrawCommand {
+	public:		enum Shape { POLYGON, RECT, ROUNDED_RECT };
+	public:		DrawCommand(Shape shape, const State& state, const Paint& paint, const Rect<double>& sourceBounds);
+	public:		void execute(Context& replayContext, NuXPixels::PolygonMask::Workspace& workspace);	///< Rasterizes into the canvas of replayContext (replacing its transformation and draft quality).
+	public:		Shape shape;
+	public:		NuXPixels::Path path;						///< Device path for POLYGON and RECT.
+	public:		const NuXPixels::FillRule* fillRule;		///< For POLYGON.
+	public:		Rect<double> rect;							///< Device rect and corner radii for ROUNDED_RECT.
+	public:		double radiusX;
+	public:		double radiusY;
+	public:		Paint paint;
+	public:		Rect<double> sourceBounds;
+	public:		NuXPixels::AffineTransformation transformation;
+	public:		Inheritable< NuXPixels::RLERaster<NuXPixels::Mask8> > mask;
+	public:		Inheritable<NuXPixels::GammaTable> gammaTable;
+	public:		bool draftQuality;							///< Options::draftQuality of the state (rasterizes without antialiasing and samples paints nearest-neighbor).
+	public:		MemoryCharge charge;						///< The command, its path and the polygon edges it will need, for as long as it is queued.
+};
+
 class IVGExecutor;
 /**
 	   Abstract drawing surface that accepts blended pixel data.
@@ -256,24 +535,54 @@ class Canvas {
 	public:		virtual void parsePaint(IMPD::Interpreter& impd, IVGExecutor& executor, Context& context, IMPD::ArgumentsContainer& args, Paint& paint) const = 0;
 	public:		virtual void blendWithARGB32(const NuXPixels::Renderer<NuXPixels::ARGB32>& source) { (void)source; assert(0); }
 	public:		virtual void blendWithMask8(const NuXPixels::Renderer<NuXPixels::Mask8>& source) { (void)source; assert(0); }
+	public:		virtual void blendPairWithARGB32(const NuXPixels::Renderer<NuXPixels::ARGB32>& first
+						, const NuXPixels::Renderer<NuXPixels::ARGB32>& second) {	///< Blends \p first and then \p second. Canvases that can do this in a single pass over their pixels override it.
+					blendWithARGB32(first);
+					blendWithARGB32(second);
+				}
+	public:		virtual void blendPairWithMask8(const NuXPixels::Renderer<NuXPixels::Mask8>& first
+						, const NuXPixels::Renderer<NuXPixels::Mask8>& second) {
+					blendWithMask8(first);
+					blendWithMask8(second);
+				}
 	public:		virtual void defineBounds(const NuXPixels::IntRect& newBounds) = 0;			///< Defines the physical boundaries of the canvas (i.e. outer bounds disregarding any current transformations). Never called more than once.
 	public:		virtual NuXPixels::IntRect getBounds() const = 0;							///< Returns the outer boundaries of the canvas. A canvas may throw if bounds has not been set yet.
+	public:		virtual NuXPixels::IntRect getClampBounds() const { return getBounds(); }	///< Fills and strokes reaching further than the size of these bounds outside them are folded onto that distance before rasterizing. Canvases that draw a part of a larger document (e.g. a tile) return the bounds of the whole document so that every part is clamped alike.
+	public:		virtual bool isDeferred() const { return false; }							///< True if the canvas rasterizes on a thread of its own. Context then hands fills and strokes to enqueue() as DrawCommands instead of rasterizing them.
+	public:		virtual void enqueue(DrawCommand* command);								///< Takes ownership of \p command. Only called if isDeferred() returns true (throws a run-time error by default).
+	public:		virtual void sync() { }													///< Waits until all enqueued commands have been rasterized.
+	public:		virtual void noteFontUse(const IMPD::WideString& fontName) { (void)fontName; }	///< Called on the root canvas of an IVGExecutor for every font lookup (see DryRunCanvas).
+	public:		virtual void noteImageUse(const IMPD::WideString& imageName) { (void)imageName; }	///< Called on the root canvas of an IVGExecutor for every `IMAGE` instruction.
 	public:		virtual ~Canvas() { }
 	public:		template<class PIXEL_TYPE> void blend(const NuXPixels::Renderer<PIXEL_TYPE>& source);
+	public:		template<class PIXEL_TYPE> void blendPair(const NuXPixels::Renderer<PIXEL_TYPE>& first
+						, const NuXPixels::Renderer<PIXEL_TYPE>& second);
 };
 
 /**
 	   Canvas implementation used to build a mask raster.
+	   
+	   Shapes are accumulated in a dense Mask8 raster and compressed to an RLERaster once in finish(). Blending
+	   every shape straight into the RLERaster would re-encode all of it for each shape.
 **/
 class MaskMakerCanvas : public Canvas {
-	public:		MaskMakerCanvas(const NuXPixels::IntRect& bounds);
+	public:		MaskMakerCanvas(const NuXPixels::IntRect& bounds, const NuXPixels::IntRect& clampBounds
+						, MemoryBudget* budget = 0);	///< Pass the getClampBounds() of the canvas the mask is for. The coverage raster is charged to `budget` as it grows.
 	public:		virtual void parsePaint(IMPD::Interpreter& impd, IVGExecutor& executor, Context& context, IMPD::ArgumentsContainer& args, Paint& paint) const;
 	public:		virtual void blendWithARGB32(const NuXPixels::Renderer<NuXPixels::ARGB32>& source);
 	public:		virtual void blendWithMask8(const NuXPixels::Renderer<NuXPixels::Mask8>& source);
+	public:		virtual void blendPairWithMask8(const NuXPixels::Renderer<NuXPixels::Mask8>& first
+						, const NuXPixels::Renderer<NuXPixels::Mask8>& second);
 	public:		virtual void defineBounds(const NuXPixels::IntRect& newBounds);
 	public:		virtual NuXPixels::IntRect getBounds() const;
+	public:		virtual NuXPixels::IntRect getClampBounds() const;
 	public:		NuXPixels::RLERaster<NuXPixels::Mask8>* finish(bool invert);
-	protected:	std::unique_ptr< NuXPixels::RLERaster<NuXPixels::Mask8> > mask8RLE;
+	protected:	void cover(const NuXPixels::IntRect& area);
+	protected:	const NuXPixels::IntRect bounds;
+	protected:	const NuXPixels::IntRect clampBounds;
+	protected:	MemoryCharge coverageCharge;
+	protected:	std::unique_ptr< NuXPixels::SelfContainedRaster<NuXPixels::Mask8> > coverage;	///< Only allocated for (at least) `touched`, 0 until something is blended.
+	protected:	NuXPixels::IntRect touched;												///< Union of the areas blended so far. Everything outside it is transparent.
 };
 
 /**
@@ -281,22 +590,116 @@ class MaskMakerCanvas : public Canvas {
 **/
 class Context {
 	friend class PatternBase;
+	friend class FillCatchingCanvas;
 	
-	public:		Context(Canvas& canvas, const NuXPixels::AffineTransformation& initialTransform);
+	public:		Context(Canvas& canvas, const NuXPixels::AffineTransformation& initialTransform
+						, const Options& initialOptions = Options());
 	public:		Context(Canvas& canvas, Context& parentContext);
 	public:		void resetState();
+	public:		void setCanvas(Canvas& newCanvas) { canvas = &newCanvas; }
+	public:		const Options& getInitialOptions() const { return initState.options; }
 	public:		double calcCurveQuality() const;
 	public:		State& accessState() { return state; }
-	public:		Canvas& accessCanvas() const { return canvas; }
+	public:		Canvas& accessCanvas() const { return *canvas; }
 	public:		NuXPixels::AffineTransformation getTransformation() const { return state.transformation; }
 	public:		int calcPatternScale() const;
 	public:		void stroke(const NuXPixels::Path& path, Stroke& stroke, const Rect<double>& paintSourceBounds, double widthMultiplier);
 	public:		void fill(const NuXPixels::Path& path, Paint& fill, bool evenOddFillRule, const Rect<double>& paintSourceBounds);
 	public:		void draw(const NuXPixels::Path& path);
+	
+				/**
+					Returns true if nothing inside `bounds` (in user coordinates) grown by `margin` can be visible, i.e. it
+					is outside the canvas or outside the non-transparent area of the current mask. Used to skip
+					rasterizing off-screen paths.
+				**/
+	public:		bool isCulled(const Rect<double>& bounds, double margin) const;
+	
+				/**
+					Draws `path`, which must be `rect` with elliptic corners of `radiusX` and `radiusY` (an ellipse if they
+					are half the size) flattened. Fills with NuXPixels::RoundedRectMask if Options::analyticShapes is set
+					and the transformation has no rotation or shear, otherwise works like draw().
+				**/
+	public:		void drawRoundedRect(const NuXPixels::Path& path, const Rect<double>& rect, double radiusX, double radiusY);
 
-	protected:	Canvas& canvas;
+	protected:	Canvas* canvas;
 	protected:	State initState;
 	protected:	State state;
+	protected:	void defer(DrawCommand::Shape shape, const NuXPixels::Path& devicePath, const NuXPixels::FillRule& fillRule
+						, const Paint& paint, const Rect<double>& sourceBounds);
+	protected:	NuXPixels::Path fillPath;					///< Scratch buffers reused by fill() and stroke() to avoid allocating for every path.
+	protected:	NuXPixels::Path strokePath;
+	protected:	NuXPixels::Path dashedPath;
+	protected:	NuXPixels::PolygonMask::Workspace fillWorkspace;
+	protected:	NuXPixels::PolygonMask::Workspace strokeWorkspace;
+};
+
+/**
+	   Caches rendered pattern painters so that identical `pattern:[...]` paints are only drawn once. Patterns inherit
+	   the state of the context they are created in, so besides source text, pixel type and scale the key includes the
+	   inherited state, but only the paints that the pattern actually used. Sources that read or write variables or
+	   have other side effects (e.g. `define` or `trace`) are never cached. The least recently used patterns are
+	   discarded when the total size of the cached images exceeds `maxBytes`.
+	   
+	   Patterns drawing text depend on what font names resolve to, so entries also record the executor's font
+	   generation (see IVGExecutor::getFontGeneration()). It changes with every `define font` and clearFontCache().
+	   
+	   A cache may be shared across renders with IVGExecutor::setPatternCache() as long as external font and image
+	   names resolve to the same content in all documents. Not thread-safe.
+**/
+class PatternCache {
+	public:		enum { FILL_PAINT, PEN_PAINT, TEXT_FILL_PAINT, TEXT_OUTLINE_PAINT, PAINT_COUNT };
+	public:		PatternCache(size_t maxBytes = 16 * 1024 * 1024);
+	public:		static bool isCacheable(const IMPD::String& source);
+	public:		std::shared_ptr<const Painter> find(const IMPD::String& source, int pixelBytes, int scale
+						, unsigned long fontGeneration, const State& inheritedState);
+	public:		void store(const IMPD::String& source, int pixelBytes, int scale, unsigned long fontGeneration
+						, const State& inheritedState, const bool usedPaints[PAINT_COUNT]
+						, const std::shared_ptr<const Painter>& painter, size_t bytes);
+	public:		void clear();
+	protected:	struct Entry;
+	protected:	typedef std::list< std::pair<const IMPD::String*, const Entry*> > UseList;	///< Source and entry of `entries`, most recently used first.
+	protected:	struct Entry {
+					int pixelBytes;
+					int scale;
+					unsigned long fontGeneration;
+					State inheritedState;
+					bool usedPaints[PAINT_COUNT];
+					std::shared_ptr<const Painter> painter;
+					size_t bytes;
+					UseList::iterator use;
+				};
+	protected:	typedef std::multimap<IMPD::String, Entry> EntryMap;
+	protected:	static bool matches(const Entry& entry, const State& state);
+	protected:	const size_t maxBytes;
+	protected:	size_t usedBytes;
+	protected:	EntryMap entries;
+	protected:	UseList uses;
+	protected:	PatternCache(const PatternCache& that); // N/A
+	protected:	PatternCache& operator=(const PatternCache& that); // N/A
+};
+
+/**
+	   Interns color and gradient painters by value so that repeated identical paint statements share immutable painters
+	   (and gradient painters with identical stops share one gradient table). Each table is emptied when it grows beyond
+	   `maxEntries` (painters still in use stay alive). Not thread-safe.
+**/
+class PaintCache {
+	public:		PaintCache(size_t maxEntries = 1024);
+	public:		template<class PIXEL_TYPE> std::shared_ptr<const Painter> internColor(typename PIXEL_TYPE::Pixel color);
+	public:		template<class PIXEL_TYPE> std::shared_ptr<const Painter> internGradient(bool radial, const double coords[4]
+						, const std::vector<typename NuXPixels::Gradient<PIXEL_TYPE>::Stop>& stops);
+	public:		void clear();
+	protected:	template<class PIXEL_TYPE> struct Tables {
+					typedef std::vector< std::pair<double, typename PIXEL_TYPE::Pixel> > StopsKey;
+					typedef std::pair<std::vector<double>, StopsKey> GradientKey;	// radial flag and coordinates, stops
+					std::map< typename PIXEL_TYPE::Pixel, std::shared_ptr<const Painter> > colorPainters;
+					std::map< StopsKey, std::shared_ptr< const NuXPixels::Gradient<PIXEL_TYPE> > > gradients;
+					std::map< GradientKey, std::shared_ptr<const Painter> > gradientPainters;
+				};
+	protected:	template<class PIXEL_TYPE> Tables<PIXEL_TYPE>& accessTables();
+	protected:	const size_t maxEntries;
+	protected:	Tables<NuXPixels::ARGB32> argb32Tables;
+	protected:	Tables<NuXPixels::Mask8> mask8Tables;
 };
 
 /**
@@ -309,12 +712,57 @@ struct Image {
 	double yResolution;
 };
 
+/**
+	   Cache of decoded images for implementations of IVGExecutor::loadImage(). Subclasses decode images in
+	   decodeImage(), which is called once per image name. The least recently used images are discarded when all cached
+	   pixels (including pre-scaled copies) exceed `maxBytes`.
+	   
+	   Each image keeps a chain of copies, each half the size of the one before (box filtered and built when first
+	   needed). lookup() answers `forXSize` and `forYSize` with the smallest copy that still has at least as many pixels
+	   as requested, so an image drawn at a fraction of its size is not resampled from far too many pixels. Clipped
+	   images (e.g. from sprite sheets) always use the full size image since the filtering would bleed into the clip.
+	   Not thread-safe.
+**/
+class ImageCache {
+	public:		typedef std::shared_ptr< const NuXPixels::SelfContainedRaster<NuXPixels::ARGB32> > RasterPointer;
+	public:		ImageCache(size_t maxBytes = 64 * 1024 * 1024);
+	
+				/**
+					Takes the arguments of IVGExecutor::loadImage(). Returns an image with a null `raster` if decodeImage()
+					fails. Failures are cached too, so a missing image is not decoded again until it is discarded or the
+					cache is cleared. The raster stays valid as long as `holder` points to it, even if the image is
+					discarded from the cache.
+				**/
+	public:		Image lookup(const IMPD::WideString& imageSource, const NuXPixels::IntRect* sourceRectangle
+						, double forXSize, bool xSizeIsRelative, double forYSize, bool ySizeIsRelative
+						, RasterPointer& holder);
+	public:		void setMemoryBudget(MemoryBudget* budget);	///< Charges cached rasters to `budget` (0 = none, the default) until they are discarded. lookup() then throws if the budget is exceeded. Call while the cache is empty. The budget must outlive the cache.
+	public:		void clear();
+	public:		virtual ~ImageCache() { }
+	protected:	virtual NuXPixels::SelfContainedRaster<NuXPixels::ARGB32>* decodeImage(const IMPD::WideString& imageSource) = 0;	///< Returns a new raster with premultiplied pixels and bounds at 0, 0, or null if the image can't be loaded.
+	protected:	typedef std::list<const IMPD::WideString*> UseList;	///< Names of `entries`, most recently used first.
+	protected:	struct Entry {
+					std::vector<RasterPointer> levels;				///< levels[0] is the decoded image, every following level half the size of the one before. Empty if decoding failed.
+					size_t bytes;
+					UseList::iterator use;
+				};
+	protected:	typedef std::map<IMPD::WideString, Entry> EntryMap;
+	protected:	void trim();
+	protected:	size_t maxBytes;
+	protected:	size_t usedBytes;
+	protected:	EntryMap entries;
+	protected:	UseList uses;
+	protected:	MemoryCharge charge;
+	protected:	ImageCache(const ImageCache& that); // N/A
+	protected:	ImageCache& operator=(const ImageCache& that); // N/A
+};
+
 /**
 	   Executes IVG drawing instructions within a rendering context.
 **/
 class IVGExecutor : public IMPD::Executor {
 	public:		IVGExecutor(Canvas& canvas, const NuXPixels::AffineTransformation& initialTransform
-						= NuXPixels::AffineTransformation());
+						= NuXPixels::AffineTransformation(), const Options& initialOptions = Options());
 	public:		virtual bool format(IMPD::Interpreter& interpreter, const IMPD::FormatInfo& formatInfo);
 	public:		virtual bool execute(IMPD::Interpreter& interpreter, const IMPD::String& instruction
 						, const IMPD::String& arguments);
@@ -345,27 +793,109 @@ class IVGExecutor : public IMPD::Executor {
 				/**
 					Returns a vector of pointers to fonts containing the necessary glyphs to display the specified string.
 					Fonts are searched in the order provided in the vector. If a glyph is not found in a font, the search continues with the next font.
-					Returns an empty vector if no suitable font is found. The returned font pointers must remain valid until the next call to lookupFonts().
+					Returns an empty vector if no suitable font is found.
+					
+					Note: the result is cached per font name, so the returned font pointers must remain valid until the
+					executor is destroyed (or clearFontCache() is called). Earlier versions only used them until the
+					text instruction was done, so hosts that free or replace fonts between calls (e.g. a font cache
+					with eviction) must keep them alive longer or call clearFontCache() when they do.
 					If `forString` is empty, just return the main font.
 					If a glyph cannot be found in any font, the main font's missing glyph is used (character #0).
 				**/
 	public:		virtual std::vector<const Font*> lookupFonts(IMPD::Interpreter& interpreter, const IMPD::WideString& fontName
 						, const IMPD::UniString& forString);
+	public:		void clearFontCache();	///< Forgets the fonts returned by lookupFonts() so that they may be freed.
+	public:		unsigned long getFontGeneration() const { return fontGeneration; }	///< Identifies what font names resolve to (0 before any `define font` or clearFontCache()).
 	public:		void runInNewContext(IMPD::Interpreter& impd, Context& context, const IMPD::String& source);
+	
+				/**
+					Replaces the executor's own text layout cache with `sharedCache` (which must outlive the executor), for
+					example to reuse layouts across documents. Pass 0 to go back to the executor's own cache.
+				**/
+	public:		void setTextLayoutCache(TextLayoutCache* sharedCache);
+	
+				/**
+					Replaces the executor's own cache of parsed `PATH` data with `sharedCache` (which must outlive the
+					executor). Pass 0 to go back to the executor's own cache. See SVGPathCache.
+				**/
+	public:		void setSVGPathCache(SVGPathCache* sharedCache);
+	
+				/**
+					Enables glyph bitmaps for small text using `cache` (which must outlive the executor). Off (0) by default
+					since the output is not identical to vector text. See GlyphBitmapCache.
+				**/
+	public:		void setGlyphBitmapCache(GlyphBitmapCache* cache);
+	
+				/**
+					Replaces the executor's own pattern cache with `sharedCache` (which must outlive the executor). Pass 0
+					to go back to the executor's own cache. See PatternCache.
+				**/
+	public:		void setPatternCache(PatternCache* sharedCache);
+	public:		PatternCache& accessPatternCache();
+	public:		PaintCache& accessPaintCache();
+	
+				/**
+					Prepares the executor to run its document again onto `newCanvas`, e.g. for the next frame of an
+					animation (see AnimationRenderer). The drawing state and all definitions are reset, but the caches are
+					kept. As long as the new run defines the same fonts and images as the previous run, in the same order
+					and with the same instructions (without variables), the parsed fonts and rasterized images of the
+					previous run are taken over instead of being built again. The pattern cache is cleared if the
+					definitions differ.
+				**/
+	public:		void restart(Canvas& newCanvas);
 	public:		virtual ~IVGExecutor();
 	protected:	void executeImage(IMPD::Interpreter& impd, IMPD::ArgumentsContainer& args);
 	protected:	void executeDefine(IMPD::Interpreter& impd, IMPD::ArgumentsContainer& args);
 	protected:	void parseStroke(IMPD::Interpreter& impd, IMPD::ArgumentsContainer& args, Stroke& stroke);
-	protected:	std::vector<const Font*> lookupExternalOrInternalFonts(IMPD::Interpreter& impd
+	protected:	bool fillTextWithGlyphBitmaps(const IMPD::UniString& text, const FontChain& fonts, double anchorRatio
+						, double& advance, const char*& errorString);
+	protected:	const FontChain& lookupExternalOrInternalFonts(IMPD::Interpreter& impd
 						, const IMPD::WideString& name, const IMPD::UniString& forString);
+	protected:	Image rasterizeImage(IMPD::Interpreter& impd, const IMPD::String& source, double resolution);
+	protected:	const Image* findDefinedImage(IMPD::Interpreter& impd, const IMPD::WideString& name, double forScale);
+	protected:	void freezeDefinedImages(IMPD::Interpreter& impd);
+	protected:	bool reuseDefinition(bool isFont, const IMPD::WideString& name, const IMPD::String& source, double resolution);
+	protected:	void discardPreviousDefinitions();
 	protected:	Context rootContext;
 	protected:	Context* currentContext;
 	protected:	typedef std::map<IMPD::WideString, Font> FontMap;
 	protected:	FontMap embeddedFonts;
-	protected:	IMPD::WideString lastFontName;
-	protected:	std::vector<const Font*> lastFontPointers; // empty = must look up
-	protected:	typedef std::map<IMPD::WideString, Image> ImageMap;
+	protected:	typedef std::map<IMPD::WideString, FontChain> FontChainMap;
+	protected:	FontChainMap fontChainCache;
+	protected:	unsigned long fontGeneration;
+	protected:	SVGPathCache ownSVGPathCache;
+	protected:	SVGPathCache* svgPathCache;
+	protected:	TextLayoutCache ownTextLayoutCache;
+	protected:	TextLayoutCache* textLayoutCache;
+	protected:	GlyphBitmapCache* glyphBitmapCache;
+	protected:	PatternCache ownPatternCache;
+	protected:	PatternCache* patternCache;
+	protected:	PaintCache paintCache;
+	protected:	struct ImageDefinition {
+					ImageDefinition() : resolution(1.0), order(0) { }
+					IMPD::String source;				///< Kept for rasterizing on first use (and at other resolutions). Empty if the image was rasterized when defined.
+					double resolution;
+					size_t order;						///< Number of images defined before this one, the only ones it may use.
+					std::vector<Image> rasters;			///< Owned. Most recently used first.
+				};
+	protected:	typedef std::map<IMPD::WideString, ImageDefinition> ImageMap;
+	protected:	static size_t deleteRasters(ImageMap& images);	///< Returns the number of bytes deleted.
 	protected:	ImageMap definedImages;
+	protected:	size_t imageOrderLimit;					///< Images with this order or later are invisible while an image is rasterized on first use.
+	protected:	MemoryCharge definedImagesCharge;		///< Rasters of definedImages and previousImages.
+	protected:	MemoryCharge embeddedFontsCharge;		///< Estimated from the size of the font definitions (of embeddedFonts and previousFonts).
+	protected:	struct DefinitionRecord {
+					bool isFont;
+					IMPD::WideString name;
+					IMPD::String source;
+					double resolution;
+				};
+	protected:	std::vector<DefinitionRecord> definitionRecords;			///< Definitions of this run in order, up to the first one with variables.
+	protected:	bool recordingDefinitions;								///< False once a definition with variables has been made.
+	protected:	std::vector<DefinitionRecord> previousDefinitionRecords;	///< Recorded definitions of the previous run (see restart()).
+	protected:	bool reusingDefinitions;								///< True after restart() until a definition differs from the previous run.
+	protected:	FontMap previousFonts;									///< Recorded fonts of the previous run not yet taken over.
+	protected:	ImageMap previousImages;								///< Recorded images of the previous run not yet taken over.
 };
 
 /**
@@ -398,8 +928,18 @@ template<class PIXEL_TYPE> class ColorPainter : public Painter {
 	   Base class for gradient painters handling stop visibility and transforms.
 **/
 template<class PIXEL_TYPE> class GradientPainter : public Painter {
+	public:		typedef std::shared_ptr< const NuXPixels::Gradient<PIXEL_TYPE> > GradientPointer;
 	public:		GradientPainter(int count, const typename NuXPixels::Gradient<PIXEL_TYPE>::Stop* points)
-						: gradient(count, points), visibleStops(false) {
+						: gradient(new NuXPixels::Gradient<PIXEL_TYPE>(count, points)) {
+					checkVisibleStops(count, points);
+				}
+	public:		GradientPainter(const GradientPointer& sharedGradient, int count
+						, const typename NuXPixels::Gradient<PIXEL_TYPE>::Stop* points)
+						: gradient(sharedGradient) {
+					checkVisibleStops(count, points);
+				}
+	protected:	void checkVisibleStops(int count, const typename NuXPixels::Gradient<PIXEL_TYPE>::Stop* points) {
+					visibleStops = false;
 					for (int i = 0; i < count; ++i) {
 						if (!PIXEL_TYPE::isTransparent(points[i].color)) {
 							visibleStops = true;
@@ -419,7 +959,7 @@ template<class PIXEL_TYPE> class GradientPainter : public Painter {
 						return withPaint.transformation.transform(inContext.getTransformation());
 					}
 				}
-	protected:	NuXPixels::Gradient<PIXEL_TYPE> gradient;
+	protected:	GradientPointer gradient;
 	protected:	bool visibleStops;
 };
 
@@ -431,6 +971,12 @@ template<class PIXEL_TYPE> class LinearGradientPainter : public GradientPainter<
 						, const typename NuXPixels::Gradient<PIXEL_TYPE>::Stop* points)
 						: GradientPainter<PIXEL_TYPE>(count, points), start(startX, startY), end(endX, endY) {
 				}
+	public:		LinearGradientPainter(double startX, double startY, double endX, double endY
+						, const typename GradientPainter<PIXEL_TYPE>::GradientPointer& sharedGradient, int count
+						, const typename NuXPixels::Gradient<PIXEL_TYPE>::Stop* points)
+						: GradientPainter<PIXEL_TYPE>(sharedGradient, count, points), start(startX, startY)
+						, end(endX, endY) {
+				}
 	public:		virtual void doPaint(Paint& withPaint, Context& inContext, const Rect<double>& sourceBounds
 						, const NuXPixels::Renderer<NuXPixels::Mask8>& mask) const {
 					using NuXPixels::Vertex; // G++ needs this
@@ -446,7 +992,7 @@ template<class PIXEL_TYPE> class LinearGradientPainter : public GradientPainter<
 					double l = fabs((xfEnd.y - xfStart.y) * dx - (xfEnd.x - xfStart.x) * dy) / (dx * dx + dy * dy);
 					xfEnd = NuXPixels::Vertex(xfStart.x + dy * l, xfStart.y - dx * l);
 					
-					inContext.accessCanvas().blend(this->gradient[NuXPixels::LinearAscend(xfStart.x, xfStart.y, xfEnd.x, xfEnd.y)]
+					inContext.accessCanvas().blend((*this->gradient)[NuXPixels::LinearAscend(xfStart.x, xfStart.y, xfEnd.x, xfEnd.y)]
 							* static_cast<const NuXPixels::Renderer<NuXPixels::Mask8>&>(FadedMask(mask, withPaint.opacity)));
 				}
 	protected:	NuXPixels::Vertex start;
@@ -463,6 +1009,12 @@ template<class PIXEL_TYPE> class RadialGradientPainter : public GradientPainter<
 						, double width, double height, int count, const typename NuXPixels::Gradient<PIXEL_TYPE>::Stop* points)
 						: GradientPainter<PIXEL_TYPE>(count, points), center(centerX, centerY), size(width, height) {
 				}
+	public:		RadialGradientPainter(double centerX, double centerY, double width, double height
+						, const typename GradientPainter<PIXEL_TYPE>::GradientPointer& sharedGradient, int count
+						, const typename NuXPixels::Gradient<PIXEL_TYPE>::Stop* points)
+						: GradientPainter<PIXEL_TYPE>(sharedGradient, count, points), center(centerX, centerY)
+						, size(width, height) {
+				}
 	public:		virtual void doPaint(Paint& withPaint, Context& inContext, const Rect<double>& sourceBounds
 						, const NuXPixels::Renderer<NuXPixels::Mask8>& mask) const {
 					using NuXPixels::Vertex; // G++ needs this
@@ -474,9 +1026,9 @@ template<class PIXEL_TYPE> class RadialGradientPainter : public GradientPainter<
 					double vSize = sqrt(square(xfVSize.x - xfCenter.x) + square(xfVSize.y - xfCenter.y));
 					if (hSize == 0 || vSize == 0) {
 						inContext.accessCanvas().blend(NuXPixels::Solid<PIXEL_TYPE>
-								(PIXEL_TYPE::multiply(this->gradient[0], withPaint.opacity)) * mask);
+								(PIXEL_TYPE::multiply((*this->gradient)[0], withPaint.opacity)) * mask);
 					} else {
-						inContext.accessCanvas().blend(this->gradient[NuXPixels::RadialAscend(xfCenter.x, xfCenter.y, hSize, vSize)]
+						inContext.accessCanvas().blend((*this->gradient)[NuXPixels::RadialAscend(xfCenter.x, xfCenter.y, hSize, vSize)]
 								* static_cast<const NuXPixels::Renderer<NuXPixels::Mask8>&>(FadedMask(mask, withPaint.opacity)));
 					}
 				}
@@ -488,16 +1040,23 @@ template<class PIXEL_TYPE> class RadialGradientPainter : public GradientPainter<
 	   Base helper for pattern painters providing a canvas to draw the pattern.
 **/
 class PatternBase : public Painter, public Canvas {
-	public:		PatternBase(int scale);
-	public:		void makePattern(IMPD::Interpreter& impd, IVGExecutor& executor, Context& parentContext, const IMPD::String& source);
+	public:		PatternBase(int scale, MemoryBudget* budget = 0);	///< The pattern image is charged to `budget`.
+	
+				/**
+					Runs `source` in a new context inheriting `parentContext`'s state. If `usedPaints` is not 0, it
+					receives which of the inherited paints (see PatternCache) were used while drawing.
+				**/
+	public:		void makePattern(IMPD::Interpreter& impd, IVGExecutor& executor, Context& parentContext
+						, const IMPD::String& source, bool usedPaints[PatternCache::PAINT_COUNT] = 0);
 	protected:	int scale;
+	protected:	MemoryCharge imageCharge;
 };
 
 /**
 	   Concrete pattern painter storing the drawn image for repeated use.
 **/
 template<class PIXEL_TYPE> class PatternPainter : public PatternBase {
-	public:		PatternPainter(int scale) : PatternBase(scale) { }
+	public:		PatternPainter(int scale, MemoryBudget* budget = 0) : PatternBase(scale, budget) { }
 	public:		virtual void parsePaint(IMPD::Interpreter& impd, IVGExecutor& executor, Context& context, IMPD::ArgumentsContainer& args, Paint& paint) const {
 					parsePaintOfType<PIXEL_TYPE>(impd, executor, context, args, paint);
 				}
@@ -509,6 +1068,16 @@ template<class PIXEL_TYPE> class PatternPainter : public PatternBase {
 					if (image.get() == 0) IMPD::Interpreter::throwRunTimeError("Undeclared bounds");
 					(*image) |= source;
 				}
+	public:		virtual void blendPairWithARGB32(const NuXPixels::Renderer<NuXPixels::ARGB32>& first
+						, const NuXPixels::Renderer<NuXPixels::ARGB32>& second) {
+					if (image.get() == 0) IMPD::Interpreter::throwRunTimeError("Undeclared bounds");
+					image->blendBoth(first, second);
+				}
+	public:		virtual void blendPairWithMask8(const NuXPixels::Renderer<NuXPixels::Mask8>& first
+						, const NuXPixels::Renderer<NuXPixels::Mask8>& second) {
+					if (image.get() == 0) IMPD::Interpreter::throwRunTimeError("Undeclared bounds");
+					image->blendBoth(first, second);
+				}
 	public:		virtual bool isVisible(const Paint& withPaint) const { (void)withPaint; return (image.get() != 0); }
 	public:		virtual void doPaint(Paint& withPaint, Context& inContext, const Rect<double>& sourceBounds
 						, const NuXPixels::Renderer<NuXPixels::Mask8>& mask) const {
@@ -529,7 +1098,8 @@ template<class PIXEL_TYPE> class PatternPainter : public PatternBase {
 					}
 
 					inContext.accessCanvas().blend(NuXPixels::Texture<PIXEL_TYPE>(*image, true
-							, NuXPixels::AffineTransformation().transform(xf))
+							, NuXPixels::AffineTransformation().transform(xf), NuXPixels::FULL_RECT
+							, !inContext.accessState().options.draftQuality)
 							* static_cast<const NuXPixels::Renderer<NuXPixels::Mask8>&>(FadedMask(mask, withPaint.opacity)));
 				}
 	public:		virtual void defineBounds(const NuXPixels::IntRect& newBounds) {
@@ -537,6 +1107,8 @@ template<class PIXEL_TYPE> class PatternPainter : public PatternBase {
 						, newBounds.width * scale, newBounds.height * scale);
 					if (image.get() != 0) IMPD::Interpreter::throwRunTimeError("Multiple bounds declarations");
 					checkBounds(physicalBounds);
+					imageCharge.add(static_cast<size_t>(physicalBounds.width) * physicalBounds.height
+							* sizeof (typename PIXEL_TYPE::Pixel));
 					image.reset(new NuXPixels::SelfContainedRaster<PIXEL_TYPE>(physicalBounds));
 					(*image) = NuXPixels::Solid<PIXEL_TYPE>(PIXEL_TYPE::transparent());
 				}
@@ -554,9 +1126,13 @@ class ARGB32Canvas : public Canvas {
 	public:		ARGB32Canvas(NuXPixels::Raster<NuXPixels::ARGB32>& output);
 	public:		virtual void parsePaint(IMPD::Interpreter& impd, IVGExecutor& executor, Context& context, IMPD::ArgumentsContainer& args, Paint& paint) const;
 	public:		virtual void blendWithARGB32(const NuXPixels::Renderer<NuXPixels::ARGB32>& source);
+	public:		virtual void blendPairWithARGB32(const NuXPixels::Renderer<NuXPixels::ARGB32>& first
+						, const NuXPixels::Renderer<NuXPixels::ARGB32>& second);
 	public:		virtual void defineBounds(const NuXPixels::IntRect& newBounds);
 	public:		virtual NuXPixels::IntRect getBounds() const;
+	public:		void setThreadPool(NuXPixels::ThreadPool* pool); // Large blends are split into bands of rows and filled on the threads of pool (0 = none, the default). Output is identical. pool must outlive the canvas and not be used by anyone else while drawing.
 	protected:	NuXPixels::Raster<NuXPixels::ARGB32>& argb32Raster;
+	protected:	NuXPixels::ThreadPool* threadPool;
 };
 
 // FIX : if we templetize this one as a generic offscreenCanvas it is virtually identical to the one in the PatternPainter
@@ -566,15 +1142,191 @@ class ARGB32Canvas : public Canvas {
 **/
 class SelfContainedARGB32Canvas : public Canvas {
 	public:		SelfContainedARGB32Canvas(const double rescaleBounds = 1.0); // rescaleBounds can be used to create a canvas for a different target resolution (just supply the same scale for the initial transform of the root context).
+	public:		SelfContainedARGB32Canvas(const NuXPixels::IntRect& viewport, const double rescaleBounds = 1.0); // Renders only viewport (in rescaled pixels) into a raster of exactly that size, e.g. one tile of a zoomed view. Pixels outside the declared bounds stay transparent and drawing outside the viewport is culled.
 	public:		virtual void parsePaint(IMPD::Interpreter& impd, IVGExecutor& executor, Context& context, IMPD::ArgumentsContainer& args, Paint& paint) const;
 	public:		virtual void blendWithARGB32(const NuXPixels::Renderer<NuXPixels::ARGB32>& source);
+	public:		virtual void blendPairWithARGB32(const NuXPixels::Renderer<NuXPixels::ARGB32>& first
+						, const NuXPixels::Renderer<NuXPixels::ARGB32>& second);
 	public:		virtual void defineBounds(const NuXPixels::IntRect& newBounds);
 	public:		virtual NuXPixels::IntRect getBounds() const;
+	public:		virtual NuXPixels::IntRect getClampBounds() const; // With a viewport, the rescaled document bounds (limited to a range around the viewport that PolygonMask can reach), so that geometry is clamped as in a full render.
 	public:		NuXPixels::SelfContainedRaster<NuXPixels::ARGB32>* accessRaster();
 	public:		NuXPixels::SelfContainedRaster<NuXPixels::ARGB32>* relinquishRaster();
+	public:		void setThreadPool(NuXPixels::ThreadPool* pool); // See ARGB32Canvas::setThreadPool().
+	public:		void setMemoryBudget(MemoryBudget* budget); // Charges the raster allocated in defineBounds() to budget (0 = none, the default). relinquishRaster() releases the charge. Call before defining bounds.
 	protected:	void checkBoundsDeclared() const;
+	protected:	NuXPixels::Raster<NuXPixels::ARGB32>& accessTarget() const;
 	protected:	std::unique_ptr< NuXPixels::SelfContainedRaster<NuXPixels::ARGB32> > raster;
+	protected:	std::unique_ptr< NuXPixels::Raster<NuXPixels::ARGB32> > clippedRaster; // view of raster limited to the declared bounds (viewport only)
 	protected:	const double rescaleBounds;
+	protected:	const bool hasViewport;
+	protected:	const NuXPixels::IntRect viewport;
+	protected:	NuXPixels::IntRect clampBounds; // see getClampBounds() (viewport only)
+	protected:	NuXPixels::ThreadPool* threadPool;
+	protected:	MemoryCharge rasterCharge;
+};
+
+/**
+	   Renders a document into an ARGB32 raster on several threads. The document is interpreted once, on a canvas
+	   that records fills and strokes as DrawCommands (like PipelinedCanvas) instead of rasterizing them. The raster
+	   is split into tiles of full rows and every command is binned by the tiles it touches. The threads of a
+	   NuXPixels::ThreadPool then rasterize the tiles side by side, each replaying only its own commands in order
+	   through rasterizer buffers of its own. The result is identical to rendering with SelfContainedARGB32Canvas.
+	   
+	   Recorded commands are replayed before anything is drawn directly (images, glyph bitmaps and wipes, which are
+	   then blended in bands on the same threads), before a mask is drawn through the current mask, after every 1024
+	   commands and at the end. Paints and masks are shared by the threads while replaying, but they are never
+	   modified once recorded. Override createExecutor() to supply fonts and images. It is called once per render(),
+	   on the calling thread.
+**/
+class TiledRenderer {
+	public:		TiledRenderer(int threadCount = 0, int tileHeight = 0); // threadCount 0 uses all hardware threads, tileHeight 0 gives about four tiles per thread
+	public:		void render(const IMPD::String& source, double scale = 1.0);
+	public:		NuXPixels::SelfContainedRaster<NuXPixels::ARGB32>* accessRaster();
+	public:		NuXPixels::SelfContainedRaster<NuXPixels::ARGB32>* relinquishRaster();	///< Also releases the charge of the raster.
+	public:		void setMemoryBudget(MemoryBudget* budget);	///< Charges the output raster to `budget` (0 = none, the default). Recorded commands are charged through Options::memoryBudget.
+	public:		virtual ~TiledRenderer() { }
+	protected:	class RecordingCanvas;
+	protected:	virtual IVGExecutor* createExecutor(Canvas& canvas, const NuXPixels::AffineTransformation& initialTransform);
+	protected:	int tileHeight;
+	protected:	NuXPixels::ThreadPool pool;
+	protected:	MemoryCharge rasterCharge;
+	protected:	std::unique_ptr< NuXPixels::SelfContainedRaster<NuXPixels::ARGB32> > raster;
+	protected:	TiledRenderer(const TiledRenderer& that); // N/A
+	protected:	TiledRenderer& operator=(const TiledRenderer& that); // N/A
+};
+
+/**
+	   Renders the frames of an animated document. Every frame runs `source` with the variable `timeVariable` declared to
+	   the time of the frame, onto a canvas of its own. The same executor runs all frames (see IVGExecutor::restart()),
+	   so fonts, embedded fonts, `define image` results, patterns, parsed paths and text layouts that don't depend on
+	   variables are only built once. Override createExecutor() to supply fonts and images.
+**/
+class AnimationRenderer {
+	public:		AnimationRenderer(const IMPD::String& source, double scale = 1.0, const IMPD::String& timeVariable = "time");
+	public:		void renderFrame(double time);
+	public:		NuXPixels::SelfContainedRaster<NuXPixels::ARGB32>* accessRaster();	///< Raster of the last frame.
+	public:		NuXPixels::SelfContainedRaster<NuXPixels::ARGB32>* relinquishRaster();
+	public:		virtual ~AnimationRenderer() { }
+	protected:	virtual IVGExecutor* createExecutor(Canvas& canvas, const NuXPixels::AffineTransformation& initialTransform);
+	protected:	const IMPD::String source;
+	protected:	const double scale;
+	protected:	const IMPD::String timeVariable;
+	protected:	std::unique_ptr<SelfContainedARGB32Canvas> canvas;
+	protected:	std::unique_ptr<IVGExecutor> executor;
+};
+
+/**
+	   Renders many independent documents (e.g. icons) on the threads of a NuXPixels::ThreadPool. Threads take the next
+	   waiting job as soon as they are done, so long and short jobs balance out. Each job runs on a
+	   SelfContainedARGB32Canvas with an executor of its own. Parsed paths and text layouts are kept between jobs (one
+	   set of caches per thread, since the caches are not thread-safe). Patterns are not, since different documents may
+	   use the same font and image names for different content.
+	   
+	   A failing job does not stop the others. Its `error` is set instead of its `raster`. Override createExecutor() to
+	   supply fonts and images and finishJob() to handle each job as soon as it is done (e.g. to write and release the
+	   raster). Both are called on the threads of the pool, so anything shared between jobs must be thread-safe. Only one
+	   thread at a time may call render().
+**/
+class BatchRenderer {
+	public:		struct Job {
+					Job() : scale(1.0) { }
+					IMPD::String source;
+					IMPD::StringStringMap variables;		///< Declared before the document runs.
+					double scale;
+					std::unique_ptr< NuXPixels::SelfContainedRaster<NuXPixels::ARGB32> > raster;	///< Output, null if the job failed.
+					std::string error;						///< Empty if the job succeeded.
+				};
+	public:		BatchRenderer(int threadCount = 0);	///< 0 uses all hardware threads.
+	public:		void render(std::vector<Job>& jobs);
+	public:		virtual ~BatchRenderer();
+	protected:	struct Caches {
+					SVGPathCache svgPaths;
+					TextLayoutCache textLayouts;
+				};
+	protected:	virtual IVGExecutor* createExecutor(Canvas& canvas, const NuXPixels::AffineTransformation& initialTransform);
+	protected:	virtual void finishJob(int index, Job& job);	///< Called after every job, successful or not. Exceptions become the job's error.
+	protected:	static void runJob(void* data, int index);
+	protected:	void renderJob(Job& job, Caches& caches);
+	protected:	NuXPixels::ThreadPool pool;
+	protected:	std::vector<Job>* jobs;
+	protected:	std::mutex cachesMutex;
+	protected:	std::vector<Caches*> freeCaches;			///< Owned. At most one per thread.
+	protected:	BatchRenderer(const BatchRenderer& that); // N/A
+	protected:	BatchRenderer& operator=(const BatchRenderer& that); // N/A
+};
+
+/**
+	   Canvas that rasterizes on a thread of its own so that interpreting a document and rasterizing it overlap.
+	   Fills and strokes stop at device space paths on the interpreting thread. They are passed as DrawCommands
+	   through a bounded lock-free queue to the raster thread, which rasterizes them into `target` in order.
+	   
+	   Masks, patterns and defined images are drawn on canvases of their own and only wait for the raster thread if a
+	   new mask is drawn through the current one. Drawing that uses data the interpreter owns (images, glyph bitmaps
+	   and wipes) waits for the queue to empty and is then blended directly. Output is identical to drawing into
+	   `target`.
+	   
+	   Call sync() before using the pixels of `target`. It waits for the raster thread and rethrows its error if
+	   it failed (later draws rethrow it too). `target` must outlive this canvas.
+**/
+class PipelinedCanvas : public Canvas {
+	public:		PipelinedCanvas(Canvas& target, int queueSize = 256);
+	public:		virtual void parsePaint(IMPD::Interpreter& impd, IVGExecutor& executor, Context& context, IMPD::ArgumentsContainer& args, Paint& paint) const;
+	public:		virtual void blendWithARGB32(const NuXPixels::Renderer<NuXPixels::ARGB32>& source);
+	public:		virtual void blendWithMask8(const NuXPixels::Renderer<NuXPixels::Mask8>& source);
+	public:		virtual void blendPairWithARGB32(const NuXPixels::Renderer<NuXPixels::ARGB32>& first
+						, const NuXPixels::Renderer<NuXPixels::ARGB32>& second);
+	public:		virtual void blendPairWithMask8(const NuXPixels::Renderer<NuXPixels::Mask8>& first
+						, const NuXPixels::Renderer<NuXPixels::Mask8>& second);
+	public:		virtual void defineBounds(const NuXPixels::IntRect& newBounds);
+	public:		virtual NuXPixels::IntRect getBounds() const;
+	public:		virtual NuXPixels::IntRect getClampBounds() const;
+	public:		virtual bool isDeferred() const { return true; }
+	public:		virtual void enqueue(DrawCommand* command);
+	public:		virtual void sync();
+	public:		virtual ~PipelinedCanvas();
+	protected:	class Queue;
+	protected:	void rasterize();
+	protected:	Canvas& target;
+	protected:	std::unique_ptr<Queue> queue;
+};
+
+/**
+	   Canvas that rasterizes nothing but collects statistics of what would be drawn, e.g. to size an output raster,
+	   reject oversized jobs or warm up font and image caches before a real render. Fills and strokes are prepared in
+	   device space like for PipelinedCanvas and then discarded, so IVGExecutor::loadImage() and
+	   IVGExecutor::lookupFonts() are still called. Patterns, masks and defined images are still drawn on canvases of
+	   their own since draws depend on them.
+	   
+	   Bounds are device bounds of the paths (or images), clipped to the declared bounds and the current mask, so
+	   they may be a little larger than the pixels actually touched. `rescaleBounds` works like for
+	   SelfContainedARGB32Canvas.
+**/
+class DryRunCanvas : public Canvas {
+	public:		struct Stats {
+					Stats();
+					NuXPixels::IntRect drawBounds;				///< Union of the bounds of all draws. Empty if nothing was drawn.
+					size_t drawCount;							///< Fills, strokes, images, wipes and glyph bitmap texts.
+					size_t vertexCount;							///< Device path vertices of all fills and strokes.
+					std::set<IMPD::WideString> fontNames;		///< Fonts looked up by the document, embedded or not.
+					std::set<IMPD::WideString> imageNames;		///< Images drawn by the document, defined or not.
+				};
+	public:		DryRunCanvas(double rescaleBounds = 1.0);
+	public:		virtual void parsePaint(IMPD::Interpreter& impd, IVGExecutor& executor, Context& context, IMPD::ArgumentsContainer& args, Paint& paint) const;
+	public:		virtual void blendWithARGB32(const NuXPixels::Renderer<NuXPixels::ARGB32>& source);
+	public:		virtual void blendWithMask8(const NuXPixels::Renderer<NuXPixels::Mask8>& source);
+	public:		virtual void defineBounds(const NuXPixels::IntRect& newBounds);
+	public:		virtual NuXPixels::IntRect getBounds() const;
+	public:		virtual bool isDeferred() const { return true; }
+	public:		virtual void enqueue(DrawCommand* command);
+	public:		virtual void noteFontUse(const IMPD::WideString& fontName);
+	public:		virtual void noteImageUse(const IMPD::WideString& imageName);
+	public:		const Stats& getStats() const { return stats; }
+	protected:	void addDraw(const NuXPixels::IntRect& drawBounds);
+	protected:	const double rescaleBounds;
+	protected:	bool declared;
+	protected:	NuXPixels::IntRect bounds;
+	protected:	Stats stats;
 };
 
 NuXPixels::ARGB32::Pixel parseColor(const IMPD::String& color);
@@ -583,6 +1335,10 @@ bool buildPathFromSVG(const IMPD::String& svgSource, double curveQuality, NuXPix
 bool buildPathForString(const IMPD::UniString& string, const std::vector<const Font*>& fonts, double size
 				, const NuXPixels::AffineTransformation& glyphTransform, double letterSpacing, double curveQuality
 				, NuXPixels::Path& path, double& advance, const char*& errorString, IMPD::UniChar lastCharacter = 0);
+bool buildPathForString(const IMPD::UniString& string, const FontChain& fonts, double size
+				, const NuXPixels::AffineTransformation& glyphTransform, double letterSpacing, double curveQuality
+				, NuXPixels::Path& path, double& advance, const char*& errorString, IMPD::UniChar lastCharacter = 0
+				, SVGPathCache* glyphPathCache = 0);
 
 } // namespace IVG
 
@@ -21,10 +21,17 @@
 	OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 **/
 
+#include <chrono>
 #include <iostream>
 #include <fstream>
 #include <stdexcept>
 #include <string>
+#include <map>
+#include <mutex>
+#include <memory>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include "src/IVG.h"
 #include "png.h"
 #include "zlib.h"
@@ -51,15 +58,12 @@ static bool isLittleEndian() {
 	}
 }
 
-class IVGExecutorWithExternalFonts : public IVGExecutor {
+// Fonts are loaded once and shared by all executors (one per tile when rendering with --threads).
+class ExternalFonts {
 	public:
-		IVGExecutorWithExternalFonts(Canvas& canvas, const std::string& fontPath,
-			    const AffineTransformation& xform = AffineTransformation())
-			    : IVGExecutor(canvas, xform), fontPath(fontPath) {
-		}
-		virtual std::vector<const Font*> lookupFonts(IMPD::Interpreter& interpreter, const IMPD::WideString& fontName,
-			    const IMPD::UniString& forString) {
-			(void)interpreter;
+		ExternalFonts(const std::string& fontPath) : fontPath(fontPath) { }
+		std::vector<const Font*> lookup(const IMPD::WideString& fontName) {
+			std::lock_guard<std::mutex> lock(mutex);
 			std::pair< FontMap::iterator, bool > insertResult = loadedFonts.insert(std::make_pair(fontName, Font()));
 			if (insertResult.second) {
 			    const std::string fontName8Bit(fontName.begin(), fontName.end());
@@ -68,6 +72,7 @@ class IVGExecutorWithExternalFonts : public IVGExecutor {
 			        std::string path = fontPath.empty() ? (fontName8Bit + ".ivgfont") : (fontPath + "/" + fontName8Bit + ".ivgfont");
 			        std::ifstream fileStream(path.c_str());
 			        if (!fileStream.good()) {
+			            loadedFonts.erase(insertResult.first);
 			            return std::vector<const Font*>();
 			        }
 			        fileStream.exceptions(std::ios_base::badbit | std::ios_base::failbit);
@@ -86,10 +91,243 @@ class IVGExecutorWithExternalFonts : public IVGExecutor {
 			return std::vector<const Font*>(1, &insertResult.first->second);
 		}
 	protected:
+		typedef std::map<IMPD::WideString, Font> FontMap;
+		std::mutex mutex;
 		FontMap loadedFonts;
 		std::string fontPath;
 };
 
+// PNG images are likewise decoded once and shared by all executors.
+class PNGImages : public ImageCache {
+	public:
+		PNGImages(const std::string& imagePath) : imagePath(imagePath) { }
+		Image load(const IMPD::WideString& imageSource, const IntRect* sourceRectangle, double forXSize,
+			    bool xSizeIsRelative, double forYSize, bool ySizeIsRelative, RasterPointer& holder) {
+			std::lock_guard<std::mutex> lock(mutex);
+			return lookup(imageSource, sourceRectangle, forXSize, xSizeIsRelative, forYSize, ySizeIsRelative, holder);
+		}
+	protected:
+		virtual SelfContainedRaster<ARGB32>* decodeImage(const IMPD::WideString& imageSource) {
+			const std::string imageName8Bit(imageSource.begin(), imageSource.end());
+			const std::string path = imagePath.empty() ? imageName8Bit : (imagePath + "/" + imageName8Bit);
+			png_image image;
+			memset(&image, 0, sizeof (image));
+			image.version = PNG_IMAGE_VERSION;
+			if (!png_image_begin_read_from_file(&image, path.c_str())) {
+				return 0;
+			}
+			image.format = (isLittleEndian() ? PNG_FORMAT_BGRA : PNG_FORMAT_ARGB);
+			std::unique_ptr< SelfContainedRaster<ARGB32> > raster(new SelfContainedRaster<ARGB32>(IntRect(0, 0
+					, image.width, image.height), false));
+			ARGB32::Pixel* pixels = raster->getPixelPointer();
+			if (!png_image_finish_read(&image, 0, pixels, raster->getStride() * sizeof (ARGB32::Pixel), 0)) {
+				png_image_free(&image);
+				return 0;
+			}
+			const int count = raster->getStride() * static_cast<int>(image.height);
+			for (int i = 0; i < count; ++i) {
+				const ARGB32::Pixel p = pixels[i];
+				const UInt32 a = p >> 24;
+				if (a != 0xFF) {
+					pixels[i] = (a << 24)
+							| (((((p >> 16) & 0xFF) * a + 127) / 255) << 16)
+							| (((((p >> 8) & 0xFF) * a + 127) / 255) << 8)
+							| (((p & 0xFF) * a + 127) / 255);
+				}
+			}
+			return raster.release();
+		}
+		std::mutex mutex;
+		std::string imagePath;
+};
+
+// Prints the time of each phase in milliseconds. "other" is the rest of `totalSeconds`, mostly IMPD interpreting.
+static void printRenderStats(const RenderStats& stats, double totalSeconds) {
+	double phaseSeconds = 0.0;
+	for (int i = 0; i < RenderStats::PHASE_COUNT; ++i) {
+		std::cerr << RenderStats::getPhaseName(static_cast<RenderStats::Phase>(i)) << ": " << stats.seconds[i] * 1000.0
+				<< " ms (" << stats.calls[i] << " times)" << std::endl;
+		phaseSeconds += stats.seconds[i];
+	}
+	std::cerr << "other: " << maxValue(totalSeconds - phaseSeconds, 0.0) * 1000.0 << " ms" << std::endl;
+	std::cerr << "vertices: " << stats.vertexCount << ", segments: " << stats.segmentCount << ", pixels: "
+			<< stats.pixelCount << std::endl;
+}
+
+static void writePNG(SelfContainedRaster<ARGB32>& raster, const char* outputPath, int compressionLevel, bool fast,
+		bool haveBackground, ARGB32::Pixel background, bool verbose = true) {
+	IntRect bounds = raster.calcBounds();
+	if (bounds.width <= 0 || bounds.height <= 0) throw std::runtime_error("IVG image is empty");
+
+	if (haveBackground) {
+		SelfContainedRaster<ARGB32> copy(raster);
+		raster = Solid<ARGB32>(background) | copy;
+	}
+	std::vector<png_bytep> rowPointers(bounds.height);
+	int imageStride = raster.getStride();
+	ARGB32::Pixel* pixels = raster.getPixelPointer() + bounds.top * imageStride + bounds.left;
+	for (int i = 0; i < bounds.height; ++i) {
+		ARGB32::Pixel* p = pixels + i * imageStride;
+		rowPointers[i] = reinterpret_cast<png_bytep>(p);
+		for (int x = 0; x < bounds.width; ++x) {
+			int a = (*p >> 24) & 0xFF;
+			int r = (*p >> 16) & 0xFF;
+			int g = (*p >> 8) & 0xFF;
+			int b = (*p >> 0) & 0xFF;
+			if (a != 0xFF && a != 0x00) {
+				int m = 0xFFFF / a;
+				r = (r * m) >> 8;
+				g = (g * m) >> 8;
+				b = (b * m) >> 8;
+				assert(0 <= r && r < 0x100);
+				assert(0 <= g && g < 0x100);
+				assert(0 <= b && b < 0x100);
+			}
+			*p = (a << 24) | (r << 16) | (g << 8) | b;
+			++p;
+		}
+	}
+	if (verbose) std::cerr << "Converted to non-premultiplied alpha..." << std::endl;
+
+	{
+		FILE* f = NULL;
+		png_structp png_ptr = 0;
+		png_infop info_ptr = 0;
+	
+		try {
+			f = fopen(outputPath, "wb");
+			if (f == NULL) throw std::runtime_error("Could not open output PNG file");
+
+			png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, 0, myPNGErrorFunction, 0);
+			if (png_ptr == 0) throw std::runtime_error("Error writing PNG image : could not initialize");
+
+			info_ptr = png_create_info_struct(png_ptr);
+			if (info_ptr == 0) throw std::runtime_error("Error writing PNG image : could not initialize");
+
+			png_set_compression_level(png_ptr, compressionLevel);
+			if (fast) png_set_filter(png_ptr, PNG_FILTER_TYPE_BASE, PNG_FILTER_NONE);
+			png_init_io(png_ptr, f);
+
+			png_set_IHDR(png_ptr, info_ptr, bounds.width, bounds.height, 8, PNG_COLOR_TYPE_RGB_ALPHA
+					, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+			
+			png_set_sRGB_gAMA_and_cHRM(png_ptr, info_ptr, PNG_sRGB_INTENT_ABSOLUTE);
+
+			png_set_oFFs(png_ptr, info_ptr, bounds.left, bounds.top, PNG_OFFSET_PIXEL);
+
+			png_set_rows(png_ptr, info_ptr, &rowPointers[0]);
+
+			png_write_png(png_ptr, info_ptr, (isLittleEndian() ? PNG_TRANSFORM_BGR : PNG_TRANSFORM_SWAP_ALPHA), NULL);
+
+			png_destroy_write_struct(&png_ptr, &info_ptr);
+			fclose(f);
+			f = NULL;
+		}
+		catch (...) {
+			png_destroy_write_struct(&png_ptr, &info_ptr);
+			if (f != NULL) {
+				fclose(f);
+				f = NULL;
+			}
+			throw;
+		}
+	}
+	if (verbose) std::cerr << "Written to PNG." << std::endl;
+}
+
+class IVGExecutorWithExternalFonts : public IVGExecutor {
+	public:
+		IVGExecutorWithExternalFonts(Canvas& canvas, ExternalFonts& fonts, PNGImages& images,
+			    const AffineTransformation& xform = AffineTransformation(), const Options& options = Options(),
+			    bool glyphBitmaps = false)
+			    : IVGExecutor(canvas, xform, options), fonts(fonts), images(images) {
+			if (glyphBitmaps) setGlyphBitmapCache(&glyphBitmapCache);
+		}
+		virtual std::vector<const Font*> lookupFonts(IMPD::Interpreter& interpreter, const IMPD::WideString& fontName,
+			    const IMPD::UniString& forString) {
+			(void)interpreter;
+			return fonts.lookup(fontName);
+		}
+		virtual Image loadImage(IMPD::Interpreter& interpreter, const IMPD::WideString& imageSource,
+			    const IntRect* sourceRectangle, bool forStretching, double forXSize, bool xSizeIsRelative,
+			    double forYSize, bool ySizeIsRelative) {
+			(void)interpreter; (void)forStretching;
+			return images.load(imageSource, sourceRectangle, forXSize, xSizeIsRelative, forYSize, ySizeIsRelative
+					, loadedImage);
+		}
+	protected:
+		ExternalFonts& fonts;
+		PNGImages& images;
+		ImageCache::RasterPointer loadedImage;
+		GlyphBitmapCache glyphBitmapCache;
+};
+
+class TiledRendererWithExternalFonts : public TiledRenderer {
+	public:
+		TiledRendererWithExternalFonts(int threadCount, int tileHeight, ExternalFonts& fonts, PNGImages& images,
+			    const Options& options, bool glyphBitmaps)
+			    : TiledRenderer(threadCount, tileHeight), fonts(fonts), images(images), options(options)
+			    , glyphBitmaps(glyphBitmaps) {
+		}
+	protected:
+		virtual IVGExecutor* createExecutor(Canvas& canvas, const AffineTransformation& initialTransform) {
+			return new IVGExecutorWithExternalFonts(canvas, fonts, images, initialTransform, options, glyphBitmaps);
+		}
+		ExternalFonts& fonts;
+		PNGImages& images;
+		const Options options;
+		const bool glyphBitmaps;
+};
+
+// Writes the raster of each job to its output path as soon as it is done.
+class BatchRendererWithExternalFonts : public BatchRenderer {
+	public:
+		BatchRendererWithExternalFonts(int threadCount, ExternalFonts& fonts, PNGImages& images, const Options& options,
+			    bool glyphBitmaps, const std::vector<std::string>& outputPaths, int compressionLevel, bool fast,
+			    bool haveBackground, ARGB32::Pixel background)
+			    : BatchRenderer(threadCount), fonts(fonts), images(images), options(options), glyphBitmaps(glyphBitmaps)
+			    , outputPaths(outputPaths), compressionLevel(compressionLevel), fast(fast), haveBackground(haveBackground)
+			    , background(background) {
+		}
+	protected:
+		virtual IVGExecutor* createExecutor(Canvas& canvas, const AffineTransformation& initialTransform) {
+			return new IVGExecutorWithExternalFonts(canvas, fonts, images, initialTransform, options, glyphBitmaps);
+		}
+		virtual void finishJob(int index, Job& job) {
+			if (job.raster.get() != 0) {
+				writePNG(*job.raster, outputPaths[index].c_str(), compressionLevel, fast, haveBackground, background
+						, false);
+				job.raster.reset();
+			}
+		}
+		ExternalFonts& fonts;
+		PNGImages& images;
+		const Options options;
+		const bool glyphBitmaps;
+		const std::vector<std::string>& outputPaths;
+		const int compressionLevel;
+		const bool fast;
+		const bool haveBackground;
+		const ARGB32::Pixel background;
+};
+
+class AnimationRendererWithExternalFonts : public AnimationRenderer {
+	public:
+		AnimationRendererWithExternalFonts(const String& source, double scale, ExternalFonts& fonts, PNGImages& images,
+			    const Options& options, bool glyphBitmaps)
+			    : AnimationRenderer(source, scale), fonts(fonts), images(images), options(options)
+			    , glyphBitmaps(glyphBitmaps) {
+		}
+	protected:
+		virtual IVGExecutor* createExecutor(Canvas& canvas, const AffineTransformation& initialTransform) {
+			return new IVGExecutorWithExternalFonts(canvas, fonts, images, initialTransform, options, glyphBitmaps);
+		}
+		ExternalFonts& fonts;
+		PNGImages& images;
+		const Options options;
+		const bool glyphBitmaps;
+};
+
 
 #ifdef LIBFUZZ
 struct FuzzerExecutor : public IVGExecutor {
@@ -120,22 +358,94 @@ extern "C" int LLVMFuzzerTestOneInput(const uint8_t *Data, size_t Size) {
 #ifndef LIBFUZZ
 int main(int argc, const char* argv[]) {
 	try {
-		const char* usage = "Usage: IVG2PNG [--fast] [--fonts <dir>] [--background <color>] <input.ivg> <output.png>\n\nVery simple!\n\n";
+		const char* usage = "Usage: IVG2PNG [--fast] [--glyph-bitmaps] [--analytic-shapes] [--adaptive-images] [--draft] [--scale <factor>] [--viewport <left,top,width,height>] [--threads <count>] [--tile-height <rows>] [--fill-threads <count>] [--pipeline] [--frames <count> [--frame-rate <fps>]] [--memory-limit <megabytes>] [--stats] [--fonts <dir>] [--images <dir>] [--background <color>] <input.ivg> <output.png>\n       IVG2PNG --dry-run [--stats] [--scale <factor>] [--fonts <dir>] [--images <dir>] <input.ivg>\n       IVG2PNG --batch <list> [--threads <count>] [--scale <factor>] [--fonts <dir>] [--images <dir>] [--background <color>] [rendering options]\n\nVery simple!\n\n";
 		const char* inputPath = 0;
 		const char* outputPath = 0;
+		const char* batchPath = 0;
 		ARGB32::Pixel background = 0;
 		bool haveBackground = false;
 		std::string fontPath;
+		bool haveImagePath = false;
+		std::string imagePath;
 		int compressionLevel = Z_BEST_COMPRESSION;
 		bool fast = false;
+		bool glyphBitmaps = false;
+		double scale = 1.0;
+		bool haveViewport = false;
+		IntRect viewport;
+		int threadCount = -1;
+		int tileHeight = 0;
+		int fillThreadCount = -1;
+		bool pipeline = false;
+		bool dryRun = false;
+		int frameCount = 0;
+		double frameRate = 25.0;
+		double memoryLimit = 0.0;
+		bool printStats = false;
+		Options options;
 		for (int i = 1; i < argc; ++i) {
 			std::string arg(argv[i]);
 			if (arg == "--fast") {
 				fast = true;
 				compressionLevel = Z_BEST_SPEED;
+			} else if (arg == "--glyph-bitmaps") {
+				glyphBitmaps = true;
+			} else if (arg == "--analytic-shapes") {
+				options.analyticShapes = true;
+			} else if (arg == "--adaptive-images") {
+				options.adaptiveImageResolution = true;
+			} else if (arg == "--draft") {
+				options.draftQuality = true;
+			} else if (arg == "--scale") {
+				if (++i == argc) { std::cerr << usage; return 1; }
+				scale = atof(argv[i]);
+				if (!(scale > 0.0)) throw std::runtime_error("Invalid scale");
+			} else if (arg == "--viewport") {
+				if (++i == argc) { std::cerr << usage; return 1; }
+				if (sscanf(argv[i], "%d,%d,%d,%d", &viewport.left, &viewport.top, &viewport.width, &viewport.height) != 4) {
+					throw std::runtime_error("Invalid viewport");
+				}
+				haveViewport = true;
+			} else if (arg == "--threads") {
+				if (++i == argc) { std::cerr << usage; return 1; }
+				threadCount = atoi(argv[i]);
+				if (threadCount < 0) throw std::runtime_error("Invalid thread count");
+			} else if (arg == "--tile-height") {
+				if (++i == argc) { std::cerr << usage; return 1; }
+				tileHeight = atoi(argv[i]);
+				if (tileHeight <= 0) throw std::runtime_error("Invalid tile height");
+			} else if (arg == "--fill-threads") {
+				if (++i == argc) { std::cerr << usage; return 1; }
+				fillThreadCount = atoi(argv[i]);
+				if (fillThreadCount < 0) throw std::runtime_error("Invalid thread count");
+			} else if (arg == "--pipeline") {
+				pipeline = true;
+			} else if (arg == "--dry-run") {
+				dryRun = true;
+			} else if (arg == "--batch") {
+				if (++i == argc) { std::cerr << usage; return 1; }
+				batchPath = argv[i];
+			} else if (arg == "--frames") {
+				if (++i == argc) { std::cerr << usage; return 1; }
+				frameCount = atoi(argv[i]);
+				if (frameCount <= 0) throw std::runtime_error("Invalid frame count");
+			} else if (arg == "--frame-rate") {
+				if (++i == argc) { std::cerr << usage; return 1; }
+				frameRate = atof(argv[i]);
+				if (!(frameRate > 0.0)) throw std::runtime_error("Invalid frame rate");
+			} else if (arg == "--memory-limit") {
+				if (++i == argc) { std::cerr << usage; return 1; }
+				memoryLimit = atof(argv[i]);
+				if (!(memoryLimit > 0.0)) throw std::runtime_error("Invalid memory limit");
+			} else if (arg == "--stats") {
+				printStats = true;
 			} else if (arg == "--fonts") {
 				if (++i == argc) { std::cerr << usage; return 1; }
 				fontPath = argv[i];
+			} else if (arg == "--images") {
+				if (++i == argc) { std::cerr << usage; return 1; }
+				imagePath = argv[i];
+				haveImagePath = true;
 			} else if (arg == "--background") {
 				if (++i == argc) { std::cerr << usage; return 1; }
 				background = parseColor(argv[i]);
@@ -149,10 +459,86 @@ int main(int argc, const char* argv[]) {
 				return 1;
 			}
 		}
-		if (inputPath == 0 || outputPath == 0) {
+		if (batchPath != 0 ? (inputPath != 0) : (inputPath == 0 || (outputPath == 0) != dryRun)) {
 			std::cerr << usage;
 			return 1;
 		}
+		if (batchPath != 0 && (dryRun || frameCount > 0 || tileHeight > 0 || fillThreadCount >= 0 || pipeline
+				|| haveViewport || printStats)) {
+			throw std::runtime_error("--batch can only be combined with --threads, --scale, --fonts, --images, --background and rendering options");
+		}
+		if (dryRun && (threadCount >= 0 || fillThreadCount >= 0 || pipeline || haveViewport)) {
+			throw std::runtime_error("--dry-run can only be combined with --scale, --fonts, --images and rendering options");
+		}
+		if (haveViewport && threadCount >= 0) throw std::runtime_error("--viewport can not be combined with --threads");
+		if (fillThreadCount >= 0 && threadCount >= 0) {
+			throw std::runtime_error("--fill-threads can not be combined with --threads");
+		}
+		if (pipeline && threadCount >= 0) throw std::runtime_error("--pipeline can not be combined with --threads");
+		if (printStats && threadCount >= 0) throw std::runtime_error("--stats can not be combined with --threads");
+		if (frameCount > 0 && (dryRun || threadCount >= 0 || fillThreadCount >= 0 || pipeline || haveViewport)) {
+			throw std::runtime_error("--frames can only be combined with --scale, --fonts, --images and rendering options");
+		}
+
+		if (batchPath != 0) {
+			/*
+				Each line of the list holds an input path and an output path separated by a tab. Images are loaded from
+				the current directory unless --images is given. Jobs are rendered in chunks to limit the memory used for
+				sources, and each output is written by the thread that rendered it.
+			*/
+			std::vector<std::string> inputPaths;
+			std::vector<std::string> outputPaths;
+			{
+				std::ifstream listStream(batchPath);
+				if (!listStream.good()) throw std::runtime_error("Could not open batch list");
+				std::string line;
+				while (std::getline(listStream, line)) {
+					if (!line.empty() && line[line.size() - 1] == '\r') line.erase(line.size() - 1);
+					if (line.empty()) continue;
+					const std::string::size_type tab = line.find('\t');
+					if (tab == std::string::npos) throw std::runtime_error("Invalid batch list line: " + line);
+					inputPaths.push_back(line.substr(0, tab));
+					outputPaths.push_back(line.substr(tab + 1));
+				}
+			}
+			std::unique_ptr<MemoryBudget> memoryBudget(memoryLimit > 0.0
+					? new MemoryBudget(static_cast<size_t>(memoryLimit * 1024.0 * 1024.0)) : 0);
+			options.memoryBudget = memoryBudget.get();
+			ExternalFonts fonts(fontPath);
+			PNGImages images(imagePath);
+			images.setMemoryBudget(memoryBudget.get());
+			std::vector<std::string> chunkOutputPaths;
+			BatchRendererWithExternalFonts batchRenderer(maxValue(threadCount, 0), fonts, images, options, glyphBitmaps
+					, chunkOutputPaths, compressionLevel, fast, haveBackground, background);
+			const size_t CHUNK_SIZE = 1024;
+			size_t failedCount = 0;
+			for (size_t first = 0; first < inputPaths.size(); first += CHUNK_SIZE) {
+				const size_t count = minValue(CHUNK_SIZE, inputPaths.size() - first);
+				std::vector<BatchRenderer::Job> jobs(count);
+				std::vector<bool> unreadable(count, false);
+				chunkOutputPaths.assign(outputPaths.begin() + first, outputPaths.begin() + first + count);
+				for (size_t i = 0; i < count; ++i) {
+					std::ifstream inStream(inputPaths[first + i].c_str());
+					jobs[i].source.assign(std::istreambuf_iterator<char>(inStream), std::istreambuf_iterator<char>());
+					unreadable[i] = !inStream.good();
+					jobs[i].scale = scale;
+				}
+				batchRenderer.render(jobs);
+				for (size_t i = 0; i < count; ++i) {
+					if (unreadable[i]) jobs[i].error = "Could not read input IVG file";
+					if (!jobs[i].error.empty()) {
+						std::cerr << inputPaths[first + i] << ": " << jobs[i].error << std::endl;
+						++failedCount;
+					}
+				}
+			}
+			std::cerr << "Rendered " << (inputPaths.size() - failedCount) << " of " << inputPaths.size() << " documents."
+					<< std::endl;
+			if (memoryBudget.get() != 0) {
+				std::cerr << "Peak memory: " << memoryBudget->getPeakBytes() << " bytes" << std::endl;
+			}
+			return (failedCount == 0 ? 0 : 1);
+		}
 
 		std::string ivgContents;
 		{
@@ -164,95 +550,126 @@ int main(int argc, const char* argv[]) {
 		}
 		std::cerr << "Read source IVG..." << std::endl;
 
-		SelfContainedARGB32Canvas canvas;
-		{
-			STLMapVariables topVars;
-			IVGExecutorWithExternalFonts ivgExecutor(canvas, fontPath);
-			FormatInfo formatInfo;
-			Interpreter impd(ivgExecutor, topVars, formatInfo);
-			impd.run(ivgContents);
+		if (!haveImagePath) {
+			// Images are looked up relative to the input file by default.
+			const std::string input(inputPath);
+			const std::string::size_type slash = input.find_last_of("/\\");
+			imagePath = (slash == std::string::npos ? std::string() : input.substr(0, slash));
 		}
-		std::cerr << "Rasterized image..." << std::endl;
 
-		SelfContainedRaster<ARGB32>* raster = canvas.accessRaster();
-		if (raster == 0) throw std::runtime_error("IVG image is empty");
-		IntRect bounds = raster->calcBounds();
-		if (bounds.width <= 0 || bounds.height <= 0) throw std::runtime_error("IVG image is empty");
-
-		if (haveBackground) {
-			SelfContainedRaster<ARGB32> copy(*raster);
-			(*raster) = Solid<ARGB32>(background) | copy;
-		}
-		std::vector<png_bytep> rowPointers(bounds.height);
-		int imageStride = raster->getStride();
-		ARGB32::Pixel* pixels = raster->getPixelPointer() + bounds.top * imageStride + bounds.left;
-		for (int i = 0; i < bounds.height; ++i) {
-			ARGB32::Pixel* p = pixels + i * imageStride;
-			rowPointers[i] = reinterpret_cast<png_bytep>(p);
-			for (int x = 0; x < bounds.width; ++x) {
-				int a = (*p >> 24) & 0xFF;
-				int r = (*p >> 16) & 0xFF;
-				int g = (*p >> 8) & 0xFF;
-				int b = (*p >> 0) & 0xFF;
-				if (a != 0xFF && a != 0x00) {
-					int m = 0xFFFF / a;
-					r = (r * m) >> 8;
-					g = (g * m) >> 8;
-					b = (b * m) >> 8;
-					assert(0 <= r && r < 0x100);
-					assert(0 <= g && g < 0x100);
-					assert(0 <= b && b < 0x100);
-				}
-				*p = (a << 24) | (r << 16) | (g << 8) | b;
-				++p;
+		std::unique_ptr<MemoryBudget> memoryBudget(memoryLimit > 0.0
+				? new MemoryBudget(static_cast<size_t>(memoryLimit * 1024.0 * 1024.0)) : 0);
+		options.memoryBudget = memoryBudget.get();
+		RenderStats renderStats;
+		if (printStats) {
+			options.stats = &renderStats;
+		}
+		const std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+		ExternalFonts fonts(fontPath);
+		PNGImages images(imagePath);
+		images.setMemoryBudget(memoryBudget.get());
+		TiledRendererWithExternalFonts tiledRenderer(threadCount, tileHeight, fonts, images, options, glyphBitmaps);
+		tiledRenderer.setMemoryBudget(memoryBudget.get());
+		if (dryRun) {
+			// Prints what a render would draw without rasterizing anything.
+			DryRunCanvas dryRunCanvas(scale);
+			{
+				STLMapVariables topVars;
+				IVGExecutorWithExternalFonts ivgExecutor(dryRunCanvas, fonts, images, AffineTransformation().scale(scale)
+						, options, glyphBitmaps);
+				FormatInfo formatInfo;
+				Interpreter impd(ivgExecutor, topVars, formatInfo);
+				impd.run(ivgContents);
+			}
+			const DryRunCanvas::Stats& stats = dryRunCanvas.getStats();
+			const IntRect canvasBounds = dryRunCanvas.getBounds();
+			std::cout << "bounds: " << canvasBounds.left << "," << canvasBounds.top << "," << canvasBounds.width << ","
+					<< canvasBounds.height << std::endl;
+			std::cout << "draw bounds: " << stats.drawBounds.left << "," << stats.drawBounds.top << ","
+					<< stats.drawBounds.width << "," << stats.drawBounds.height << std::endl;
+			std::cout << "draws: " << stats.drawCount << std::endl;
+			std::cout << "vertices: " << stats.vertexCount << std::endl;
+			for (std::set<WideString>::const_iterator it = stats.fontNames.begin(); it != stats.fontNames.end(); ++it) {
+				std::cout << "font: " << std::string(it->begin(), it->end()) << std::endl;
+			}
+			for (std::set<WideString>::const_iterator it = stats.imageNames.begin(); it != stats.imageNames.end(); ++it) {
+				std::cout << "image: " << std::string(it->begin(), it->end()) << std::endl;
+			}
+			if (printStats) {
+				printRenderStats(renderStats, std::chrono::duration<double>(std::chrono::steady_clock::now()
+						- startTime).count());
 			}
+			if (memoryBudget.get() != 0) {
+				std::cerr << "Peak memory: " << memoryBudget->getPeakBytes() << " bytes" << std::endl;
+			}
+			return 0;
 		}
-		std::cerr << "Converted to non-premultiplied alpha..." << std::endl;
-
-		{
-			FILE* f = NULL;
-			png_structp png_ptr = 0;
-			png_infop info_ptr = 0;
-		
-			try {
-				f = fopen(outputPath, "wb");
-				if (f == NULL) throw std::runtime_error("Could not open output PNG file");
-
-				png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, 0, myPNGErrorFunction, 0);
-				if (png_ptr == 0) throw std::runtime_error("Error writing PNG image : could not initialize");
-
-				info_ptr = png_create_info_struct(png_ptr);
-				if (info_ptr == 0) throw std::runtime_error("Error writing PNG image : could not initialize");
-
-				png_set_compression_level(png_ptr, compressionLevel);
-				if (fast) png_set_filter(png_ptr, PNG_FILTER_TYPE_BASE, PNG_FILTER_NONE);
-				png_init_io(png_ptr, f);
-
-				png_set_IHDR(png_ptr, info_ptr, bounds.width, bounds.height, 8, PNG_COLOR_TYPE_RGB_ALPHA
-						, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
-				
-				png_set_sRGB_gAMA_and_cHRM(png_ptr, info_ptr, PNG_sRGB_INTENT_ABSOLUTE);
-
-				png_set_oFFs(png_ptr, info_ptr, bounds.left, bounds.top, PNG_OFFSET_PIXEL);
-
-				png_set_rows(png_ptr, info_ptr, &rowPointers[0]);
-
-				png_write_png(png_ptr, info_ptr, (isLittleEndian() ? PNG_TRANSFORM_BGR : PNG_TRANSFORM_SWAP_ALPHA), NULL);
-
-				png_destroy_write_struct(&png_ptr, &info_ptr);
-				fclose(f);
-				f = NULL;
+		if (frameCount > 0) {
+			/*
+				Renders the document frameCount times with the variable `time` counting seconds from 0. Each frame is
+				written to the output path with the frame number inserted before the extension (e.g. out0001.png).
+			*/
+			AnimationRendererWithExternalFonts animationRenderer(ivgContents, scale, fonts, images, options, glyphBitmaps);
+			const std::string output(outputPath);
+			std::string::size_type dot = output.find_last_of('.');
+			if (dot == std::string::npos || output.find_first_of("/\\", dot) != std::string::npos) {
+				dot = output.size();
 			}
-			catch (...) {
-				png_destroy_write_struct(&png_ptr, &info_ptr);
-				if (f != NULL) {
-					fclose(f);
-					f = NULL;
-				}
-				throw;
+			for (int frame = 0; frame < frameCount; ++frame) {
+				animationRenderer.renderFrame(frame / frameRate);
+				std::cerr << "Rasterized frame " << frame << "..." << std::endl;
+				char number[16];
+				snprintf(number, sizeof (number), "%04d", frame);
+				const std::string framePath = output.substr(0, dot) + number + output.substr(dot);
+				writePNG(*animationRenderer.accessRaster(), framePath.c_str(), compressionLevel, fast, haveBackground
+						, background);
+			}
+			if (printStats) {
+				printRenderStats(renderStats, std::chrono::duration<double>(std::chrono::steady_clock::now()
+						- startTime).count());
+			}
+			if (memoryBudget.get() != 0) {
+				std::cerr << "Peak memory: " << memoryBudget->getPeakBytes() << " bytes" << std::endl;
 			}
+			return 0;
 		}
-		std::cerr << "Written to PNG." << std::endl;
+		std::unique_ptr<ThreadPool> fillPool;
+		std::unique_ptr<SelfContainedARGB32Canvas> canvas;
+		SelfContainedRaster<ARGB32>* raster = 0;
+		if (threadCount >= 0) {
+			tiledRenderer.render(ivgContents, scale);
+			raster = tiledRenderer.accessRaster();
+		} else {
+			canvas.reset(haveViewport ? new SelfContainedARGB32Canvas(viewport, scale) : new SelfContainedARGB32Canvas(scale));
+			if (fillThreadCount >= 0) {
+				fillPool.reset(new ThreadPool(fillThreadCount));
+				canvas->setThreadPool(fillPool.get());
+			}
+			canvas->setMemoryBudget(memoryBudget.get());
+			{
+				std::unique_ptr<PipelinedCanvas> pipelinedCanvas(pipeline ? new PipelinedCanvas(*canvas) : 0);
+				Canvas& executorCanvas = (pipeline ? static_cast<Canvas&>(*pipelinedCanvas) : *canvas);
+				STLMapVariables topVars;
+				IVGExecutorWithExternalFonts ivgExecutor(executorCanvas, fonts, images, AffineTransformation().scale(scale), options
+						, glyphBitmaps);
+				FormatInfo formatInfo;
+				Interpreter impd(ivgExecutor, topVars, formatInfo);
+				impd.run(ivgContents);
+				executorCanvas.sync();
+			}
+			raster = canvas->accessRaster();
+		}
+		std::cerr << "Rasterized image..." << std::endl;
+		if (printStats) {
+			printRenderStats(renderStats, std::chrono::duration<double>(std::chrono::steady_clock::now()
+					- startTime).count());
+		}
+		if (memoryBudget.get() != 0) {
+			std::cerr << "Peak memory: " << memoryBudget->getPeakBytes() << " bytes" << std::endl;
+		}
+
+		if (raster == 0) throw std::runtime_error("IVG image is empty");
+		writePNG(*raster, outputPath, compressionLevel, fast, haveBackground, background);
 	}
 	catch (const IMPD::Exception& x) {
 		std::cerr << "Exception: " << x.what() << std::endl;
@@ -29,7 +29,7 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 using namespace NuXPixels;
 
-static void renderRect(const PolygonMask& mask, const IntRect& rect, SelfContainedRaster<Mask8>& dest)
+static void renderRect(const Renderer<Mask8>& mask, const IntRect& rect, SelfContainedRaster<Mask8>& dest)
 {
 Mask8::Pixel* pixels = dest.getPixelPointer();
 	int stride = dest.getStride();
@@ -76,6 +76,23 @@ return false;
 return true;
 }
 
+static int calcWinding(const Path& path, double x, double y)
+{
+	int winding = 0;
+	Vertex lv(0.0, 0.0);
+	for (Path::const_iterator it = path.begin(); it != path.end(); ++it) {
+		const Vertex v = it->second;
+		if (it->first != Path::MOVE && (lv.y <= y) != (v.y <= y)) {
+			const double crossX = lv.x + (v.x - lv.x) * (y - lv.y) / (v.y - lv.y);
+			if (crossX < x) {
+				winding += (v.y > lv.y ? 1 : -1);
+			}
+		}
+		lv = v;
+	}
+	return winding;
+}
+
 int main()
 {
 	Path path;
@@ -160,6 +177,190 @@ renderRect(mask, topRight, silly);
 			return 1;
 }
 
+	// RectMask must match PolygonMask exactly, for both winding directions, with and without clipping.
+	IntRect rectArea(0, 0, 64, 64);
+	unsigned int seed = 1;
+	for (int i = 0; i < 2000; ++i) {
+		double v[4];
+		for (int j = 0; j < 4; ++j) {
+			seed = seed * 1664525 + 1013904223;
+			v[j] = static_cast<double>(seed >> 8) / (1 << 24) * 70.0 - 3.0;
+		}
+		Path rectPath;
+		if ((i & 1) == 0) {
+			rectPath.addRect(v[0], v[1], v[2] * 0.5, v[3] * 0.5);
+		} else {
+			rectPath.moveTo(v[0], v[1]).lineTo(v[0], v[3]).lineTo(v[2], v[3]).lineTo(v[2], v[1]);
+		}
+		rectPath.closeAll();
+		if (!RectMask::isRect(rectPath)) {
+			continue;
+		}
+		const IntRect rectClip = ((i & 2) == 0 ? rectArea : IntRect(7, 5, 40, 33));
+		SelfContainedRaster<Mask8> polygonRaster(rectArea);
+		SelfContainedRaster<Mask8> rectRaster(rectArea);
+		renderRect(PolygonMask(rectPath, rectClip, PolygonMask::evenOddFillRule), rectArea, polygonRaster);
+		renderRect(RectMask(rectPath, rectClip), rectArea, rectRaster);
+		if (!equals(polygonRaster, rectRaster, rectArea, "rect mask")) {
+			std::cerr << "rect mask mismatch at iteration " << i << "\n";
+			return 1;
+		}
+	}
+	Path notRect;
+	notRect.moveTo(10, 10).lineTo(10, 20).lineTo(20, 20).lineTo(20, 15).lineTo(20, 10).closeAll();
+	Path twice;
+	twice.addRect(10, 10, 10, 10).addRect(10, 10, 10, 10);
+	if (RectMask::isRect(notRect) || RectMask::isRect(twice) || RectMask::isRect(path)) {
+		std::cerr << "RectMask::isRect accepted a non-rectangle\n";
+		return 1;
+	}
+
+	// RoundedRectMask should agree with a finely flattened polygon (PolygonMask is off by a few levels on curves).
+	IntRect roundedArea(0, 0, 80, 60);
+	Path rounded;
+	rounded.addRoundedRect(3.3, 4.7, 70.1, 50.2, 20.5, 11.25, 64.0);
+	rounded.addEllipse(40.0, 30.0, 9.7, 15.1, 64.0);
+	rounded.closeAll();
+	SelfContainedRaster<Mask8> flattenedRaster(roundedArea);
+	renderRect(PolygonMask(rounded, roundedArea, PolygonMask::evenOddFillRule), roundedArea, flattenedRaster);
+	SelfContainedRaster<Mask8> analyticRaster(roundedArea);
+	renderRect(RoundedRectMask(3.3, 4.7, 70.1, 50.2, 20.5, 11.25, roundedArea), roundedArea, analyticRaster);
+	SelfContainedRaster<Mask8> ellipseRaster(roundedArea);
+	renderRect(RoundedRectMask(40.0 - 9.7, 30.0 - 15.1, 9.7 * 2, 15.1 * 2, 9.7, 15.1, roundedArea), roundedArea
+			, ellipseRaster);
+	for (int y = roundedArea.top; y < roundedArea.calcBottom(); ++y) {
+		for (int x = roundedArea.left; x < roundedArea.calcRight(); ++x) {
+			const int expected = flattenedRaster.getPixelPointer()[y * flattenedRaster.getStride() + x];
+			const int actual = analyticRaster.getPixelPointer()[y * analyticRaster.getStride() + x]
+					- ellipseRaster.getPixelPointer()[y * ellipseRaster.getStride() + x];
+			if (abs(expected - actual) > 5) {
+				std::cerr << "rounded rect mask mismatch at (" << x << "," << y << ") polygon=" << expected
+						<< " analytic=" << actual << "\n";
+				return 1;
+			}
+		}
+	}
+
+	// Path::clampToRect folds geometry outside the rect onto its border without changing the winding number of any
+	// point inside it.
+	for (int i = 0; i < 200; ++i) {
+		Path star;
+		for (int j = 0; j < 3 + i % 10; ++j) {
+			double v[2];
+			for (int k = 0; k < 2; ++k) {
+				seed = seed * 1664525 + 1013904223;
+				v[k] = static_cast<double>(seed >> 8) / (1 << 24) * 400.0 - 180.0;
+			}
+			if (j == 0) {
+				star.moveTo(v[0], v[1]);
+			} else {
+				star.lineTo(v[0], v[1]);
+			}
+		}
+		star.closeAll();
+		Path clamped(star);
+		clamped.clampToRect(Rect<double>(-2.0, -2.0, 52.0, 44.0));
+		const Rect<double> clampedBounds = clamped.calcFloatBounds();
+		if (clampedBounds.left < -2.0 || clampedBounds.top < -2.0 || clampedBounds.calcRight() > 50.0
+				|| clampedBounds.calcBottom() > 42.0) {
+			std::cerr << "clamped path outside rect at iteration " << i << "\n";
+			return 1;
+		}
+		for (int j = 0; j < 500; ++j) {
+			double v[2];
+			for (int k = 0; k < 2; ++k) {
+				seed = seed * 1664525 + 1013904223;
+				v[k] = static_cast<double>(seed >> 8) / (1 << 24) * (k == 0 ? 51.0 : 43.0) - 1.5;
+			}
+			if (calcWinding(star, v[0], v[1]) != calcWinding(clamped, v[0], v[1])) {
+				std::cerr << "clamped path winding mismatch at iteration " << i << "\n";
+				return 1;
+			}
+		}
+	}
+
+	// Without antialiasing every pixel is fully covered if its center is inside the path (by the fill rule) and empty
+	// otherwise. Centers closer to an edge than the fixed point precision may go either way.
+	for (int i = 0; i < 200; ++i) {
+		Path polygon;
+		for (int j = 0; j < 3 + i % 10; ++j) {
+			double v[2];
+			for (int k = 0; k < 2; ++k) {
+				seed = seed * 1664525 + 1013904223;
+				v[k] = floor((static_cast<double>(seed >> 8) / (1 << 24) * 100.0 - 20.0) * 256.0) / 256.0;
+			}
+			if (j == 0) {
+				polygon.moveTo(v[0], v[1]);
+			} else {
+				polygon.lineTo(v[0], v[1]);
+			}
+		}
+		polygon.closeAll();
+		const bool evenOdd = ((i & 1) != 0);
+		const IntRect aliasedArea(0, 0, 60, 50);
+		const IntRect aliasedClip = ((i & 2) == 0 ? aliasedArea : IntRect(7, 5, 40, 33));
+		SelfContainedRaster<Mask8> aliasedRaster(aliasedArea);
+		const FillRule& fillRule = (evenOdd ? static_cast<const FillRule&>(PolygonMask::evenOddFillRule)
+				: static_cast<const FillRule&>(PolygonMask::nonZeroFillRule));
+		renderRect(PolygonMask(polygon, aliasedClip, fillRule, 0, false), aliasedArea, aliasedRaster);
+		for (int y = aliasedArea.top; y < aliasedArea.calcBottom(); ++y) {
+			for (int x = aliasedArea.left; x < aliasedArea.calcRight(); ++x) {
+				const int winding = calcWinding(polygon, x + 0.5, y + 0.5);
+				if (calcWinding(polygon, x + 0.49, y + 0.5) != winding || calcWinding(polygon, x + 0.51, y + 0.5) != winding
+						|| calcWinding(polygon, x + 0.5, y + 0.49) != winding
+						|| calcWinding(polygon, x + 0.5, y + 0.51) != winding) {
+					continue;
+				}
+				const bool inside = (evenOdd ? (winding & 1) != 0 : winding != 0) && x >= aliasedClip.left
+						&& x < aliasedClip.calcRight() && y >= aliasedClip.top && y < aliasedClip.calcBottom();
+				const int actual = aliasedRaster.getPixelPointer()[y * aliasedRaster.getStride() + x];
+				if (actual != (inside ? 0xFF : 0x00)) {
+					std::cerr << "aliased mask mismatch at iteration " << i << " (" << x << "," << y << ") expected="
+							<< (inside ? 0xFF : 0x00) << " actual=" << actual << "\n";
+					return 1;
+				}
+			}
+		}
+	}
+
+	// RLERaster tracks the bounds of its non-transparent pixels.
+	RLERaster<Mask8> rle(IntRect(0, 0, 100, 100), PolygonMask(Path().addEllipse(40.0, 30.0, 9.7, 15.1)));
+	if (rle.calcCoverageBounds() != IntRect(30, 14, 20, 32)) {
+		std::cerr << "RLERaster coverage bounds mismatch\n";
+		return 1;
+	}
+	rle = Solid<Mask8>(Mask8::transparent());
+	if (!rle.calcCoverageBounds().isEmpty()) {
+		std::cerr << "RLERaster coverage bounds not empty\n";
+		return 1;
+	}
+
+	// Inverting an RLERaster in place gives the same pixels as filling through ~.
+	{
+		const IntRect area(0, 0, 90, 70);
+		const Path ellipse = Path().addEllipse(40.0, 30.0, 29.7, 25.1);
+		const Path star = Path().addStar(45.0, 35.0, 7, 33.3, 12.1, 0.3);
+		const Solid<Mask8> half(0x80);
+		const SolidRect<Mask8> rect(0xFF, IntRect(20, 10, 50, 40));
+		const SolidRect<Mask8> wide(0xFF, IntRect(0, 20, 90, 20));
+		std::vector< RLERaster<Mask8> > masks;
+		masks.push_back(RLERaster<Mask8>(area, PolygonMask(ellipse, area)));
+		masks.push_back(RLERaster<Mask8>(area, PolygonMask(star, area, PolygonMask::evenOddFillRule)));
+		masks.push_back(RLERaster<Mask8>(area, rect));
+		masks.push_back(RLERaster<Mask8>(area, wide * half));
+		masks.push_back(RLERaster<Mask8>(area, ~PolygonMask(ellipse, area)));
+		masks.push_back(RLERaster<Mask8>(area));
+		SelfContainedRaster<Mask8> expected(area);
+		SelfContainedRaster<Mask8> actual(area);
+		for (size_t i = 0; i < masks.size(); ++i) {
+			RLERaster<Mask8> inverted(masks[i]);
+			inverted.invert();
+			renderRect(~masks[i], area, expected);
+			renderRect(inverted, area, actual);
+			if (!equals(expected, actual, area, "RLERaster invert")) return 1;
+		}
+	}
+
 return 0;
 }
 
@@ -22,13 +22,79 @@ FOR %%f IN (ivg\*.ivg) DO (
 		%exe% --fonts %fonts% "%%f" "%tempDir%\%%~nf.png" || GOTO error
 	)
 	fc "%tempDir%\%%~nf.png" "png\%%~nf.png" || GOTO error
+	REM Multi-threaded rendering in small tiles must give identical output.
+	IF "%%~nf"=="huge" (
+		%exe% --fast --threads 3 --tile-height 37 --fonts %fonts% "%%f" "%tempDir%\%%~nf.png" || GOTO error
+	) ELSE (
+		%exe% --threads 3 --tile-height 37 --fonts %fonts% "%%f" "%tempDir%\%%~nf.png" || GOTO error
+	)
+	fc "%tempDir%\%%~nf.png" "png\%%~nf.png" || GOTO error
+	REM So must filling large blends in parallel bands.
+	IF "%%~nf"=="huge" (
+		%exe% --fast --fill-threads 3 --fonts %fonts% "%%f" "%tempDir%\%%~nf.png" || GOTO error
+	) ELSE (
+		%exe% --fill-threads 3 --fonts %fonts% "%%f" "%tempDir%\%%~nf.png" || GOTO error
+	)
+	fc "%tempDir%\%%~nf.png" "png\%%~nf.png" || GOTO error
+	REM And rasterizing on a separate thread from the interpreter.
+	IF "%%~nf"=="huge" (
+		%exe% --fast --pipeline --fonts %fonts% "%%f" "%tempDir%\%%~nf.png" || GOTO error
+	) ELSE (
+		%exe% --pipeline --fonts %fonts% "%%f" "%tempDir%\%%~nf.png" || GOTO error
+	)
+	fc "%tempDir%\%%~nf.png" "png\%%~nf.png" || GOTO error
+	REM Frames of an animation reuse the definitions of the frame before and must still be identical.
+	IF "%%~nf"=="huge" (
+		%exe% --fast --frames 2 --fonts %fonts% "%%f" "%tempDir%\%%~nf.png" || GOTO error
+	) ELSE (
+		%exe% --frames 2 --fonts %fonts% "%%f" "%tempDir%\%%~nf.png" || GOTO error
+	)
+	fc "%tempDir%\%%~nf0000.png" "png\%%~nf.png" || GOTO error
+	fc "%tempDir%\%%~nf0001.png" "png\%%~nf.png" || GOTO error
 	ECHO.
 	ECHO.
 )
+
+REM Rendering options that change the output are compared with goldens of their own, named <test>-<option>.png.
+CALL :checkOption smallTextTest glyph-bitmaps || GOTO error
+CALL :checkOption imageTest1 adaptive-images || GOTO error
+CALL :checkOption imageTest1 draft || GOTO error
+
+REM A viewport must clamp far geometry against the whole document, so its golden is cut from the full render.
+ECHO Doing farGeometryTest --viewport
+ECHO.
+%exe% --viewport 0,150,50,100 --fonts %fonts% "ivg\farGeometryTest.ivg" "%tempDir%\farGeometryTest.png" || GOTO error
+fc "%tempDir%\farGeometryTest.png" "png\farGeometryTest-viewport.png" || GOTO error
+ECHO.
+ECHO.
+
+REM A memory limit must reject a document that needs more (decoded images included) and not change the output of one
+REM that fits.
+ECHO Doing externalImageTest --memory-limit
+ECHO.
+%exe% --memory-limit 3 --fonts %fonts% "ivg\externalImageTest.ivg" "%tempDir%\externalImageTest.png" && (
+	ECHO Memory limit was not enforced
+	GOTO error
+)
+%exe% --memory-limit 16 --fonts %fonts% "ivg\externalImageTest.ivg" "%tempDir%\externalImageTest.png" || GOTO error
+fc "%tempDir%\externalImageTest.png" "png\externalImageTest.png" || GOTO error
+ECHO.
+ECHO.
+
 DEL /q %tempDir%\*.png
 RMDIR %tempDir%
 
 EXIT /b 0
+
+:checkOption
+ECHO Doing %1 --%2
+ECHO.
+%exe% --%2 --fonts %fonts% "ivg\%1.ivg" "%tempDir%\%1.png" || EXIT /b 1
+fc "%tempDir%\%1.png" "png\%1-%2.png" || EXIT /b 1
+ECHO.
+ECHO.
+EXIT /b 0
+
 :error
 ECHO Error %ERRORLEVEL%
 EXIT /b %ERRORLEVEL%
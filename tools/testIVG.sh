@@ -23,8 +23,52 @@ for f in ./ivg/*.ivg; do
 	fi
 	$EXE $args --fonts "$FONTS" "$f" "$tmp/$n.png"
 	cmp "$tmp/$n.png" "./png/$n.png"
+	# Multi-threaded rendering in small tiles must give identical output.
+	$EXE $args --threads 3 --tile-height 37 --fonts "$FONTS" "$f" "$tmp/$n.png"
+	cmp "$tmp/$n.png" "./png/$n.png"
+	# So must filling large blends in parallel bands.
+	$EXE $args --fill-threads 3 --fonts "$FONTS" "$f" "$tmp/$n.png"
+	cmp "$tmp/$n.png" "./png/$n.png"
+	# And rasterizing on a separate thread from the interpreter.
+	$EXE $args --pipeline --fonts "$FONTS" "$f" "$tmp/$n.png"
+	cmp "$tmp/$n.png" "./png/$n.png"
+	# Frames of an animation reuse the definitions of the frame before and must still be identical.
+	$EXE $args --frames 2 --fonts "$FONTS" "$f" "$tmp/$n.png"
+	cmp "$tmp/${n}0000.png" "./png/$n.png"
+	cmp "$tmp/${n}0001.png" "./png/$n.png"
 	echo
 	echo
 done
+
+# Rendering options that change the output are compared with goldens of their own, named <test>-<option>.png.
+checkOption() {
+	n=$1
+	shift
+	echo Doing "$n" "$@"
+	echo
+	$EXE "$@" --fonts "$FONTS" "./ivg/$n.ivg" "$tmp/$n.png"
+	cmp "$tmp/$n.png" "./png/$n-${1#--}.png"
+	echo
+	echo
+}
+checkOption smallTextTest --glyph-bitmaps
+checkOption imageTest1 --adaptive-images
+checkOption imageTest1 --draft
+# A viewport must clamp far geometry against the whole document, so its golden is cut from the full render.
+checkOption farGeometryTest --viewport 0,150,50,100
+
+# A memory limit must reject a document that needs more (decoded images included) and not change the output of one
+# that fits.
+echo Doing externalImageTest --memory-limit
+echo
+if $EXE --memory-limit 3 --fonts "$FONTS" ./ivg/externalImageTest.ivg "$tmp/externalImageTest.png"; then
+	echo "Memory limit was not enforced"
+	exit 1
+fi
+$EXE --memory-limit 16 --fonts "$FONTS" ./ivg/externalImageTest.ivg "$tmp/externalImageTest.png"
+cmp "$tmp/externalImageTest.png" ./png/externalImageTest.png
+echo
+echo
+
 rm -rf "$tmp"/*.png
 rmdir "$tmp"
@@ -20,6 +20,11 @@ FOR %%f IN (ivg\*.ivg) DO (
 	ECHO.
 	ECHO.
 )
+
+REM Goldens of rendering options that change the output (see testIVG.cmd).
+%exe% --glyph-bitmaps --fonts %fonts% "ivg\smallTextTest.ivg" "png\smallTextTest-glyph-bitmaps.png" || GOTO BAD
+%exe% --adaptive-images --fonts %fonts% "ivg\imageTest1.ivg" "png\imageTest1-adaptive-images.png" || GOTO BAD
+%exe% --draft --fonts %fonts% "ivg\imageTest1.ivg" "png\imageTest1-draft.png" || GOTO BAD
 GOTO END
 
 :BAD
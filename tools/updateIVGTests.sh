@@ -19,3 +19,7 @@ for f in ivg/*.ivg; do
 	echo
 done
 
+# Goldens of rendering options that change the output (see testIVG.sh).
+"$EXE" --glyph-bitmaps --fonts "$FONTS" ivg/smallTextTest.ivg png/smallTextTest-glyph-bitmaps.png
+"$EXE" --adaptive-images --fonts "$FONTS" ivg/imageTest1.ivg png/imageTest1-adaptive-images.png
+"$EXE" --draft --fonts "$FONTS" ivg/imageTest1.ivg png/imageTest1-draft.png